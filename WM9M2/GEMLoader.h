@@ -29,10 +29,271 @@ SOFTWARE.
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <cstring>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 namespace GEMLoader
 {
 
+	// Read-only view of elements owned elsewhere: a vector, or a mapped file. Spans handed out by
+	// the mapped loader and visit() (and GEMClipView's) point wherever the data sits in the file, so
+	// they need not be aligned for T. Dereferencing those (operator[], begin/end) is x86/x64-only,
+	// where MSVC, gcc and clang read misaligned floats and ints; portable code copies elements out
+	// with read() or memcpy from data(). Spans over vectors are always aligned, as is GEMPack.
+	template<typename T>
+	class GEMSpan
+	{
+	public:
+		GEMSpan() = default;
+		GEMSpan(const T* first, size_t n) : ptr(first), count(n) {}
+		GEMSpan(const std::vector<T>& v) : ptr(v.empty() ? nullptr : &v[0]), count(v.size()) {}
+		const T* data() const { return ptr; }
+		size_t size() const { return count; }
+		bool empty() const { return count == 0; }
+		const T& operator[](size_t i) const { return ptr[i]; }
+		T read(size_t i) const
+		{
+			T value;
+			memcpy(&value, reinterpret_cast<const char*>(ptr) + i * sizeof(T), sizeof(T));
+			return value;
+		}
+		const T* begin() const { return ptr; }
+		const T* end() const { return ptr + count; }
+	private:
+		const T* ptr = nullptr;
+		size_t count = 0;
+	};
+
+	// Whole file mapped read-only. Meshes loaded through it point into the mapping, so it has to
+	// outlive them.
+	class GEMMappedFile
+	{
+	public:
+		GEMMappedFile() = default;
+		GEMMappedFile(const GEMMappedFile&) = delete;
+		GEMMappedFile& operator=(const GEMMappedFile&) = delete;
+		~GEMMappedFile()
+		{
+			close();
+		}
+		bool open(const std::string& filename)
+		{
+			close();
+#ifdef _WIN32
+			file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+			if (file == INVALID_HANDLE_VALUE) return false;
+			LARGE_INTEGER fileSize;
+			if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0)
+			{
+				close();
+				return false;
+			}
+			mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+			if (mapping == NULL)
+			{
+				close();
+				return false;
+			}
+			view = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+			if (view == nullptr)
+			{
+				close();
+				return false;
+			}
+			bytes = (size_t)fileSize.QuadPart;
+#else
+			int fd = ::open(filename.c_str(), O_RDONLY);
+			if (fd < 0) return false;
+			struct stat info;
+			if (fstat(fd, &info) != 0 || info.st_size == 0)
+			{
+				::close(fd);
+				return false;
+			}
+			void* p = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			::close(fd);
+			if (p == MAP_FAILED) return false;
+			view = static_cast<const char*>(p);
+			bytes = (size_t)info.st_size;
+#endif
+			return true;
+		}
+		void close()
+		{
+#ifdef _WIN32
+			if (view) UnmapViewOfFile(view);
+			if (mapping != NULL) CloseHandle(mapping);
+			if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+			mapping = NULL;
+			file = INVALID_HANDLE_VALUE;
+#else
+			if (view) munmap(const_cast<char*>(view), bytes);
+#endif
+			view = nullptr;
+			bytes = 0;
+		}
+		const char* data() const
+		{
+			return view;
+		}
+		size_t size() const
+		{
+			return bytes;
+		}
+	private:
+		const char* view = nullptr;
+		size_t bytes = 0;
+#ifdef _WIN32
+		HANDLE file = INVALID_HANDLE_VALUE;
+		HANDLE mapping = NULL;
+#endif
+	};
+
+	// Cursor over a mapped file. Reading past the end marks it failed and yields zeros or empty
+	// spans instead of touching memory outside the mapping.
+	class GEMMemoryReader
+	{
+	public:
+		GEMMemoryReader(const char* data, size_t size) : cursor(data), end(data + size) {}
+		bool failed = false;
+		void read(void* out, size_t n)
+		{
+			if ((size_t)(end - cursor) < n)
+			{
+				fail();
+				memset(out, 0, n);
+				return;
+			}
+			memcpy(out, cursor, n);
+			cursor += n;
+		}
+		size_t remaining() const
+		{
+			return (size_t)(end - cursor);
+		}
+		// n bytes in place, or null if fewer are left
+		const char* readBytes(size_t n)
+		{
+			if ((size_t)(end - cursor) < n)
+			{
+				fail();
+				return nullptr;
+			}
+			const char* bytes = cursor;
+			cursor += n;
+			return bytes;
+		}
+		// n elements in place, aligned only as the file happens to place them (see GEMSpan)
+		template<typename T>
+		GEMSpan<T> readArray(unsigned int n)
+		{
+			if (n > (size_t)(end - cursor) / sizeof(T))
+			{
+				fail();
+				return GEMSpan<T>();
+			}
+			GEMSpan<T> span(reinterpret_cast<const T*>(cursor), n);
+			cursor += (size_t)n * sizeof(T);
+			return span;
+		}
+	private:
+		const char* cursor;
+		const char* end;
+		void fail()
+		{
+			failed = true;
+			cursor = end;
+		}
+	};
+
+	// Why a .gem file was rejected
+	enum GEMError
+	{
+		GEM_OK = 0,
+		GEM_CANNOT_OPEN,    // missing or unreadable
+		GEM_BAD_MAGIC,      // not a GEM file
+		GEM_TRUNCATED,      // a count or length runs past the end of the file
+		GEM_BAD_INDEX,      // a vertex index past its mesh, or a bone parent past the skeleton
+		GEM_BAD_VALUE       // a negative length or frame count, frames with no bones, or an unknown model type
+	};
+
+	inline const char* gemErrorString(GEMError error)
+	{
+		switch (error)
+		{
+		case GEM_OK: return "ok";
+		case GEM_CANNOT_OPEN: return "cannot be opened";
+		case GEM_BAD_MAGIC: return "is not a GE Model File";
+		case GEM_TRUNCATED: return "is truncated or has a count larger than the file";
+		case GEM_BAD_INDEX: return "has an index out of range";
+		case GEM_BAD_VALUE: return "has an invalid length, frame count or model type";
+		}
+		return "unknown error";
+	}
+
+	// The stream counterpart of GEMMemoryReader. It knows the file size, so a count can be checked
+	// with fits() before anything is allocated for it; reading past the end marks it failed and
+	// yields zeros.
+	class GEMStreamReader
+	{
+	public:
+		bool failed = false;
+		GEMError error = GEM_OK;  // the first failure
+		bool open(const std::string& filename)
+		{
+			file.open(filename, std::ios::binary | std::ios::ate);
+			if (!file) return false;
+			left = (size_t)file.tellg();
+			file.seekg(0);
+			return true;
+		}
+		void read(void* out, size_t n)
+		{
+			if (left < n || !file.read(static_cast<char*>(out), (std::streamsize)n))
+			{
+				fail(GEM_TRUNCATED);
+				memset(out, 0, n);
+				return;
+			}
+			left -= n;
+		}
+		size_t remaining() const
+		{
+			return left;
+		}
+		// Whether count elements of elementSize bytes are left; fails the reader if not
+		bool fits(size_t count, size_t elementSize)
+		{
+			if (failed) return false;
+			if (count > left / elementSize)
+			{
+				fail(GEM_TRUNCATED);
+				return false;
+			}
+			return true;
+		}
+		void fail(GEMError why)
+		{
+			if (!failed) error = why;
+			failed = true;
+			left = 0;
+		}
+	private:
+		std::ifstream file;
+		size_t left = 0;
+	};
+
 	class GEMMaterialProperty
 	{
 	public:
@@ -102,7 +363,7 @@ namespace GEMLoader
 	{
 	public:
 		std::vector<GEMMaterialProperty> properties;
-		GEMMaterialProperty find(std::string name)
+		GEMMaterialProperty find(std::string name) const
 		{
 			for (int i = 0; i < properties.size(); i++)
 			{
@@ -152,9 +413,26 @@ namespace GEMLoader
 		std::vector<GEMStaticVertex> verticesStatic;
 		std::vector<GEMAnimatedVertex> verticesAnimated;
 		std::vector<unsigned int> indices;
+		// Filled instead of the vectors by the mapped loader; they point into a GEMMappedFile
+		GEMSpan<GEMStaticVertex> mappedStatic;
+		GEMSpan<GEMAnimatedVertex> mappedAnimated;
+		GEMSpan<unsigned int> mappedIndices;
 		bool isAnimated()
 		{
-			return verticesAnimated.size() > 0;
+			return verticesAnimated.size() > 0 || mappedAnimated.size() > 0;
+		}
+		// Whichever storage the loader used
+		GEMSpan<GEMStaticVertex> staticVertices() const
+		{
+			return verticesStatic.empty() ? mappedStatic : GEMSpan<GEMStaticVertex>(verticesStatic);
+		}
+		GEMSpan<GEMAnimatedVertex> animatedVertices() const
+		{
+			return verticesAnimated.empty() ? mappedAnimated : GEMSpan<GEMAnimatedVertex>(verticesAnimated);
+		}
+		GEMSpan<unsigned int> indexSpan() const
+		{
+			return indices.empty() ? mappedIndices : GEMSpan<unsigned int>(indices);
 		}
 	};
 
@@ -199,198 +477,630 @@ namespace GEMLoader
 		GEMMatrix globalInverse;
 	};
 
+	// One mesh as handed to a visitor
+	struct GEMMeshView
+	{
+		GEMSpan<GEMStaticVertex> staticVertices;      // static models
+		GEMSpan<GEMAnimatedVertex> animatedVertices;  // animated models
+		GEMSpan<unsigned int> indices;
+	};
+
+	// One clip as handed to a visitor, keys as stored in the file: for each frame, boneCount
+	// positions, then rotations, then scales
+	struct GEMClipView
+	{
+		std::string name;
+		int frameCount = 0;
+		int boneCount = 0;
+		float ticksPerSecond = 0.0f;
+		const char* data = nullptr;
+
+		GEMSpan<GEMVec3> positions(int frame) const
+		{
+			return GEMSpan<GEMVec3>(reinterpret_cast<const GEMVec3*>(data + frame * frameBytes()), boneCount);
+		}
+		GEMSpan<GEMQuaternion> rotations(int frame) const
+		{
+			return GEMSpan<GEMQuaternion>(reinterpret_cast<const GEMQuaternion*>(data + frame * frameBytes() + boneCount * sizeof(GEMVec3)), boneCount);
+		}
+		GEMSpan<GEMVec3> scales(int frame) const
+		{
+			return GEMSpan<GEMVec3>(reinterpret_cast<const GEMVec3*>(data + frame * frameBytes() + boneCount * (sizeof(GEMVec3) + sizeof(GEMQuaternion))), boneCount);
+		}
+		size_t frameBytes() const
+		{
+			return (size_t)boneCount * (2 * sizeof(GEMVec3) + sizeof(GEMQuaternion));
+		}
+	};
+
+	// Callbacks for GEMModelLoader::visit, in file order. Derive from this and hide the ones you
+	// need; the rest do nothing. Spans are only valid during the call.
+	struct GEMVisitor
+	{
+		void begin(unsigned int /*isAnimated*/, unsigned int /*meshCount*/) {}
+		void mesh(unsigned int /*index*/, const GEMMaterial& /*material*/, const GEMMeshView& /*mesh*/) {}
+		void skeleton(const std::vector<GEMBone>& /*bones*/, const GEMMatrix& /*globalInverse*/) {}
+		void clip(unsigned int /*index*/, const GEMClipView& /*clip*/) {}
+	};
+
 	class GEMModelLoader
 	{
 	private:
-		GEMMaterialProperty loadProperty(std::ifstream& file)
+		// The current mesh's vertices (or clip's keys) and indices while visiting a stream; reused
+		std::vector<char> scratch;
+		std::vector<char> indexScratch;
+
+		// Grows without copying: the old contents are about to be overwritten, and keeping them
+		// alive while the new block is filled would double the peak
+		static char* scratchBytes(std::vector<char>& buffer, size_t n)
+		{
+			if (buffer.size() < n)
+			{
+				std::vector<char>().swap(buffer);
+				buffer.resize(n);
+			}
+			return buffer.data();
+		}
+		// Four running maxima keep the loop from waiting on one compare chain; this is most of what
+		// validation costs. Indices in a mapped file need not be aligned, hence the copies.
+		static bool indicesInRange(const void* data, size_t n, unsigned int vertexCount)
+		{
+			const char* indices = static_cast<const char*>(data);
+			unsigned int largest[4] = { 0, 0, 0, 0 };
+			size_t i = 0;
+			for (; i + 4 <= n; i += 4)
+			{
+				unsigned int index[4];
+				memcpy(index, indices + i * sizeof(unsigned int), sizeof(index));
+				for (int k = 0; k < 4; k++)
+				{
+					largest[k] = index[k] > largest[k] ? index[k] : largest[k];
+				}
+			}
+			for (; i < n; i++)
+			{
+				unsigned int index;
+				memcpy(&index, indices + i * sizeof(unsigned int), sizeof(index));
+				largest[0] = index > largest[0] ? index : largest[0];
+			}
+			largest[0] = largest[1] > largest[0] ? largest[1] : largest[0];
+			largest[2] = largest[3] > largest[2] ? largest[3] : largest[2];
+			return n == 0 || (largest[0] > largest[2] ? largest[0] : largest[2]) < vertexCount;
+		}
+		static bool parentsInRange(const std::vector<GEMBone>& bones)
+		{
+			for (size_t i = 0; i < bones.size(); i++)
+			{
+				if (bones[i].parentIndex < -1 || bones[i].parentIndex >= (int)bones.size()) return false;
+			}
+			return true;
+		}
+		// Sizes the vector once and fills it with a single read. The count is checked against the
+		// bytes left first, so a corrupt one fails instead of allocating.
+		template<typename T>
+		void loadArray(GEMStreamReader& file, std::vector<T>& values, unsigned int n)
+		{
+			if (!file.fits(n, sizeof(T))) return;
+			values.resize(n);
+			file.read(values.data(), (size_t)n * sizeof(T));
+		}
+		void loadMesh(GEMStreamReader& file, GEMMesh& mesh, int isAnimated)
+		{
+			unsigned int n = 0;
+			file.read(&n, sizeof(unsigned int));
+			// Each property takes at least its two length fields
+			if (!file.fits(n, 2 * sizeof(int))) return;
+			mesh.material.properties.reserve(n);
+			for (unsigned int i = 0; i < n && !file.failed; i++)
+			{
+				mesh.material.properties.emplace_back();
+				GEMMaterialProperty& prop = mesh.material.properties.back();
+				prop.name = loadString(file);
+				prop.value = loadString(file);
+			}
+			unsigned int vertexCount = 0;
+			file.read(&vertexCount, sizeof(unsigned int));
+			if (isAnimated == 0)
+			{
+				loadArray(file, mesh.verticesStatic, vertexCount);
+			} else
+			{
+				loadArray(file, mesh.verticesAnimated, vertexCount);
+			}
+			file.read(&n, sizeof(unsigned int));
+			loadArray(file, mesh.indices, n);
+			if (!file.failed && !indicesInRange(mesh.indices.data(), mesh.indices.size(), vertexCount)) file.fail(GEM_BAD_INDEX);
+		}
+		// Reads straight into the string, so names short enough for the small-string buffer never
+		// touch the heap
+		std::string loadString(GEMStreamReader& file)
+		{
+			int l = 0;
+			file.read(&l, sizeof(int));
+			if (l < 0) file.fail(GEM_BAD_VALUE);
+			if (l <= 0 || !file.fits((size_t)l, 1)) return std::string();
+			std::string str((size_t)l, '\0');
+			file.read(&str[0], l);
+			// Stops at an embedded zero like a C string
+			str.resize(strnlen(str.c_str(), (size_t)l));
+			return str;
+		}
+		GEMMatrix loadMatrix(GEMStreamReader& file)
+		{
+			GEMMatrix mat;
+			file.read(&mat.m, sizeof(float) * 16);
+			return mat;
+		}
+		void loadFrames(GEMAnimationSequence& aseq, GEMStreamReader& file, int bonesN, int frames)
+		{
+			// Frames with no bones take no bytes, so nothing in the file would bound their count
+			if (frames < 0 || (frames > 0 && bonesN <= 0))
+			{
+				file.fail(GEM_BAD_VALUE);
+				return;
+			}
+			size_t frameBytes = (size_t)bonesN * (2 * sizeof(GEMVec3) + sizeof(GEMQuaternion));
+			if (frames > 0 && !file.fits((size_t)frames, frameBytes)) return;
+			aseq.frames.reserve(frames);
+			for (int i = 0; i < frames && !file.failed; i++)
+			{
+				aseq.frames.emplace_back();
+				GEMAnimationFrame& frame = aseq.frames.back();
+				loadArray(file, frame.positions, bonesN);
+				loadArray(file, frame.rotations, bonesN);
+				loadArray(file, frame.scales, bonesN);
+			}
+		}
+		void loadSkeleton(GEMStreamReader& file, std::vector<GEMBone>& bones, GEMMatrix& globalInverse)
+		{
+			unsigned int bonesN = 0;
+			file.read(&bonesN, sizeof(unsigned int));
+			// A bone takes at least its name length, offset and parent
+			if (!file.fits(bonesN, sizeof(int) * 2 + sizeof(float) * 16)) return;
+			bones.reserve(bonesN);
+			for (unsigned int i = 0; i < bonesN && !file.failed; i++)
+			{
+				bones.emplace_back();
+				GEMBone& bone = bones.back();
+				bone.name = loadString(file);
+				bone.offset = loadMatrix(file);
+				file.read(&bone.parentIndex, sizeof(int));
+			}
+			globalInverse = loadMatrix(file);
+			if (!file.failed && !parentsInRange(bones)) file.fail(GEM_BAD_INDEX);
+		}
+		// Opens the file, checks the magic number and reads the mesh count
+		GEMError openStream(const std::string& filename, GEMStreamReader& file, unsigned int& isAnimated, unsigned int& meshCount)
+		{
+			if (!file.open(filename)) return report(filename, GEM_CANNOT_OPEN);
+			unsigned int n = 0;
+			file.read(&n, sizeof(unsigned int));
+			if (n != 4058972161) return report(filename, GEM_BAD_MAGIC);
+			file.read(&isAnimated, sizeof(unsigned int));
+			file.read(&meshCount, sizeof(unsigned int));
+			if (!file.failed && isAnimated > 1) file.fail(GEM_BAD_VALUE);
+			return report(filename, file.error);
+		}
+		GEMMaterialProperty loadProperty(GEMMemoryReader& file)
 		{
 			GEMMaterialProperty prop;
 			prop.name = loadString(file);
 			prop.value = loadString(file);
 			return prop;
 		}
-		void loadMesh(std::ifstream& file, GEMMesh& mesh, int isAnimated)
+		void loadMesh(GEMMemoryReader& file, GEMMesh& mesh, int isAnimated)
 		{
 			unsigned int n = 0;
-			file.read(reinterpret_cast<char*>(&n), sizeof(unsigned int));
-			for (unsigned int i = 0; i < n; i++)
+			file.read(&n, sizeof(unsigned int));
+			// Each property takes at least its two length fields
+			mesh.material.properties.reserve(file.remaining() / (2 * sizeof(int)) < n ? 0 : n);
+			for (unsigned int i = 0; i < n && !file.failed; i++)
 			{
 				mesh.material.properties.push_back(loadProperty(file));
 			}
+			file.read(&n, sizeof(unsigned int));
 			if (isAnimated == 0)
 			{
-				file.read(reinterpret_cast<char*>(&n), sizeof(unsigned int));
-				for (unsigned int i = 0; i < n; i++)
-				{
-					GEMStaticVertex v;
-					file.read(reinterpret_cast<char*>(&v), sizeof(GEMStaticVertex));
-					mesh.verticesStatic.push_back(v);
-				}
-				file.read(reinterpret_cast<char*>(&n), sizeof(unsigned int));
-				for (unsigned int i = 0; i < n; i++)
-				{
-					unsigned int index = 0;
-					file.read(reinterpret_cast<char*>(&index), sizeof(unsigned int));
-					mesh.indices.push_back(index);
-				}
+				mesh.mappedStatic = file.readArray<GEMStaticVertex>(n);
 			} else
 			{
-				file.read(reinterpret_cast<char*>(&n), sizeof(unsigned int));
-				for (unsigned int i = 0; i < n; i++)
-				{
-					GEMAnimatedVertex v;
-					file.read(reinterpret_cast<char*>(&v), sizeof(GEMAnimatedVertex));
-					mesh.verticesAnimated.push_back(v);
-				}
-				file.read(reinterpret_cast<char*>(&n), sizeof(unsigned int));
-				for (unsigned int i = 0; i < n; i++)
-				{
-					unsigned int index = 0;
-					file.read(reinterpret_cast<char*>(&index), sizeof(unsigned int));
-					mesh.indices.push_back(index);
-				}
+				mesh.mappedAnimated = file.readArray<GEMAnimatedVertex>(n);
 			}
+			file.read(&n, sizeof(unsigned int));
+			mesh.mappedIndices = file.readArray<unsigned int>(n);
 		}
-		std::string loadString(std::ifstream& file)
+		std::string loadString(GEMMemoryReader& file)
 		{
 			int l = 0;
-			file.read(reinterpret_cast<char*>(&l), sizeof(int));
-			char* buffer = new char[l + 1];
-			memset(buffer, 0, l * sizeof(char));
-			file.read(buffer, l * sizeof(char));
-			buffer[l] = 0;
-			std::string str(buffer);
-			delete[] buffer;
-			return str;
+			file.read(&l, sizeof(int));
+			GEMSpan<char> chars = file.readArray<char>(l > 0 ? (unsigned int)l : 0);
+			if (chars.empty()) return std::string();
+			// Stops at an embedded zero like the stream version
+			return std::string(chars.data(), strnlen(chars.data(), chars.size()));
 		}
-		GEMVec3 loadVec3(std::ifstream& file)
+		void loadFrames(GEMAnimationSequence& aseq, GEMMemoryReader& file, int bonesN, int frames)
 		{
-			GEMVec3 v;
-			file.read(reinterpret_cast<char*>(&v), sizeof(GEMVec3));
-			return v;
+			// validate() has rejected these; frames with no bones would not be bounded by the file
+			if (frames <= 0 || bonesN <= 0) return;
+			size_t frameBytes = (size_t)bonesN * (2 * sizeof(GEMVec3) + sizeof(GEMQuaternion));
+			if (file.remaining() / frameBytes >= (size_t)frames)
+			{
+				aseq.frames.reserve(frames);
+			}
+			for (int i = 0; i < frames && !file.failed; i++)
+			{
+				GEMSpan<GEMVec3> positions = file.readArray<GEMVec3>(bonesN);
+				GEMSpan<GEMQuaternion> rotations = file.readArray<GEMQuaternion>(bonesN);
+				GEMSpan<GEMVec3> scales = file.readArray<GEMVec3>(bonesN);
+				aseq.frames.emplace_back();
+				GEMAnimationFrame& frame = aseq.frames.back();
+				copySpan(frame.positions, positions);
+				copySpan(frame.rotations, rotations);
+				copySpan(frame.scales, scales);
+			}
 		}
-		GEMMatrix loadMatrix(std::ifstream& file)
+		// The span may be misaligned, so it is copied as bytes rather than element by element
+		template<typename T>
+		static void copySpan(std::vector<T>& out, const GEMSpan<T>& span)
 		{
-			GEMMatrix mat;
-			file.read(reinterpret_cast<char*>(&mat.m), sizeof(float) * 16);
-			return mat;
+			out.resize(span.size());
+			if (!span.empty()) memcpy(&out[0], span.data(), span.size() * sizeof(T));
 		}
-		GEMQuaternion loadQuaternion(std::ifstream& file)
+		// Maps and validates the file, then reads past the header. The parse that follows cannot
+		// run off the end or meet a count the file does not hold.
+		GEMError openMapped(const std::string& filename, GEMMappedFile& mapping, GEMMemoryReader& file, unsigned int& isAnimated, unsigned int& meshCount)
 		{
-			GEMQuaternion q;
-			file.read(reinterpret_cast<char*>(&q.q), sizeof(float) * 4);
-			return q;
+			if (!mapping.open(filename)) return report(filename, GEM_CANNOT_OPEN);
+			GEMError error = validate(mapping.data(), mapping.size());
+			if (error != GEM_OK)
+			{
+				mapping.close();
+				return report(filename, error);
+			}
+			file = GEMMemoryReader(mapping.data(), mapping.size());
+			unsigned int n = 0;
+			file.read(&n, sizeof(unsigned int));
+			file.read(&isAnimated, sizeof(unsigned int));
+			file.read(&meshCount, sizeof(unsigned int));
+			return GEM_OK;
 		}
-		void loadFrame(GEMAnimationSequence& aseq, std::ifstream& file, int bonesN)
+		void loadMeshes(GEMMemoryReader& file, std::vector<GEMMesh>& meshes, unsigned int isAnimated, unsigned int meshCount)
 		{
-			GEMAnimationFrame frame;
-			for (int i = 0; i < bonesN; i++)
+			// A mesh takes at least its three count fields
+			if (file.remaining() / (3 * sizeof(unsigned int)) >= meshCount)
 			{
-				GEMVec3 p = loadVec3(file);
-				frame.positions.push_back(p);
+				meshes.reserve(meshes.size() + meshCount);
 			}
-			for (int i = 0; i < bonesN; i++)
+			for (unsigned int i = 0; i < meshCount && !file.failed; i++)
 			{
-				GEMQuaternion q = loadQuaternion(file);
-				frame.rotations.push_back(q);
+				meshes.push_back(GEMMesh());
+				loadMesh(file, meshes.back(), isAnimated);
 			}
-			for (int i = 0; i < bonesN; i++)
+		}
+		static GEMError report(const std::string& filename, GEMError error)
+		{
+			if (error != GEM_OK)
 			{
-				GEMVec3 s = loadVec3(file);
-				frame.scales.push_back(s);
+				std::cout << filename << ": " << gemErrorString(error) << std::endl;
 			}
-			aseq.frames.push_back(frame);
+			return error;
 		}
-		void loadFrames(GEMAnimationSequence& aseq, std::ifstream& file, int bonesN, int frames)
+		// Walks one string without copying it
+		static bool skipString(GEMMemoryReader& file)
 		{
-			for (int i = 0; i < frames; i++)
+			int l = 0;
+			file.read(&l, sizeof(int));
+			if (l < 0) return false;
+			file.readBytes((size_t)l);
+			return true;
+		}
+	public:
+		// Checks a whole .gem image without allocating: every count and length against the bytes
+		// left, every index against its mesh's vertex count and every bone parent against the
+		// skeleton. A file that passes can be parsed without further checks.
+		static GEMError validate(const char* data, size_t size)
+		{
+			GEMMemoryReader file(data, size);
+			unsigned int n = 0;
+			unsigned int isAnimated = 0;
+			unsigned int meshCount = 0;
+			file.read(&n, sizeof(unsigned int));
+			if (file.failed || n != 4058972161) return GEM_BAD_MAGIC;
+			file.read(&isAnimated, sizeof(unsigned int));
+			file.read(&meshCount, sizeof(unsigned int));
+			if (file.failed) return GEM_TRUNCATED;
+			if (isAnimated > 1) return GEM_BAD_VALUE;
+			for (unsigned int i = 0; i < meshCount && !file.failed; i++)
+			{
+				file.read(&n, sizeof(unsigned int));
+				for (unsigned int p = 0; p < n && !file.failed; p++)
+				{
+					if (!skipString(file) || !skipString(file)) return GEM_BAD_VALUE;
+				}
+				unsigned int vertexCount = 0;
+				file.read(&vertexCount, sizeof(unsigned int));
+				file.readBytes((size_t)vertexCount * (isAnimated ? sizeof(GEMAnimatedVertex) : sizeof(GEMStaticVertex)));
+				file.read(&n, sizeof(unsigned int));
+				GEMSpan<unsigned int> indices = file.readArray<unsigned int>(n);
+				if (!file.failed && !indicesInRange(indices.data(), indices.size(), vertexCount)) return GEM_BAD_INDEX;
+			}
+			if (file.failed) return GEM_TRUNCATED;
+			if (!isAnimated) return GEM_OK;
+
+			unsigned int bonesN = 0;
+			file.read(&bonesN, sizeof(unsigned int));
+			for (unsigned int i = 0; i < bonesN && !file.failed; i++)
+			{
+				int parentIndex = 0;
+				if (!skipString(file)) return GEM_BAD_VALUE;
+				file.readBytes(sizeof(float) * 16);
+				file.read(&parentIndex, sizeof(int));
+				if (!file.failed && (parentIndex < -1 || parentIndex >= (int)bonesN)) return GEM_BAD_INDEX;
+			}
+			file.readBytes(sizeof(float) * 16);
+			file.read(&n, sizeof(unsigned int));
+			size_t frameBytes = (size_t)bonesN * (2 * sizeof(GEMVec3) + sizeof(GEMQuaternion));
+			for (unsigned int i = 0; i < n && !file.failed; i++)
 			{
-				loadFrame(aseq, file, bonesN);
+				int frames = 0;
+				if (!skipString(file)) return GEM_BAD_VALUE;
+				file.read(&frames, sizeof(int));
+				file.readBytes(sizeof(float));
+				if (frames < 0 || (frames > 0 && bonesN == 0)) return GEM_BAD_VALUE;
+				if (frameBytes > 0 && (size_t)frames > file.remaining() / frameBytes) return GEM_TRUNCATED;
+				file.readBytes((size_t)frames * frameBytes);
 			}
+			return file.failed ? GEM_TRUNCATED : GEM_OK;
 		}
-	public:
+		// False if the file cannot be read or is not a GEM file
 		bool isAnimatedModel(std::string filename)
 		{
-			std::ifstream file(filename, ::std::ios::binary);
+			GEMStreamReader file;
+			unsigned int isAnimated = 0;
+			unsigned int meshCount = 0;
+			return openStream(filename, file, isAnimated, meshCount) == GEM_OK && isAnimated != 0;
+		}
+		// The loaders return GEM_OK or why the file was rejected (also printed). Counts are checked
+		// against the file size before anything is allocated for them; meshes may hold what was read
+		// before the error.
+		GEMError load(std::string filename, std::vector<GEMMesh>& meshes)
+		{
+			GEMStreamReader file;
+			unsigned int isAnimated = 0;
 			unsigned int n = 0;
-			file.read(reinterpret_cast<char*>(&n), sizeof(unsigned int));
-			if (n != 4058972161)
+			GEMError error = openStream(filename, file, isAnimated, n);
+			if (error != GEM_OK) return error;
+			// A mesh takes at least its three count fields
+			if (!file.fits(n, 3 * sizeof(unsigned int))) return report(filename, file.error);
+			meshes.reserve(meshes.size() + n);
+			for (unsigned int i = 0; i < n && !file.failed; i++)
 			{
-				std::cout << filename << " is not a GE Model File" << std::endl;
-				file.close();
-				exit(0);
+				meshes.emplace_back();
+				loadMesh(file, meshes.back(), isAnimated);
 			}
-			unsigned int isAnimated = 0;
-			file.read(reinterpret_cast<char*>(&isAnimated), sizeof(unsigned int));
-			file.close();
-			return isAnimated;
+			return report(filename, file.error);
 		}
-		void load(std::string filename, std::vector<GEMMesh>& meshes)
+		GEMError load(std::string filename, std::vector<GEMMesh>& meshes, GEMAnimation& animation)
 		{
-			std::ifstream file(filename, ::std::ios::binary);
+			GEMStreamReader file;
+			unsigned int isAnimated = 0;
 			unsigned int n = 0;
-			file.read(reinterpret_cast<char*>(&n), sizeof(unsigned int));
-			if (n != 4058972161)
+			GEMError error = openStream(filename, file, isAnimated, n);
+			if (error != GEM_OK) return error;
+			if (!file.fits(n, 3 * sizeof(unsigned int))) return report(filename, file.error);
+			meshes.reserve(meshes.size() + n);
+			for (unsigned int i = 0; i < n && !file.failed; i++)
 			{
-				std::cout << filename << " is not a GE Model File" << std::endl;
-				file.close();
-				exit(0);
+				meshes.emplace_back();
+				loadMesh(file, meshes.back(), isAnimated);
 			}
+			// Static models end after their meshes
+			if (!isAnimated || file.failed) return report(filename, file.error);
+			loadSkeleton(file, animation.bones, animation.globalInverse);
+			// Read animation sequence
+			file.read(&n, sizeof(unsigned int));
+			// A clip takes at least its name length, frame count and tick rate
+			if (!file.fits(n, sizeof(int) * 2 + sizeof(float))) return report(filename, file.error);
+			animation.animations.reserve(n);
+			for (unsigned int i = 0; i < n && !file.failed; i++)
+			{
+				animation.animations.emplace_back();
+				GEMAnimationSequence& aseq = animation.animations.back();
+				aseq.name = loadString(file);
+				int frames = 0;
+				file.read(&frames, sizeof(int));
+				file.read(&aseq.ticksPerSecond, sizeof(float));
+				loadFrames(aseq, file, (int)animation.bones.size(), frames);
+			}
+			return report(filename, file.error);
+		}
+		// Zero-copy versions: vertices and indices stay in the mapping and are reached through
+		// GEMMesh::staticVertices() / animatedVertices() / indexSpan(). Materials, bones and
+		// animation frames are small and still copied. Keep mapping alive while using the meshes.
+		// The file is validated before anything is parsed, so meshes are untouched on error.
+		GEMError load(std::string filename, GEMMappedFile& mapping, std::vector<GEMMesh>& meshes)
+		{
 			unsigned int isAnimated = 0;
-			file.read(reinterpret_cast<char*>(&isAnimated), sizeof(unsigned int));
-			file.read(reinterpret_cast<char*>(&n), sizeof(unsigned int));
+			unsigned int n = 0;
+			GEMMemoryReader file(nullptr, 0);
+			GEMError error = openMapped(filename, mapping, file, isAnimated, n);
+			if (error != GEM_OK) return error;
+			loadMeshes(file, meshes, isAnimated, n);
+			return GEM_OK;
+		}
+		GEMError load(std::string filename, GEMMappedFile& mapping, std::vector<GEMMesh>& meshes, GEMAnimation& animation)
+		{
+			unsigned int isAnimated = 0;
+			unsigned int n = 0;
+			GEMMemoryReader file(nullptr, 0);
+			GEMError error = openMapped(filename, mapping, file, isAnimated, n);
+			if (error != GEM_OK) return error;
+			loadMeshes(file, meshes, isAnimated, n);
+			if (!isAnimated) return GEM_OK;
+			// Read skeleton
+			unsigned int bonesN = 0;
+			file.read(&bonesN, sizeof(unsigned int));
+			animation.bones.reserve(bonesN);
+			for (unsigned int i = 0; i < bonesN; i++)
+			{
+				animation.bones.emplace_back();
+				GEMBone& bone = animation.bones.back();
+				bone.name = loadString(file);
+				file.read(&bone.offset.m, sizeof(float) * 16);
+				file.read(&bone.parentIndex, sizeof(int));
+			}
+			file.read(&animation.globalInverse.m, sizeof(float) * 16);
+			// Read animation sequence
+			file.read(&n, sizeof(unsigned int));
+			animation.animations.reserve(n);
 			for (unsigned int i = 0; i < n; i++)
 			{
-				GEMMesh mesh;
-				loadMesh(file, mesh, isAnimated);
-				meshes.push_back(mesh);
+				animation.animations.emplace_back();
+				GEMAnimationSequence& aseq = animation.animations.back();
+				aseq.name = loadString(file);
+				int frames = 0;
+				file.read(&frames, sizeof(int));
+				file.read(&aseq.ticksPerSecond, sizeof(float));
+				loadFrames(aseq, file, (int)animation.bones.size(), frames);
 			}
-			file.close();
+			return GEM_OK;
 		}
-		void load(std::string filename, std::vector<GEMMesh>& meshes, GEMAnimation& animation)
+		// Streams the file through visitor one mesh and clip at a time. They are read into one
+		// scratch buffer that the loader keeps, so memory stays at the largest of them however big
+		// the file is. Each piece is checked before it is handed over, but the visitor may have
+		// seen earlier ones when an error is returned.
+		template<typename Visitor>
+		GEMError visit(const std::string& filename, Visitor& visitor)
 		{
-			std::ifstream file(filename, ::std::ios::binary);
+			GEMStreamReader file;
+			unsigned int isAnimated = 0;
+			unsigned int meshCount = 0;
+			GEMError error = openStream(filename, file, isAnimated, meshCount);
+			if (error != GEM_OK) return error;
+			visitor.begin(isAnimated, meshCount);
+
+			size_t stride = isAnimated ? sizeof(GEMAnimatedVertex) : sizeof(GEMStaticVertex);
+			GEMMaterial material;
 			unsigned int n = 0;
-			file.read(reinterpret_cast<char*>(&n), sizeof(unsigned int));
-			if (n != 4058972161)
+			for (unsigned int i = 0; i < meshCount && !file.failed; i++)
+			{
+				material.properties.clear();
+				file.read(&n, sizeof(unsigned int));
+				for (unsigned int p = 0; p < n && !file.failed; p++)
+				{
+					material.properties.emplace_back();
+					material.properties.back().name = loadString(file);
+					material.properties.back().value = loadString(file);
+				}
+				unsigned int vertexCount = 0;
+				unsigned int indexCount = 0;
+				file.read(&vertexCount, sizeof(unsigned int));
+				if (!file.fits(vertexCount, stride)) break;
+				const char* vertices = scratchBytes(scratch, (size_t)vertexCount * stride);
+				file.read(scratch.data(), (size_t)vertexCount * stride);
+				file.read(&indexCount, sizeof(unsigned int));
+				if (!file.fits(indexCount, sizeof(unsigned int))) break;
+				const char* indices = scratchBytes(indexScratch, (size_t)indexCount * sizeof(unsigned int));
+				file.read(indexScratch.data(), (size_t)indexCount * sizeof(unsigned int));
+				if (file.failed) break;
+
+				GEMMeshView mesh;
+				if (isAnimated) mesh.animatedVertices = GEMSpan<GEMAnimatedVertex>(reinterpret_cast<const GEMAnimatedVertex*>(vertices), vertexCount);
+				else mesh.staticVertices = GEMSpan<GEMStaticVertex>(reinterpret_cast<const GEMStaticVertex*>(vertices), vertexCount);
+				mesh.indices = GEMSpan<unsigned int>(reinterpret_cast<const unsigned int*>(indices), indexCount);
+				if (!indicesInRange(mesh.indices.data(), indexCount, vertexCount))
+				{
+					file.fail(GEM_BAD_INDEX);
+					break;
+				}
+				visitor.mesh(i, material, mesh);
+			}
+			if (!isAnimated || file.failed) return report(filename, file.error);
+
+			std::vector<GEMBone> bones;
+			GEMMatrix globalInverse;
+			loadSkeleton(file, bones, globalInverse);
+			if (file.failed) return report(filename, file.error);
+			visitor.skeleton(bones, globalInverse);
+
+			GEMClipView clip;
+			clip.boneCount = (int)bones.size();
+			file.read(&n, sizeof(unsigned int));
+			for (unsigned int i = 0; i < n && !file.failed; i++)
 			{
-				std::cout << filename << " is not a GE Model File" << std::endl;
-				exit(0);
+				clip.name = loadString(file);
+				file.read(&clip.frameCount, sizeof(int));
+				file.read(&clip.ticksPerSecond, sizeof(float));
+				if (clip.frameCount < 0 || (clip.frameCount > 0 && clip.boneCount == 0)) file.fail(GEM_BAD_VALUE);
+				if (file.failed || (clip.frameBytes() > 0 && !file.fits((size_t)clip.frameCount, clip.frameBytes()))) break;
+				size_t bytes = (size_t)clip.frameCount * clip.frameBytes();
+				clip.data = scratchBytes(scratch, bytes);
+				file.read(scratch.data(), bytes);
+				if (file.failed) break;
+				visitor.clip(i, clip);
 			}
+			return report(filename, file.error);
+		}
+		// The same over a mapping: spans point into it instead of a scratch buffer, so nothing is
+		// copied and they stay valid for as long as mapping is open. The file is validated first, so
+		// the visitor sees all of it or nothing.
+		template<typename Visitor>
+		GEMError visit(const std::string& filename, GEMMappedFile& mapping, Visitor& visitor)
+		{
 			unsigned int isAnimated = 0;
-			file.read(reinterpret_cast<char*>(&isAnimated), sizeof(unsigned int));
-			file.read(reinterpret_cast<char*>(&n), sizeof(unsigned int));
-			for (unsigned int i = 0; i < n; i++)
+			unsigned int meshCount = 0;
+			GEMMemoryReader file(nullptr, 0);
+			GEMError error = openMapped(filename, mapping, file, isAnimated, meshCount);
+			if (error != GEM_OK) return error;
+			visitor.begin(isAnimated, meshCount);
+
+			GEMMaterial material;
+			unsigned int n = 0;
+			for (unsigned int i = 0; i < meshCount; i++)
 			{
-				GEMMesh mesh;
-				loadMesh(file, mesh, isAnimated);
-				meshes.push_back(mesh);
+				material.properties.clear();
+				file.read(&n, sizeof(unsigned int));
+				for (unsigned int p = 0; p < n; p++)
+				{
+					material.properties.push_back(loadProperty(file));
+				}
+				GEMMeshView mesh;
+				file.read(&n, sizeof(unsigned int));
+				if (isAnimated) mesh.animatedVertices = file.readArray<GEMAnimatedVertex>(n);
+				else mesh.staticVertices = file.readArray<GEMStaticVertex>(n);
+				file.read(&n, sizeof(unsigned int));
+				mesh.indices = file.readArray<unsigned int>(n);
+				visitor.mesh(i, material, mesh);
 			}
-			// Read skeleton
+			if (!isAnimated) return GEM_OK;
+
+			std::vector<GEMBone> bones;
+			GEMMatrix globalInverse;
 			unsigned int bonesN = 0;
-			file.read(reinterpret_cast<char*>(&bonesN), sizeof(unsigned int));
+			file.read(&bonesN, sizeof(unsigned int));
+			bones.reserve(bonesN);
 			for (unsigned int i = 0; i < bonesN; i++)
 			{
-				GEMBone bone;
-				bone.name = loadString(file);
-				bone.offset = loadMatrix(file);
-				file.read(reinterpret_cast<char*>(&bone.parentIndex), sizeof(int));
-				animation.bones.push_back(bone);
+				bones.emplace_back();
+				bones.back().name = loadString(file);
+				file.read(&bones.back().offset.m, sizeof(float) * 16);
+				file.read(&bones.back().parentIndex, sizeof(int));
 			}
-			animation.globalInverse = loadMatrix(file);
-			// Read animation sequence
-			file.read(reinterpret_cast<char*>(&n), sizeof(unsigned int));
+			file.read(&globalInverse.m, sizeof(float) * 16);
+			visitor.skeleton(bones, globalInverse);
+
+			GEMClipView clip;
+			clip.boneCount = (int)bonesN;
+			file.read(&n, sizeof(unsigned int));
 			for (unsigned int i = 0; i < n; i++)
 			{
-				GEMAnimationSequence aseq;
-				aseq.name = loadString(file);
-				int frames = 0;
-				file.read(reinterpret_cast<char*>(&frames), sizeof(int));
-				file.read(reinterpret_cast<char*>(&aseq.ticksPerSecond), sizeof(float));
-				loadFrames(aseq, file, bonesN, frames);
-				animation.animations.push_back(aseq);
+				clip.name = loadString(file);
+				file.read(&clip.frameCount, sizeof(int));
+				file.read(&clip.ticksPerSecond, sizeof(float));
+				clip.data = file.readBytes((size_t)clip.frameCount * clip.frameBytes());
+				visitor.clip(i, clip);
 			}
-			file.close();
+			return GEM_OK;
 		}
 	};
 
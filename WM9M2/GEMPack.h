@@ -0,0 +1,450 @@
+#pragma once
+
+#include "GEMLoader.h"
+#include <cfloat>
+#include <cstdint>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// Cooked form of a .gem file, laid out so that loading is one mapping plus pointer arithmetic:
+//
+//   GEMPackHeader
+//   GEMPackMesh[meshCount]     per-mesh counts, bounds, texture paths and blob offsets
+//   GEMPackBone[boneCount]     animated models only
+//   GEMPackClip[clipCount]     animated models only
+//   string table               zero-terminated names and texture paths
+//   blobs                      16-byte aligned: vertices already in STATIC_VERTEX / ANIMATED_VERTEX
+//                              layout, indices, and each clip's frames in AnimationSequence layout
+//                              (positions, rotations, scales; each stream [frame][bone])
+//
+// Offsets are from the start of the file. The header records the source .gem's size and
+// modification time, so a stale pack is cooked again instead of being used.
+namespace GEMLoader
+{
+
+	static const unsigned int GEM_PACK_MAGIC = 0x4B504D47;  // "GMPK"
+	static const unsigned int GEM_PACK_VERSION = 1;
+
+	struct GEMPackHeader
+	{
+		unsigned int magic;
+		unsigned int version;
+		unsigned int isAnimated;
+		unsigned int meshCount;
+		unsigned long long sourceSize;
+		long long sourceTime;
+		unsigned long long totalSize;
+		float boundsMin[3];         // whole model, before any transform
+		float boundsMax[3];
+		float baseLift;             // lifts the lowest vertex to y = 0
+		unsigned int meshesOffset;
+		unsigned int bonesOffset;
+		unsigned int boneCount;
+		unsigned int clipsOffset;
+		unsigned int clipCount;
+		unsigned int stringsOffset;
+		unsigned int stringsSize;
+		GEMMatrix globalInverse;
+	};
+
+	struct GEMPackMesh
+	{
+		unsigned int vertexOffset;
+		unsigned int vertexCount;
+		unsigned int indexOffset;
+		unsigned int indexCount;
+		unsigned int diffuse;       // string table offsets
+		unsigned int normals;
+		float boundsMin[3];
+		float boundsMax[3];
+	};
+
+	struct GEMPackBone
+	{
+		unsigned int name;
+		int parentIndex;
+		GEMMatrix offset;
+	};
+
+	struct GEMPackClip
+	{
+		unsigned int name;
+		int frameCount;
+		float ticksPerSecond;
+		unsigned int dataOffset;    // frameCount * boneCount * (3 + 4 + 3) floats
+	};
+
+	// Size and modification time of a file; false if it cannot be read
+	inline bool gemFileStamp(const std::string& filename, unsigned long long& size, long long& time)
+	{
+#ifdef _WIN32
+		struct _stat64 info;
+		if (_stat64(filename.c_str(), &info) != 0) return false;
+#else
+		struct stat info;
+		if (stat(filename.c_str(), &info) != 0) return false;
+#endif
+		size = (unsigned long long)info.st_size;
+		time = (long long)info.st_mtime;
+		return true;
+	}
+
+	class GEMPackCooker
+	{
+	public:
+		// Builds the pack for a .gem file in memory; false if the source cannot be read
+		static bool cook(const std::string& source, std::vector<char>& out)
+		{
+			GEMPackHeader header;
+			memset(&header, 0, sizeof(GEMPackHeader));
+			if (!gemFileStamp(source, header.sourceSize, header.sourceTime)) return false;
+
+			// Vertices, indices and keys are copied straight from the mapped source into the pack
+			GEMModelLoader loader;
+			GEMMappedFile mapping;
+			Source parsed;
+			if (loader.visit(source, mapping, parsed) != GEM_OK) return false;
+			header.isAnimated = parsed.isAnimated;
+			const std::vector<GEMMeshView>& meshes = parsed.meshes;
+			const std::vector<GEMClipView>& sourceClips = parsed.clips;
+
+			std::string strings;
+			std::vector<GEMPackMesh> packMeshes(meshes.size());
+			std::vector<GEMPackBone> bones(parsed.bones.size());
+			std::vector<GEMPackClip> clips(sourceClips.size());
+			int bonesN = (int)parsed.bones.size();
+
+			// Table sizes first, so blob offsets are known while filling them in
+			size_t offset = align(sizeof(GEMPackHeader));
+			header.meshCount = (unsigned int)meshes.size();
+			header.meshesOffset = (unsigned int)offset;
+			offset = align(offset + packMeshes.size() * sizeof(GEMPackMesh));
+			header.boneCount = (unsigned int)bones.size();
+			header.bonesOffset = (unsigned int)offset;
+			offset = align(offset + bones.size() * sizeof(GEMPackBone));
+			header.clipCount = (unsigned int)clips.size();
+			header.clipsOffset = (unsigned int)offset;
+			offset = align(offset + clips.size() * sizeof(GEMPackClip));
+
+			float modelMin[3] = { FLT_MAX, FLT_MAX, FLT_MAX };
+			float modelMax[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+			for (size_t i = 0; i < meshes.size(); i++)
+			{
+				GEMPackMesh& mesh = packMeshes[i];
+				const char* vertices;
+				size_t stride;
+				if (header.isAnimated)
+				{
+					mesh.vertexCount = (unsigned int)meshes[i].animatedVertices.size();
+					vertices = reinterpret_cast<const char*>(meshes[i].animatedVertices.data());
+					stride = sizeof(GEMAnimatedVertex);
+				}
+				else
+				{
+					mesh.vertexCount = (unsigned int)meshes[i].staticVertices.size();
+					vertices = reinterpret_cast<const char*>(meshes[i].staticVertices.data());
+					stride = sizeof(GEMStaticVertex);
+				}
+				mesh.indexCount = (unsigned int)meshes[i].indices.size();
+				mesh.diffuse = addString(strings, parsed.diffuse[i]);
+				mesh.normals = addString(strings, parsed.normals[i]);
+
+				for (int k = 0; k < 3; k++)
+				{
+					mesh.boundsMin[k] = FLT_MAX;
+					mesh.boundsMax[k] = -FLT_MAX;
+				}
+				for (unsigned int v = 0; v < mesh.vertexCount; v++)
+				{
+					GEMVec3 p;
+					memcpy(&p, vertices + v * stride, sizeof(GEMVec3));
+					const float c[3] = { p.x, p.y, p.z };
+					for (int k = 0; k < 3; k++)
+					{
+						if (c[k] < mesh.boundsMin[k]) mesh.boundsMin[k] = c[k];
+						if (c[k] > mesh.boundsMax[k]) mesh.boundsMax[k] = c[k];
+					}
+				}
+				for (int k = 0; k < 3; k++)
+				{
+					if (mesh.boundsMin[k] < modelMin[k]) modelMin[k] = mesh.boundsMin[k];
+					if (mesh.boundsMax[k] > modelMax[k]) modelMax[k] = mesh.boundsMax[k];
+				}
+
+				mesh.vertexOffset = (unsigned int)offset;
+				offset = align(offset + mesh.vertexCount * stride);
+				mesh.indexOffset = (unsigned int)offset;
+				offset = align(offset + mesh.indexCount * sizeof(unsigned int));
+			}
+			memcpy(header.boundsMin, modelMin, sizeof(modelMin));
+			memcpy(header.boundsMax, modelMax, sizeof(modelMax));
+			header.baseLift = -modelMin[1];
+
+			for (size_t i = 0; i < bones.size(); i++)
+			{
+				bones[i].name = addString(strings, parsed.bones[i].name);
+				bones[i].parentIndex = parsed.bones[i].parentIndex;
+				bones[i].offset = parsed.bones[i].offset;
+			}
+			header.globalInverse = parsed.globalInverse;
+			for (size_t i = 0; i < clips.size(); i++)
+			{
+				const GEMClipView& seq = sourceClips[i];
+				clips[i].name = addString(strings, seq.name);
+				clips[i].frameCount = seq.frameCount;
+				clips[i].ticksPerSecond = seq.ticksPerSecond;
+				clips[i].dataOffset = (unsigned int)offset;
+				offset = align(offset + (size_t)seq.frameCount * bonesN * (3 + 4 + 3) * sizeof(float));
+			}
+
+			header.stringsOffset = (unsigned int)offset;
+			header.stringsSize = (unsigned int)strings.size();
+			offset += strings.size();
+			header.magic = GEM_PACK_MAGIC;
+			header.version = GEM_PACK_VERSION;
+			header.totalSize = offset;
+
+			// Fill
+			out.assign(offset, 0);
+			char* base = &out[0];
+			memcpy(base, &header, sizeof(GEMPackHeader));
+			if (!packMeshes.empty()) memcpy(base + header.meshesOffset, &packMeshes[0], packMeshes.size() * sizeof(GEMPackMesh));
+			if (!bones.empty()) memcpy(base + header.bonesOffset, &bones[0], bones.size() * sizeof(GEMPackBone));
+			if (!clips.empty()) memcpy(base + header.clipsOffset, &clips[0], clips.size() * sizeof(GEMPackClip));
+			if (!strings.empty()) memcpy(base + header.stringsOffset, strings.data(), strings.size());
+			for (size_t i = 0; i < meshes.size(); i++)
+			{
+				const GEMPackMesh& mesh = packMeshes[i];
+				if (header.isAnimated && mesh.vertexCount > 0)
+				{
+					memcpy(base + mesh.vertexOffset, meshes[i].animatedVertices.data(), mesh.vertexCount * sizeof(GEMAnimatedVertex));
+				}
+				else if (mesh.vertexCount > 0)
+				{
+					memcpy(base + mesh.vertexOffset, meshes[i].staticVertices.data(), mesh.vertexCount * sizeof(GEMStaticVertex));
+				}
+				if (mesh.indexCount > 0)
+				{
+					memcpy(base + mesh.indexOffset, meshes[i].indices.data(), mesh.indexCount * sizeof(unsigned int));
+				}
+			}
+			for (size_t i = 0; i < clips.size(); i++)
+			{
+				const GEMClipView& seq = sourceClips[i];
+				size_t frames = (size_t)seq.frameCount;
+				char* positions = base + clips[i].dataOffset;
+				char* rotations = positions + frames * bonesN * sizeof(GEMVec3);
+				char* scales = rotations + frames * bonesN * sizeof(GEMQuaternion);
+				for (size_t f = 0; f < frames && bonesN > 0; f++)
+				{
+					memcpy(positions + f * bonesN * sizeof(GEMVec3), seq.positions((int)f).data(), bonesN * sizeof(GEMVec3));
+					memcpy(rotations + f * bonesN * sizeof(GEMQuaternion), seq.rotations((int)f).data(), bonesN * sizeof(GEMQuaternion));
+					memcpy(scales + f * bonesN * sizeof(GEMVec3), seq.scales((int)f).data(), bonesN * sizeof(GEMVec3));
+				}
+			}
+			return true;
+		}
+
+		static bool cook(const std::string& source, const std::string& pack)
+		{
+			std::vector<char> data;
+			if (!cook(source, data)) return false;
+			return write(pack, data);
+		}
+
+		static bool write(const std::string& pack, const std::vector<char>& data)
+		{
+			std::ofstream file(pack, std::ios::binary | std::ios::trunc);
+			if (!file) return false;
+			file.write(&data[0], data.size());
+			return file.good();
+		}
+
+	private:
+		// Collects what the cook needs; the spans and clip data point into the source mapping
+		struct Source : GEMVisitor
+		{
+			unsigned int isAnimated = 0;
+			std::vector<GEMMeshView> meshes;
+			std::vector<std::string> diffuse;
+			std::vector<std::string> normals;
+			std::vector<GEMBone> bones;
+			GEMMatrix globalInverse = {};
+			std::vector<GEMClipView> clips;
+
+			void begin(unsigned int animated, unsigned int /*meshCount*/)
+			{
+				isAnimated = animated ? 1 : 0;
+			}
+			void mesh(unsigned int /*index*/, const GEMMaterial& material, const GEMMeshView& view)
+			{
+				meshes.push_back(view);
+				diffuse.push_back(material.find("diffuse").getValue());
+				normals.push_back(material.find("normals").getValue());
+			}
+			void skeleton(const std::vector<GEMBone>& skeletonBones, const GEMMatrix& inverse)
+			{
+				bones = skeletonBones;
+				globalInverse = inverse;
+			}
+			void clip(unsigned int /*index*/, const GEMClipView& view)
+			{
+				clips.push_back(view);
+			}
+		};
+
+		static size_t align(size_t offset)
+		{
+			return (offset + 15) & ~(size_t)15;
+		}
+
+		static unsigned int addString(std::string& strings, const std::string& s)
+		{
+			unsigned int offset = (unsigned int)strings.size();
+			strings.append(s);
+			strings.push_back('\0');
+			return offset;
+		}
+	};
+
+	// A loaded pack. Everything it hands out points into the mapping (or the freshly cooked buffer),
+	// so it has to outlive the pointers.
+	class GEMPack
+	{
+	public:
+		// Maps filename + ".pack" when it is valid and up to date with filename; otherwise cooks it,
+		// tries to save it for next time, and uses the cooked copy from memory
+		bool openOrCook(const std::string& filename)
+		{
+			std::string packName = filename + ".pack";
+			unsigned long long sourceSize = 0;
+			long long sourceTime = 0;
+			bool haveSource = gemFileStamp(filename, sourceSize, sourceTime);
+			if (mapping.open(packName) && attach(mapping.data(), mapping.size()))
+			{
+				// Without the source (shipped packs only) any valid pack is used
+				if (!haveSource || (header->sourceSize == sourceSize && header->sourceTime == sourceTime)) return true;
+			}
+			close();
+			if (!haveSource || !GEMPackCooker::cook(filename, cooked)) return false;
+			GEMPackCooker::write(packName, cooked);
+			return attach(&cooked[0], cooked.size());
+		}
+
+		// Maps an existing pack without checking it against a source
+		bool open(const std::string& packName)
+		{
+			close();
+			return mapping.open(packName) && attach(mapping.data(), mapping.size());
+		}
+
+		void close()
+		{
+			mapping.close();
+			cooked.clear();
+			base = nullptr;
+			header = nullptr;
+		}
+
+		const GEMPackHeader& info() const
+		{
+			return *header;
+		}
+		const GEMPackMesh& mesh(int i) const
+		{
+			return at<GEMPackMesh>(header->meshesOffset)[i];
+		}
+		const void* vertices(int i) const
+		{
+			return base + mesh(i).vertexOffset;
+		}
+		const unsigned int* indices(int i) const
+		{
+			return at<unsigned int>(mesh(i).indexOffset);
+		}
+		const GEMPackBone& bone(int i) const
+		{
+			return at<GEMPackBone>(header->bonesOffset)[i];
+		}
+		const GEMPackClip& clip(int i) const
+		{
+			return at<GEMPackClip>(header->clipsOffset)[i];
+		}
+		const float* clipData(int i) const
+		{
+			return at<float>(clip(i).dataOffset);
+		}
+		const char* string(unsigned int offset) const
+		{
+			return base + header->stringsOffset + offset;
+		}
+
+	private:
+		GEMMappedFile mapping;
+		// Only as aligned as operator new makes it: 16 bytes on x64 but 8 on Win32, unlike the
+		// page-aligned mapping. The pack needs 4 (floats and ints), which attach checks.
+		std::vector<char> cooked;
+		const char* base = nullptr;
+		const GEMPackHeader* header = nullptr;
+
+		template<typename T>
+		const T* at(unsigned int offset) const
+		{
+			return reinterpret_cast<const T*>(base + offset);
+		}
+
+		static bool inside(unsigned long long offset, unsigned long long bytes, size_t size)
+		{
+			return offset <= size && bytes <= size - offset;
+		}
+
+		// For tables and blobs of 4-byte fields
+		static bool insideAligned(unsigned long long offset, unsigned long long bytes, size_t size)
+		{
+			return (offset & 3) == 0 && inside(offset, bytes, size);
+		}
+
+		// Checks every table and blob lies inside the data, every index names a vertex of its mesh and
+		// every bone parent a bone, so the accessors and the renderer, collision and animation code
+		// that use them need no checks
+		bool attach(const char* data, size_t size)
+		{
+			if (size < sizeof(GEMPackHeader) || ((uintptr_t)data & 3) != 0) return false;
+			const GEMPackHeader* h = reinterpret_cast<const GEMPackHeader*>(data);
+			if (h->magic != GEM_PACK_MAGIC || h->version != GEM_PACK_VERSION || h->totalSize != size) return false;
+			if (!insideAligned(h->meshesOffset, (unsigned long long)h->meshCount * sizeof(GEMPackMesh), size) ||
+				!insideAligned(h->bonesOffset, (unsigned long long)h->boneCount * sizeof(GEMPackBone), size) ||
+				!insideAligned(h->clipsOffset, (unsigned long long)h->clipCount * sizeof(GEMPackClip), size) ||
+				!inside(h->stringsOffset, h->stringsSize, size) ||
+				(h->stringsSize > 0 && data[h->stringsOffset + h->stringsSize - 1] != '\0')) return false;
+			const GEMPackMesh* meshes = reinterpret_cast<const GEMPackMesh*>(data + h->meshesOffset);
+			unsigned long long stride = h->isAnimated ? sizeof(GEMAnimatedVertex) : sizeof(GEMStaticVertex);
+			for (unsigned int i = 0; i < h->meshCount; i++)
+			{
+				if (!insideAligned(meshes[i].vertexOffset, meshes[i].vertexCount * stride, size) ||
+					!insideAligned(meshes[i].indexOffset, (unsigned long long)meshes[i].indexCount * sizeof(unsigned int), size) ||
+					meshes[i].diffuse >= h->stringsSize || meshes[i].normals >= h->stringsSize) return false;
+				const unsigned int* indices = reinterpret_cast<const unsigned int*>(data + meshes[i].indexOffset);
+				for (unsigned int k = 0; k < meshes[i].indexCount; k++)
+				{
+					if (indices[k] >= meshes[i].vertexCount) return false;
+				}
+			}
+			const GEMPackBone* bones = reinterpret_cast<const GEMPackBone*>(data + h->bonesOffset);
+			for (unsigned int i = 0; i < h->boneCount; i++)
+			{
+				if (bones[i].name >= h->stringsSize || bones[i].parentIndex < -1 || bones[i].parentIndex >= (int)h->boneCount) return false;
+			}
+			const GEMPackClip* clips = reinterpret_cast<const GEMPackClip*>(data + h->clipsOffset);
+			for (unsigned int i = 0; i < h->clipCount; i++)
+			{
+				if (clips[i].name >= h->stringsSize || clips[i].frameCount < 0 ||
+					!insideAligned(clips[i].dataOffset, (unsigned long long)clips[i].frameCount * h->boneCount * (3 + 4 + 3) * sizeof(float), size)) return false;
+			}
+			base = data;
+			header = h;
+			return true;
+		}
+	};
+
+};
@@ -0,0 +1,1505 @@
+﻿#pragma once
+// Skeletons, clips, blending and batched palette evaluation. Nothing here touches the device, so
+// it builds without the DirectX headers; LoadAnimation in animation.h adds the GPU side.
+#include "jobSystem.h"
+#include "GEMPack.h"
+#include <iostream>
+#include <fstream>
+#include <cfloat>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <map>
+#include <unordered_map>
+#include <chrono>
+#include "mathLib.h"
+
+// Top three rows of a Matrix whose last row is (0, 0, 0, 1); same layout, translation in m[3], m[7], m[11]
+struct alignas(16) AffineTransform
+{
+	float m[12];
+
+	static bool isAffine(const mathLib::Matrix& matrix) {
+		return matrix.m[12] == 0.0f && matrix.m[13] == 0.0f && matrix.m[14] == 0.0f && matrix.m[15] == 1.0f;
+	}
+
+	static AffineTransform fromMatrix(const mathLib::Matrix& matrix) {
+		AffineTransform a;
+		memcpy(a.m, matrix.m, 12 * sizeof(float));
+		return a;
+	}
+
+	void toMatrix(mathLib::Matrix& matrix) const {
+		memcpy(matrix.m, m, 12 * sizeof(float));
+		matrix.m[12] = 0.0f;
+		matrix.m[13] = 0.0f;
+		matrix.m[14] = 0.0f;
+		matrix.m[15] = 1.0f;
+	}
+
+	// Translation * rotation * scale, built directly instead of multiplying three 4x4 matrices.
+	// Quaternions are stored x, y, z, w (see Quaternion::toMatrix).
+	static void fromTRS(const mathLib::Vec3& t, const mathLib::Quaternion& r, const mathLib::Vec3& s, AffineTransform& out) {
+		float xx = r.q[0] * r.q[0];
+		float xy = r.q[0] * r.q[1];
+		float xz = r.q[0] * r.q[2];
+		float yy = r.q[1] * r.q[1];
+		float zz = r.q[2] * r.q[2];
+		float yz = r.q[1] * r.q[2];
+		float wx = r.q[3] * r.q[0];
+		float wy = r.q[3] * r.q[1];
+		float wz = r.q[3] * r.q[2];
+		out.m[0] = (1.0f - 2.0f * (yy + zz)) * s.x;
+		out.m[1] = 2.0f * (xy - wz) * s.y;
+		out.m[2] = 2.0f * (xz + wy) * s.z;
+		out.m[3] = t.x;
+		out.m[4] = 2.0f * (xy + wz) * s.x;
+		out.m[5] = (1.0f - 2.0f * (xx + zz)) * s.y;
+		out.m[6] = 2.0f * (yz - wx) * s.z;
+		out.m[7] = t.y;
+		out.m[8] = 2.0f * (xz - wy) * s.x;
+		out.m[9] = 2.0f * (yz + wx) * s.y;
+		out.m[10] = (1.0f - 2.0f * (xx + yy)) * s.z;
+		out.m[11] = t.z;
+	}
+
+	// out = a applied after b (a * b in column-vector notation). out may alias neither input.
+	// Loads and stores are unaligned: transforms and palettes live in std::vectors and heap
+	// objects, which C++14 and Win32 heaps only align to 8 bytes.
+	static void multiply(const AffineTransform& a, const AffineTransform& b, float* out) {
+#if MATHLIB_SSE
+		__m128 b0 = _mm_loadu_ps(&b.m[0]);
+		__m128 b1 = _mm_loadu_ps(&b.m[4]);
+		__m128 b2 = _mm_loadu_ps(&b.m[8]);
+		// b's implied last row only picks up a's translation
+		__m128 translationMask = _mm_castsi128_ps(_mm_set_epi32(-1, 0, 0, 0));
+		for (int r = 0; r < 3; r++) {
+			__m128 row = _mm_loadu_ps(&a.m[r * 4]);
+			__m128 v = _mm_and_ps(row, translationMask);
+			v = mathLib::simd::madd(_mm_shuffle_ps(row, row, _MM_SHUFFLE(0, 0, 0, 0)), b0, v);
+			v = mathLib::simd::madd(_mm_shuffle_ps(row, row, _MM_SHUFFLE(1, 1, 1, 1)), b1, v);
+			v = mathLib::simd::madd(_mm_shuffle_ps(row, row, _MM_SHUFFLE(2, 2, 2, 2)), b2, v);
+			_mm_storeu_ps(&out[r * 4], v);
+		}
+#else
+		for (int r = 0; r < 3; r++) {
+			const float* row = &a.m[r * 4];
+			for (int c = 0; c < 4; c++) {
+				out[r * 4 + c] = row[0] * b.m[c] + row[1] * b.m[4 + c] + row[2] * b.m[8 + c];
+			}
+			out[r * 4 + 3] += row[3];
+		}
+#endif
+	}
+};
+
+struct Bone
+{
+	std::string name;
+	mathLib::Matrix offset;
+	int parentIndex;
+};
+
+struct Skeleton
+{
+	std::vector<Bone> bones;
+	mathLib::Matrix globalInverse;
+
+	// Filled by compile(): bones in parent-first order and the transforms folded into the palette
+	std::vector<int> order;
+	std::vector<AffineTransform> offsets;
+	std::vector<AffineTransform> bindLocals;	// local transform of each bone in the bind pose
+	AffineTransform inverse;
+	bool compiled = false;
+
+	// The fused palette pass keeps its globals on the stack, one per bone
+	static const int MAX_BONES = 256;
+
+	// Validates parent links and stores a topological order for the fused palette pass.
+	// Returns false for more than MAX_BONES bones, broken hierarchies or non-affine transforms;
+	// the generic path is used then.
+	bool compile() {
+		compiled = false;
+		order.clear();
+		offsets.clear();
+		int count = (int)bones.size();
+		if (count > MAX_BONES) {
+			std::cout << "Skeleton: " << count << " bones is more than " << MAX_BONES << ", not compiled" << std::endl;
+			return false;
+		}
+		std::vector<char> placed(count, 0);
+		for (int i = 0; i < count; i++) {
+			int parent = bones[i].parentIndex;
+			if (parent >= count || parent == i || !AffineTransform::isAffine(bones[i].offset)) {
+				std::cout << "Skeleton: bone " << bones[i].name << " cannot be compiled" << std::endl;
+				return false;
+			}
+		}
+		if (!AffineTransform::isAffine(globalInverse)) {
+			return false;
+		}
+
+		// Repeated sweeps so any order in the file works; parent-first files finish in one sweep
+		while ((int)order.size() < count) {
+			size_t before = order.size();
+			for (int i = 0; i < count; i++) {
+				int parent = bones[i].parentIndex;
+				if (!placed[i] && (parent < 0 || placed[parent])) {
+					placed[i] = 1;
+					order.push_back(i);
+				}
+			}
+			if (order.size() == before) {
+				std::cout << "Skeleton: bone hierarchy has a cycle" << std::endl;
+				order.clear();
+				return false;
+			}
+		}
+
+		offsets.resize(count);
+		bindLocals.resize(count);
+		for (int i = 0; i < count; i++) {
+			offsets[i] = AffineTransform::fromMatrix(bones[i].offset);
+			// offset is the inverse bind-pose global, so local = parent offset applied after offset^-1
+			mathLib::Matrix bindGlobal = bones[i].offset.invert();
+			int parent = bones[i].parentIndex;
+			bindLocals[i] = AffineTransform::fromMatrix(parent > -1 ? bindGlobal * bones[parent].offset : bindGlobal);
+		}
+		inverse = AffineTransform::fromMatrix(globalInverse);
+		compiled = true;
+		return true;
+	}
+};
+
+// Clip streams are memcpy'd straight from the GEM data, so the math types must stay tightly packed
+static_assert(sizeof(mathLib::Vec3) == 3 * sizeof(float), "Vec3 must be tightly packed");
+static_assert(sizeof(mathLib::Quaternion) == 4 * sizeof(float), "Quaternion must be tightly packed");
+
+// Tolerances for CompressedClip::build. They bound the error of constant-track elimination and
+// keyframe removal; the quantized end keys are used when checking, so quantization is included.
+struct ClipCompressionSettings
+{
+	float translationTolerance = 0.001f;	// model units
+	float rotationTolerance = 0.001f;		// radians
+	float scaleTolerance = 0.001f;
+	bool removeKeyframes = true;
+};
+
+struct ClipCompressionStats
+{
+	size_t rawBytes = 0;
+	size_t compressedBytes = 0;
+	int tracks = 0;
+	int constantTracks = 0;
+	int rawKeys = 0;
+	int keptKeys = 0;
+	float maxJointError = 0.0f;	// largest joint position error against the raw clip, in model units
+
+	float ratio() const {
+		return compressedBytes > 0 ? (float)rawBytes / (float)compressedBytes : 0.0f;
+	}
+};
+
+// Compressed clip: one track per bone and channel, each either a constant or a list of keys.
+// Translations and scales are range-quantized to 16 bits per component, rotations use a
+// 48-bit smallest-three encoding. Samples are decoded on the fly.
+class CompressedClip
+{
+public:
+	enum Channel { POSITION = 0, ROTATION = 1, SCALE = 2 };
+
+	struct Track
+	{
+		int firstKey;	// into keyFrames; keyData holds 3 values per key
+		int keyCount;	// 1 = constant track, stored at full precision in base
+		float base[4];	// range minimum, or the constant value
+		float step[3];	// range / 65535 per component
+	};
+
+	std::vector<Track> tracks;			// [bone * 3 + channel]
+	std::vector<uint16_t> keyFrames;	// source frame index of each key
+	std::vector<uint16_t> keyData;
+	int boneCount = 0;
+	int frameCount = 0;
+
+	bool empty() const {
+		return tracks.empty();
+	}
+
+	size_t sizeInBytes() const {
+		return tracks.size() * sizeof(Track) + (keyFrames.size() + keyData.size()) * sizeof(uint16_t);
+	}
+
+	// Smallest-three: 2 bits for the index of the largest component, 1 bit for its sign and
+	// 15 bits for each of the other three, which all lie in [-1/sqrt2, 1/sqrt2]
+	static void encodeQuaternion(const mathLib::Quaternion& rotation, uint16_t out[3]) {
+		const float range = 0.70710678f;
+		mathLib::Quaternion q = rotation;
+		q.normalize();
+		int largest = 0;
+		for (int i = 1; i < 4; i++) {
+			if (fabsf(q.q[i]) > fabsf(q.q[largest])) largest = i;
+		}
+		uint64_t bits = ((uint64_t)largest << 46) | ((uint64_t)(q.q[largest] < 0.0f ? 1 : 0) << 45);
+		int shift = 30;
+		for (int i = 0; i < 4; i++) {
+			if (i == largest) continue;
+			float v = mathLib::clamp(q.q[i], -range, range);
+			uint64_t quantized = (uint64_t)((v + range) / (2.0f * range) * 32767.0f + 0.5f);
+			bits |= quantized << shift;
+			shift -= 15;
+		}
+		out[0] = (uint16_t)(bits >> 32);
+		out[1] = (uint16_t)(bits >> 16);
+		out[2] = (uint16_t)bits;
+	}
+
+	static mathLib::Quaternion decodeQuaternion(const uint16_t in[3]) {
+		const float range = 0.70710678f;
+		uint64_t bits = ((uint64_t)in[0] << 32) | ((uint64_t)in[1] << 16) | (uint64_t)in[2];
+		int largest = (int)(bits >> 46) & 3;
+		bool negative = ((bits >> 45) & 1) != 0;
+		mathLib::Quaternion q;
+		float sum = 0.0f;
+		int shift = 30;
+		for (int i = 0; i < 4; i++) {
+			if (i == largest) continue;
+			float v = (float)((bits >> shift) & 0x7FFF) / 32767.0f * (2.0f * range) - range;
+			q.q[i] = v;
+			sum += v * v;
+			shift -= 15;
+		}
+		float w = sqrtf(max(0.0f, 1.0f - sum));
+		q.q[largest] = negative ? -w : w;
+		return q;
+	}
+
+	// u is a continuous frame position in [0, frameCount - 1]
+	void sample(int bone, float u, mathLib::Vec3& position, mathLib::Quaternion& rotation, mathLib::Vec3& scale) const {
+		position = sampleVector(tracks[bone * 3 + POSITION], u);
+		rotation = sampleRotation(tracks[bone * 3 + ROTATION], u);
+		scale = sampleVector(tracks[bone * 3 + SCALE], u);
+	}
+
+	// Streams are laid out [frame][bone], as in AnimationSequence
+	ClipCompressionStats build(const mathLib::Vec3* positions, const mathLib::Quaternion* rotations, const mathLib::Vec3* scales,
+		int frames, int bones, const ClipCompressionSettings& settings)
+	{
+		tracks.clear();
+		keyFrames.clear();
+		keyData.clear();
+		boneCount = bones;
+		frameCount = frames;
+
+		ClipCompressionStats stats;
+		std::vector<mathLib::Vec3> vectorValues(frames);
+		std::vector<mathLib::Quaternion> rotationValues(frames);
+		for (int bone = 0; bone < bones; bone++) {
+			for (int f = 0; f < frames; f++) vectorValues[f] = positions[f * bones + bone];
+			buildVectorTrack(vectorValues, settings.translationTolerance, settings.removeKeyframes, stats);
+			for (int f = 0; f < frames; f++) rotationValues[f] = rotations[f * bones + bone];
+			buildRotationTrack(rotationValues, settings.rotationTolerance, settings.removeKeyframes, stats);
+			for (int f = 0; f < frames; f++) vectorValues[f] = scales[f * bones + bone];
+			buildVectorTrack(vectorValues, settings.scaleTolerance, settings.removeKeyframes, stats);
+		}
+
+		stats.rawBytes = (size_t)frames * bones * (2 * sizeof(mathLib::Vec3) + sizeof(mathLib::Quaternion));
+		stats.compressedBytes = sizeInBytes();
+		stats.tracks = bones * 3;
+		stats.rawKeys = frames * bones * 3;
+		return stats;
+	}
+
+private:
+	mathLib::Vec3 decodeVector(const Track& track, int key) const {
+		const uint16_t* q = &keyData[key * 3];
+		return mathLib::Vec3(track.base[0] + q[0] * track.step[0], track.base[1] + q[1] * track.step[1], track.base[2] + q[2] * track.step[2]);
+	}
+
+	static mathLib::Vec3 lerpVector(const mathLib::Vec3& a, const mathLib::Vec3& b, float t) {
+		return mathLib::Vec3(a.x + (b.x - a.x) * t, a.y + (b.y - a.y) * t, a.z + (b.z - a.z) * t);
+	}
+
+	// Finds the key starting the segment that contains u and the blend factor inside it
+	int findKey(const Track& track, float u, float& alpha) const {
+		const uint16_t* first = &keyFrames[track.firstKey];
+		int k = (int)(std::upper_bound(first, first + track.keyCount, u) - first) - 1;
+		k = mathLib::clamp(k, 0, track.keyCount - 2);
+		float f0 = first[k];
+		float f1 = first[k + 1];
+		alpha = mathLib::clamp((u - f0) / (f1 - f0), 0.0f, 1.0f);
+		return track.firstKey + k;
+	}
+
+	mathLib::Vec3 sampleVector(const Track& track, float u) const {
+		if (track.keyCount == 1) {
+			return mathLib::Vec3(track.base[0], track.base[1], track.base[2]);
+		}
+		float alpha;
+		int key = findKey(track, u, alpha);
+		return lerpVector(decodeVector(track, key), decodeVector(track, key + 1), alpha);
+	}
+
+	mathLib::Quaternion sampleRotation(const Track& track, float u) const {
+		if (track.keyCount == 1) {
+			return mathLib::Quaternion(track.base[0], track.base[1], track.base[2], track.base[3]);
+		}
+		float alpha;
+		int key = findKey(track, u, alpha);
+		return mathLib::Quaternion::slerp(decodeQuaternion(&keyData[key * 3]), decodeQuaternion(&keyData[(key + 1) * 3]), alpha);
+	}
+
+	static float rotationError(const mathLib::Quaternion& a, const mathLib::Quaternion& b) {
+		// q and -q give the same matrix, so compare via |dot|
+		float d = fabsf(a.dot(b)) / sqrtf(a.dot(a) * b.dot(b));
+		return 2.0f * acosf(min(d, 1.0f));
+	}
+
+	// Greedy error-bounded key selection: grow each segment while every frame it skips is
+	// reproduced within tolerance by interpolating its end keys
+	template<typename WithinTolerance>
+	static void selectKeys(int frames, bool removeKeyframes, WithinTolerance withinTolerance, std::vector<int>& keys) {
+		keys.clear();
+		keys.push_back(0);
+		int anchor = 0;
+		int end = 1;
+		while (end < frames - 1) {
+			if (removeKeyframes && withinTolerance(anchor, end + 1)) {
+				end++;
+				continue;
+			}
+			keys.push_back(end);
+			anchor = end;
+			end++;
+		}
+		if (frames > 1) keys.push_back(frames - 1);
+	}
+
+	void buildVectorTrack(const std::vector<mathLib::Vec3>& values, float tolerance, bool removeKeyframes, ClipCompressionStats& stats) {
+		Track track;
+		mathLib::Vec3 lo(FLT_MAX, FLT_MAX, FLT_MAX);
+		mathLib::Vec3 hi(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+		for (size_t f = 0; f < values.size(); f++) {
+			lo = mathLib::Min(lo, values[f]);
+			hi = mathLib::Max(hi, values[f]);
+		}
+		mathLib::Vec3 extent(hi.x - lo.x, hi.y - lo.y, hi.z - lo.z);
+		if (values.size() < 2 || extent.getLength() <= 2.0f * tolerance) {
+			// Constant track: every frame lies in the box, so the midpoint is at most half its
+			// diagonal, and within tolerance, from each of them
+			track.firstKey = (int)keyFrames.size();
+			track.keyCount = 1;
+			track.base[0] = (lo.x + hi.x) * 0.5f;
+			track.base[1] = (lo.y + hi.y) * 0.5f;
+			track.base[2] = (lo.z + hi.z) * 0.5f;
+			track.base[3] = 0.0f;
+			track.step[0] = track.step[1] = track.step[2] = 0.0f;
+			tracks.push_back(track);
+			stats.constantTracks++;
+			stats.keptKeys++;
+			return;
+		}
+
+		track.base[0] = lo.x;
+		track.base[1] = lo.y;
+		track.base[2] = lo.z;
+		track.base[3] = 0.0f;
+		for (int c = 0; c < 3; c++) track.step[c] = extent.v[c] / 65535.0f;
+
+		std::vector<uint16_t> quantized(values.size() * 3);
+		for (size_t f = 0; f < values.size(); f++) {
+			for (int c = 0; c < 3; c++) {
+				float q = track.step[c] > 0.0f ? (values[f].v[c] - track.base[c]) / track.step[c] : 0.0f;
+				quantized[f * 3 + c] = (uint16_t)mathLib::clamp(q + 0.5f, 0.0f, 65535.0f);
+			}
+		}
+		auto decode = [&](int f) {
+			return mathLib::Vec3(track.base[0] + quantized[f * 3] * track.step[0],
+				track.base[1] + quantized[f * 3 + 1] * track.step[1],
+				track.base[2] + quantized[f * 3 + 2] * track.step[2]);
+		};
+		auto withinTolerance = [&](int a, int b) {
+			mathLib::Vec3 va = decode(a);
+			mathLib::Vec3 vb = decode(b);
+			for (int f = a + 1; f < b; f++) {
+				mathLib::Vec3 v = lerpVector(va, vb, (float)(f - a) / (float)(b - a));
+				mathLib::Vec3 d(v.x - values[f].x, v.y - values[f].y, v.z - values[f].z);
+				if (d.getLength() > tolerance) return false;
+			}
+			return true;
+		};
+
+		std::vector<int> keys;
+		selectKeys((int)values.size(), removeKeyframes, withinTolerance, keys);
+		track.firstKey = (int)keyFrames.size();
+		track.keyCount = (int)keys.size();
+		for (size_t k = 0; k < keys.size(); k++) {
+			keyFrames.push_back((uint16_t)keys[k]);
+			keyData.insert(keyData.end(), &quantized[keys[k] * 3], &quantized[keys[k] * 3] + 3);
+		}
+		tracks.push_back(track);
+		stats.keptKeys += track.keyCount;
+	}
+
+	void buildRotationTrack(const std::vector<mathLib::Quaternion>& values, float tolerance, bool removeKeyframes, ClipCompressionStats& stats) {
+		Track track;
+		// Neighbouring keys in opposite hemispheres make slerp take the long way round. That path
+		// is part of how the raw clip plays, so both keys of such a pair are always kept.
+		std::vector<char> flipped(values.size(), 0);
+		bool constant = true;
+		for (size_t f = 1; f < values.size(); f++) {
+			flipped[f - 1] = values[f - 1].dot(values[f]) < 0.0f;
+			constant = constant && !flipped[f - 1] && rotationError(values[0], values[f]) <= tolerance;
+		}
+		if (constant) {
+			track.firstKey = (int)keyFrames.size();
+			track.keyCount = 1;
+			for (int c = 0; c < 4; c++) track.base[c] = values[0].q[c];
+			track.step[0] = track.step[1] = track.step[2] = 0.0f;
+			tracks.push_back(track);
+			stats.constantTracks++;
+			stats.keptKeys++;
+			return;
+		}
+
+		std::vector<uint16_t> encoded(values.size() * 3);
+		for (size_t f = 0; f < values.size(); f++) {
+			encodeQuaternion(values[f], &encoded[f * 3]);
+		}
+		auto withinTolerance = [&](int a, int b) {
+			for (int f = a; f < b; f++) {
+				if (flipped[f]) return false;
+			}
+			mathLib::Quaternion qa = decodeQuaternion(&encoded[a * 3]);
+			mathLib::Quaternion qb = decodeQuaternion(&encoded[b * 3]);
+			for (int f = a + 1; f < b; f++) {
+				mathLib::Quaternion q = mathLib::Quaternion::slerp(qa, qb, (float)(f - a) / (float)(b - a));
+				if (rotationError(q, values[f]) > tolerance) return false;
+			}
+			return true;
+		};
+
+		std::vector<int> keys;
+		selectKeys((int)values.size(), removeKeyframes, withinTolerance, keys);
+		track.firstKey = (int)keyFrames.size();
+		track.keyCount = (int)keys.size();
+		for (int c = 0; c < 4; c++) track.base[c] = 0.0f;
+		track.step[0] = track.step[1] = track.step[2] = 0.0f;
+		for (size_t k = 0; k < keys.size(); k++) {
+			keyFrames.push_back((uint16_t)keys[k]);
+			keyData.insert(keyData.end(), &encoded[keys[k] * 3], &encoded[keys[k] * 3] + 3);
+		}
+		tracks.push_back(track);
+		stats.keptKeys += track.keyCount;
+	}
+};
+
+// Per-bone blend weights, e.g. to play an attack on the upper body only
+struct BoneMask
+{
+	std::vector<float> weights;
+
+	void init(const Skeleton& skeleton, float weight = 0.0f) {
+		weights.assign(skeleton.bones.size(), weight);
+	}
+
+	// Sets the weight of a bone and everything below it; relies on parent-first bone order
+	void setBranch(const Skeleton& skeleton, const std::string& boneName, float weight) {
+		if (weights.size() != skeleton.bones.size()) init(skeleton);
+		std::vector<char> inBranch(skeleton.bones.size(), 0);
+		for (int i = 0; i < (int)skeleton.bones.size(); i++) {
+			int parent = skeleton.bones[i].parentIndex;
+			inBranch[i] = skeleton.bones[i].name == boneName || (parent > -1 && inBranch[parent]);
+			if (inBranch[i]) weights[i] = weight;
+		}
+	}
+};
+
+// Local (TRS) pose of a whole skeleton. Clips are blended here, before the hierarchy pass,
+// so any number of clips still costs one walk down the skeleton. Buffers are kept between
+// updates: once sized, sampling and blending do not allocate.
+struct AnimationPose
+{
+	std::vector<mathLib::Vec3> positions;
+	std::vector<mathLib::Quaternion> rotations;
+	std::vector<mathLib::Vec3> scales;
+
+	void resize(int bones) {
+		if ((int)positions.size() != bones) {
+			positions.resize(bones);
+			rotations.resize(bones);
+			scales.resize(bones);
+		}
+	}
+
+	int size() const {
+		return (int)positions.size();
+	}
+
+	// this = lerp(this, other, weight), per bone scaled by the mask
+	void blend(const AnimationPose& other, float weight, const BoneMask* mask = nullptr) {
+		for (int i = 0; i < size(); i++) {
+			float w = mask ? weight * mask->weights[i] : weight;
+			if (w <= 0.0f) continue;
+			positions[i] = lerpVector(positions[i], other.positions[i], w);
+			rotations[i] = blendRotation(rotations[i], other.rotations[i], w);
+			scales[i] = lerpVector(scales[i], other.scales[i], w);
+		}
+	}
+
+	// Adds the difference between an additive pose and its reference pose on top of this one
+	void addLayer(const AnimationPose& additive, const AnimationPose& reference, float weight, const BoneMask* mask = nullptr) {
+		const mathLib::Quaternion identity(0.0f, 0.0f, 0.0f, 1.0f);
+		for (int i = 0; i < size(); i++) {
+			float w = mask ? weight * mask->weights[i] : weight;
+			if (w <= 0.0f) continue;
+			for (int c = 0; c < 3; c++) {
+				positions[i].v[c] += (additive.positions[i].v[c] - reference.positions[i].v[c]) * w;
+				float ref = reference.scales[i].v[c];
+				float ratio = ref != 0.0f ? additive.scales[i].v[c] / ref : 1.0f;
+				scales[i].v[c] *= 1.0f + (ratio - 1.0f) * w;
+			}
+			mathLib::Quaternion delta = multiply(conjugate(reference.rotations[i]), additive.rotations[i]);
+			rotations[i] = multiply(rotations[i], blendRotation(identity, delta, w));
+		}
+	}
+
+	// Quaternions are stored x, y, z, w in q[] (see Quaternion::toMatrix)
+	static mathLib::Quaternion multiply(const mathLib::Quaternion& a, const mathLib::Quaternion& b) {
+		return mathLib::Quaternion(
+			a.q[3] * b.q[0] + a.q[0] * b.q[3] + a.q[1] * b.q[2] - a.q[2] * b.q[1],
+			a.q[3] * b.q[1] - a.q[0] * b.q[2] + a.q[1] * b.q[3] + a.q[2] * b.q[0],
+			a.q[3] * b.q[2] + a.q[0] * b.q[1] - a.q[1] * b.q[0] + a.q[2] * b.q[3],
+			a.q[3] * b.q[3] - a.q[0] * b.q[0] - a.q[1] * b.q[1] - a.q[2] * b.q[2]);
+	}
+
+	static mathLib::Quaternion conjugate(const mathLib::Quaternion& a) {
+		return mathLib::Quaternion(-a.q[0], -a.q[1], -a.q[2], a.q[3]);
+	}
+
+	// Shortest-path slerp: unrelated clips may store a rotation in opposite hemispheres
+	static mathLib::Quaternion blendRotation(const mathLib::Quaternion& a, const mathLib::Quaternion& b, float t) {
+		if (a.dot(b) < 0.0f) {
+			return mathLib::Quaternion::slerp(a, b * -1.0f, t);
+		}
+		return mathLib::Quaternion::slerp(a, b, t);
+	}
+
+	static mathLib::Vec3 lerpVector(const mathLib::Vec3& a, const mathLib::Vec3& b, float t) {
+		return mathLib::Vec3(a.x + (b.x - a.x) * t, a.y + (b.y - a.y) * t, a.z + (b.z - a.z) * t);
+	}
+};
+
+class AnimationSequence
+{
+public:
+	// One contiguous block per clip holding three tightly packed streams, each laid out [frame][bone]:
+	// positions (Vec3), rotations (Quaternion), scales (Vec3)
+	std::vector<float> data;
+	int frameCount = 0;
+	int boneCount = 0;
+	float ticksPerSecond;
+
+	// Optional compressed form; when present it is sampled instead of the raw streams
+	CompressedClip compressed;
+	ClipCompressionStats compressionStats;
+
+	// Size the block once for the whole clip
+	void allocate(int frames, int bones) {
+		frameCount = frames;
+		boneCount = bones;
+		data.assign((size_t)frames * bones * (3 + 4 + 3), 0.0f);
+	}
+
+	mathLib::Vec3* positions(int frame = 0) {
+		return reinterpret_cast<mathLib::Vec3*>(&data[0]) + (size_t)frame * boneCount;
+	}
+
+	mathLib::Quaternion* rotations(int frame = 0) {
+		return reinterpret_cast<mathLib::Quaternion*>(&data[(size_t)frameCount * boneCount * 3]) + (size_t)frame * boneCount;
+	}
+
+	mathLib::Vec3* scales(int frame = 0) {
+		return reinterpret_cast<mathLib::Vec3*>(&data[(size_t)frameCount * boneCount * 7]) + (size_t)frame * boneCount;
+	}
+
+	mathLib::Vec3 interpolate(mathLib::Vec3 p1, mathLib::Vec3 p2, float t) {
+		return ((p1 * (1.0f - t)) + (p2 * t));
+	}
+
+	mathLib::Quaternion interpolate(const mathLib::Quaternion& q1, const mathLib::Quaternion& q2, float t) {
+		return mathLib::Quaternion::slerp(q1, q2, t);
+	}
+
+	float duration() {
+		return ((float)frameCount / ticksPerSecond);
+	}
+
+	void calcFrame(float t, int& frame, float& interpolationFact)
+	{
+		interpolationFact = t * ticksPerSecond;
+		frame = (int)floorf(interpolationFact);
+		interpolationFact = interpolationFact - (float)frame;
+		frame = min(frame, frameCount - 1);
+	}
+
+	int nextFrame(int frame)
+	{
+		return min(frame + 1, frameCount - 1);
+	}
+
+	void sampleRaw(int baseFrame, float interpolationFact, int boneIndex, mathLib::Vec3& position, mathLib::Quaternion& rotation, mathLib::Vec3& scale) {
+		int nextFrameIndex = nextFrame(baseFrame);
+		position = interpolate(positions(baseFrame)[boneIndex], positions(nextFrameIndex)[boneIndex], interpolationFact);
+		rotation = interpolate(rotations(baseFrame)[boneIndex], rotations(nextFrameIndex)[boneIndex], interpolationFact);
+		scale = interpolate(scales(baseFrame)[boneIndex], scales(nextFrameIndex)[boneIndex], interpolationFact);
+	}
+
+	// Local TRS of one bone, from the compressed clip when there is one
+	void sampleLocal(int baseFrame, float interpolationFact, int boneIndex, mathLib::Vec3& position, mathLib::Quaternion& rotation, mathLib::Vec3& scale) {
+		if (!compressed.empty()) {
+			float u = min((float)baseFrame + interpolationFact, (float)(frameCount - 1));
+			compressed.sample(boneIndex, u, position, rotation, scale);
+			return;
+		}
+		sampleRaw(baseFrame, interpolationFact, boneIndex, position, rotation, scale);
+	}
+
+	static mathLib::Matrix localToGlobal(const mathLib::Vec3& position, const mathLib::Quaternion& rotation, const mathLib::Vec3& scale,
+		mathLib::Matrix* matrices, Skeleton* skeleton, int boneIndex) {
+		mathLib::Matrix local = mathLib::Matrix::scaling(scale) * rotation.toMatrix() * mathLib::Matrix::translation(position);
+
+		if (skeleton->bones[boneIndex].parentIndex > -1) {
+			mathLib::Matrix global = local * matrices[skeleton->bones[boneIndex].parentIndex];
+			return global;
+		}
+		return local;
+	}
+
+	void samplePose(float t, AnimationPose& pose) {
+		int frame = 0;
+		float interpolationFact = 0;
+		calcFrame(t, frame, interpolationFact);
+		pose.resize(boneCount);
+		for (int i = 0; i < boneCount; i++) {
+			sampleLocal(frame, interpolationFact, i, pose.positions[i], pose.rotations[i], pose.scales[i]);
+		}
+	}
+
+	mathLib::Matrix interpolateBoneToGlobal(mathLib::Matrix* matrices, int baseFrame, float interpolationFact, Skeleton* skeleton, int boneIndex) {
+		mathLib::Vec3 position, scale;
+		mathLib::Quaternion rotation;
+		sampleLocal(baseFrame, interpolationFact, boneIndex, position, rotation, scale);
+		return localToGlobal(position, rotation, scale, matrices, skeleton, boneIndex);
+	}
+
+	// Builds the compressed form and measures the largest joint position error against the raw
+	// clip, at every frame and halfway between frames. Half frames where a bone flips hemisphere
+	// are skipped: the raw slerp is degenerate there. The raw block is released unless keepRaw.
+	ClipCompressionStats compress(Skeleton* skeleton, const ClipCompressionSettings& settings, bool keepRaw = false) {
+		if (frameCount == 0 || boneCount == 0 || frameCount > 65535 || data.empty()) {
+			return compressionStats;
+		}
+		compressionStats = compressed.build(positions(), rotations(), scales(), frameCount, boneCount, settings);
+
+		std::vector<mathLib::Matrix> rawGlobal(boneCount);
+		std::vector<mathLib::Matrix> packedGlobal(boneCount);
+		for (int step = 0; step < frameCount * 2 - 1; step++) {
+			int frame = step / 2;
+			float fact = (step & 1) ? 0.5f : 0.0f;
+			if (fact > 0.0f) {
+				bool flipped = false;
+				for (int i = 0; i < boneCount && !flipped; i++) {
+					flipped = rotations(frame)[i].dot(rotations(frame + 1)[i]) < 0.0f;
+				}
+				if (flipped) continue;
+			}
+			for (int i = 0; i < boneCount; i++) {
+				mathLib::Vec3 p, s;
+				mathLib::Quaternion q;
+				sampleRaw(frame, fact, i, p, q, s);
+				rawGlobal[i] = localToGlobal(p, q, s, &rawGlobal[0], skeleton, i);
+				compressed.sample(i, (float)frame + fact, p, q, s);
+				packedGlobal[i] = localToGlobal(p, q, s, &packedGlobal[0], skeleton, i);
+
+				mathLib::Vec3 d(rawGlobal[i].m[3] - packedGlobal[i].m[3], rawGlobal[i].m[7] - packedGlobal[i].m[7], rawGlobal[i].m[11] - packedGlobal[i].m[11]);
+				compressionStats.maxJointError = max(compressionStats.maxJointError, d.getLength());
+			}
+		}
+
+		if (!keepRaw) {
+			data.clear();
+			data.shrink_to_fit();
+		}
+		return compressionStats;
+	}
+};
+
+class Animation
+{
+public:
+	// Clips sit in one dense array. Names are resolved to indices once, so per-frame code never
+	// does string lookups, and unknown names cannot create empty clips.
+	std::vector<AnimationSequence> clips;
+	std::vector<std::string> clipNames;
+	std::map<std::string, int> clipIds;
+	Skeleton skeleton;
+
+	static const int INVALID_CLIP = -1;
+
+	int boneSize() {
+		return skeleton.bones.size();
+	}
+
+	// Adds a clip, or replaces the one with the same name, and returns its handle
+	int addClip(const std::string& name, AnimationSequence&& sequence) {
+		auto it = clipIds.find(name);
+		if (it != clipIds.end()) {
+			clips[it->second] = std::move(sequence);
+			return it->second;
+		}
+		clips.push_back(std::move(sequence));
+		clipNames.push_back(name);
+		clipIds[name] = (int)clips.size() - 1;
+		return (int)clips.size() - 1;
+	}
+
+	// Skeleton and clips from a loaded pack, one allocation and one copy per clip
+	void load(const GEMLoader::GEMPack& pack) {
+		const GEMLoader::GEMPackHeader& info = pack.info();
+		for (int i = 0; i < (int)info.boneCount; i++)
+		{
+			const GEMLoader::GEMPackBone& packBone = pack.bone(i);
+			Bone bone;
+			bone.name = pack.string(packBone.name);
+			memcpy(&bone.offset, &packBone.offset, 16 * sizeof(float));
+			bone.parentIndex = packBone.parentIndex;
+			skeleton.bones.push_back(bone);
+		}
+		skeleton.compile();
+
+		int bonesN = (int)info.boneCount;
+		for (int i = 0; i < (int)info.clipCount; i++)
+		{
+			const GEMLoader::GEMPackClip& packClip = pack.clip(i);
+			AnimationSequence aseq;
+			aseq.ticksPerSecond = packClip.ticksPerSecond;
+			aseq.allocate(packClip.frameCount, bonesN);
+			if (!aseq.data.empty())
+			{
+				memcpy(&aseq.data[0], pack.clipData(i), aseq.data.size() * sizeof(float));
+			}
+			addClip(pack.string(packClip.name), std::move(aseq));
+		}
+	}
+
+	// Returns INVALID_CLIP for unknown names; debug builds also report them
+	int findClip(const std::string& name) const {
+		auto it = clipIds.find(name);
+		if (it == clipIds.end()) {
+#if defined(_DEBUG)
+			std::cout << "Animation: unknown clip \"" << name << "\"" << std::endl;
+#endif
+			return INVALID_CLIP;
+		}
+		return it->second;
+	}
+
+	bool validClip(int clip) const {
+		return clip >= 0 && clip < (int)clips.size();
+	}
+
+	int clipCount() const {
+		return (int)clips.size();
+	}
+
+	const std::string& clipName(int clip) const {
+		return clipNames[clip];
+	}
+
+	void calcFrame(int clip, float t, int& frame, float& interpolationFact) {
+		clips[clip].calcFrame(t, frame, interpolationFact);
+	}
+
+	mathLib::Matrix interpolateBoneToGlobal(int clip, mathLib::Matrix* matrices, int baseFrame, float interpolationFact, int boneIndex) {
+		return clips[clip].interpolateBoneToGlobal(matrices, baseFrame, interpolationFact, &skeleton, boneIndex);
+	}
+
+	// Compresses every clip and reports the ratio and joint error of each
+	void compressClips(const ClipCompressionSettings& settings = ClipCompressionSettings(), bool keepRaw = false) {
+		for (int i = 0; i < clipCount(); i++) {
+			ClipCompressionStats stats = clips[i].compress(&skeleton, settings, keepRaw);
+			std::cout << "Clip " << clipNames[i] << ": " << stats.rawBytes << " -> " << stats.compressedBytes << " bytes ("
+				<< stats.ratio() << ":1), " << stats.keptKeys << "/" << stats.rawKeys << " keys, "
+				<< stats.constantTracks << "/" << stats.tracks << " constant tracks, max joint error " << stats.maxJointError << std::endl;
+		}
+	}
+
+	void calcFinalTransforms(mathLib::Matrix* matrices)
+	{
+		for (int i = 0; i < skeleton.bones.size(); i++)
+		{
+			matrices[i] = skeleton.bones[i].offset * matrices[i] * skeleton.globalInverse;
+		}
+	}
+
+	// Writes the skinning palette of one clip at time t into matrices[0..boneSize).
+	// Only reads shared data, so many palettes can be evaluated at once.
+	// frozenBones (compiled skeletons only) marks bones that keep their bind-local pose unsampled.
+	void evaluatePalette(AnimationSequence& sequence, float t, mathLib::Matrix* matrices, const char* frozenBones = nullptr)
+	{
+		int frame = 0;
+		float interpolationFact = 0;
+		sequence.calcFrame(t, frame, interpolationFact);
+
+		if (skeleton.compiled)
+		{
+			mathLib::Vec3 positions[256];
+			mathLib::Quaternion rotations[256];
+			mathLib::Vec3 scales[256];
+			for (int i = 0; i < boneSize(); i++)
+			{
+				if (frozenBones && frozenBones[i]) continue;
+				sequence.sampleLocal(frame, interpolationFact, i, positions[i], rotations[i], scales[i]);
+			}
+			buildPalette(positions, rotations, scales, matrices, frozenBones);
+			return;
+		}
+
+		for (int i = 0; i < boneSize(); i++)
+		{
+			matrices[i] = sequence.interpolateBoneToGlobal(matrices, frame, interpolationFact, &skeleton, i);
+		}
+
+		calcFinalTransforms(matrices);
+	}
+
+	// Hierarchy pass and final transforms for an already blended local pose
+	void evaluatePose(const AnimationPose& pose, mathLib::Matrix* matrices)
+	{
+		if (skeleton.compiled)
+		{
+			buildPalette(pose.positions.data(), pose.rotations.data(), pose.scales.data(), matrices);
+			return;
+		}
+
+		for (int i = 0; i < boneSize(); i++)
+		{
+			matrices[i] = AnimationSequence::localToGlobal(pose.positions[i], pose.rotations[i], pose.scales[i], matrices, &skeleton, i);
+		}
+
+		calcFinalTransforms(matrices);
+	}
+
+	// Fused pass for a compiled skeleton: local affine straight from TRS, globalInverse folded into
+	// the roots, then offset applied, all as 3x4 multiplies in topological order
+	void buildPalette(const mathLib::Vec3* positions, const mathLib::Quaternion* rotations, const mathLib::Vec3* scales, mathLib::Matrix* matrices,
+		const char* frozenBones = nullptr)
+	{
+		AffineTransform globals[Skeleton::MAX_BONES];
+		AffineTransform local;
+		for (size_t k = 0; k < skeleton.order.size(); k++)
+		{
+			int i = skeleton.order[k];
+			int parent = skeleton.bones[i].parentIndex;
+			if (frozenBones && frozenBones[i])
+			{
+				local = skeleton.bindLocals[i];
+			}
+			else
+			{
+				AffineTransform::fromTRS(positions[i], rotations[i], scales[i], local);
+			}
+			AffineTransform::multiply(parent > -1 ? globals[parent] : skeleton.inverse, local, globals[i].m);
+			// The top three rows are written straight into the palette matrix
+			AffineTransform::multiply(globals[i], skeleton.offsets[i], matrices[i].m);
+			matrices[i].m[12] = 0.0f;
+			matrices[i].m[13] = 0.0f;
+			matrices[i].m[14] = 0.0f;
+			matrices[i].m[15] = 1.0f;
+		}
+	}
+};
+
+// Shares evaluated palettes between instances of one Animation that play the same clip at nearly
+// the same time. Time is quantized into buckets of phaseTolerance seconds and each bucket is
+// evaluated once, at its centre, so an instance is off by at most half the tolerance.
+// Larger tolerances mean more sharing and coarser motion; 0 turns sharing off.
+class PoseCache
+{
+public:
+	Animation* animation;
+	float phaseTolerance = 1.0f / 120.0f;	// seconds
+	int maxEntries = 1024;		// trim() drops every entry beyond this
+
+	long long hits = 0;
+	long long misses = 0;
+	long long evictions = 0;
+
+	explicit PoseCache(Animation* _animation = nullptr) : animation(_animation) {}
+
+	// Palette for clip at time t, evaluated on a miss. Valid until the next trim() or clear().
+	const mathLib::Matrix* palette(int clip, float t) {
+		trim();
+		bool pending;
+		int slot = acquire(clip, t, pending);
+		if (pending) {
+			evaluate(slot);
+		}
+		return slots[slot].palette.data();
+	}
+
+	// Finds or reserves the slot for (clip, bucket of t). New slots are left pending so a batch
+	// can evaluate them together with evaluatePending.
+	int acquire(int clip, float t, bool& pending) {
+		int bucket = phaseTolerance > 0.0f ? (int)floorf(t / phaseTolerance) : 0;
+		float time = phaseTolerance > 0.0f ? (bucket + 0.5f) * phaseTolerance : t;
+		uint64_t key = ((uint64_t)(uint32_t)clip << 32) | (uint32_t)bucket;
+		if (phaseTolerance > 0.0f) {
+			auto it = lookup.find(key);
+			if (it != lookup.end()) {
+				hits++;
+				pending = slots[it->second].pending;
+				return it->second;
+			}
+		}
+		misses++;
+		if (used == (int)slots.size()) {
+			slots.push_back(Slot());
+		}
+		Slot& slot = slots[used];
+		slot.clip = clip;
+		slot.time = time;
+		slot.pending = true;
+		slot.palette.resize(animation->boneSize());
+		if (phaseTolerance > 0.0f) {
+			lookup[key] = used;
+		}
+		pendingSlots.push_back(used);
+		pending = true;
+		return used++;
+	}
+
+	void evaluate(int slot) {
+		Slot& s = slots[slot];
+		if (s.pending) {
+			animation->evaluatePalette(animation->clips[s.clip], s.time, s.palette.data());
+			s.pending = false;
+		}
+	}
+
+	void evaluatePending(JobSystem* jobs = nullptr) {
+		auto run = [this](int begin, int end) {
+			for (int i = begin; i < end; i++) {
+				evaluate(pendingSlots[i]);
+			}
+		};
+		if (jobs) {
+			jobs->parallelFor((int)pendingSlots.size(), 4, run);
+		}
+		else {
+			run(0, (int)pendingSlots.size());
+		}
+		pendingSlots.clear();
+	}
+
+	const mathLib::Matrix* slotPalette(int slot) const {
+		return slots[slot].palette.data();
+	}
+
+	// Forgets every entry once more than maxEntries are cached. Slot buffers are kept for reuse.
+	void trim() {
+		if (used > maxEntries) {
+			evictions += used;
+			clear();
+		}
+	}
+
+	void clear() {
+		used = 0;
+		lookup.clear();
+		pendingSlots.clear();
+	}
+
+	int size() const {
+		return used;
+	}
+
+	float hitRate() const {
+		long long total = hits + misses;
+		return total > 0 ? (float)hits / (float)total : 0.0f;
+	}
+
+	void resetCounters() {
+		hits = 0;
+		misses = 0;
+		evictions = 0;
+	}
+
+private:
+	struct Slot
+	{
+		int clip;
+		float time;
+		bool pending;
+		std::vector<mathLib::Matrix> palette;
+	};
+
+	std::vector<Slot> slots;
+	int used = 0;
+	std::unordered_map<uint64_t, int> lookup;
+	std::vector<int> pendingSlots;
+};
+
+struct AnimationLODTier
+{
+	float minScreenSize;	// projected radius over half the screen height; the first tier reached is used
+	float updateInterval;	// seconds between evaluations, 0 = every update
+	bool reducedSkeleton;	// leaf bones keep their bind-local pose
+};
+
+// Animation level of detail shared by the instances of one Animation. Distant instances evaluate
+// less often and show a blend of their last two palettes in between; the furthest also skip
+// the leaf bones. Per-tier counters record what each tier cost and saved.
+class AnimationLOD
+{
+public:
+	struct TierStats
+	{
+		long long updates = 0;
+		long long evaluations = 0;
+		long long bonesFrozen = 0;
+		double seconds = 0.0;
+	};
+
+	std::vector<AnimationLODTier> tiers;
+	std::vector<TierStats> stats;
+	std::vector<char> frozenBones;	// bones skipped by reduced-skeleton tiers
+
+	AnimationLOD() {
+		tiers.push_back({ 0.2f, 0.0f, false });
+		tiers.push_back({ 0.08f, 1.0f / 30.0f, false });
+		tiers.push_back({ 0.03f, 1.0f / 15.0f, true });
+		tiers.push_back({ 0.0f, 1.0f / 8.0f, true });
+		stats.resize(tiers.size());
+	}
+
+	// The reduced skeleton drops leaf bones below another bone (fingers, jaw, tail tips, toes).
+	// Needs a compiled skeleton; use setFrozen to adjust the choice.
+	void init(const Skeleton& skeleton) {
+		int count = (int)skeleton.bones.size();
+		std::vector<int> children(count, 0);
+		for (int i = 0; i < count; i++) {
+			if (skeleton.bones[i].parentIndex > -1) children[skeleton.bones[i].parentIndex]++;
+		}
+		frozenBones.assign(count, 0);
+		for (int i = 0; i < count; i++) {
+			frozenBones[i] = skeleton.compiled && children[i] == 0 && skeleton.bones[i].parentIndex > -1;
+		}
+		stats.assign(tiers.size(), TierStats());
+	}
+
+	void setFrozen(const Skeleton& skeleton, const std::string& boneName, bool frozen) {
+		for (size_t i = 0; i < skeleton.bones.size() && i < frozenBones.size(); i++) {
+			if (skeleton.bones[i].name == boneName) frozenBones[i] = frozen && skeleton.compiled;
+		}
+	}
+
+	int frozenCount() const {
+		int n = 0;
+		for (size_t i = 0; i < frozenBones.size(); i++) n += frozenBones[i];
+		return n;
+	}
+
+	// Picks a tier from the projected size of a bounding sphere; fovY in radians
+	int selectTier(const mathLib::Vec3& center, float radius, const mathLib::Vec3& cameraPosition, float fovY) const {
+		mathLib::Vec3 d(center.x - cameraPosition.x, center.y - cameraPosition.y, center.z - cameraPosition.z);
+		float distance = d.getLength();
+		if (distance <= radius) return 0;
+		float size = radius / (distance * tanf(fovY * 0.5f));
+		for (int i = 0; i < (int)tiers.size(); i++) {
+			if (size >= tiers[i].minScreenSize) return i;
+		}
+		return (int)tiers.size() - 1;
+	}
+
+	void record(int tier, bool evaluated, double seconds) {
+		if (stats.size() != tiers.size()) stats.resize(tiers.size());
+		TierStats& s = stats[tier];
+		s.updates++;
+		s.seconds += seconds;
+		if (evaluated) {
+			s.evaluations++;
+			if (tiers[tier].reducedSkeleton) s.bonesFrozen += frozenCount();
+		}
+	}
+
+	// Time saved per tier, against the measured cost of a full update in tier 0
+	void report() const {
+		double fullCost = stats.size() > 0 && stats[0].updates > 0 ? stats[0].seconds / stats[0].updates : 0.0;
+		for (size_t i = 0; i < stats.size(); i++) {
+			const TierStats& s = stats[i];
+			std::cout << "LOD tier " << i << ": " << s.updates << " updates, " << s.evaluations << " evaluations, "
+				<< s.bonesFrozen << " bones frozen, " << s.seconds * 1000.0 << " ms";
+			if (fullCost > 0.0) {
+				std::cout << ", saved " << (s.updates * fullCost - s.seconds) * 1000.0 << " ms";
+			}
+			std::cout << std::endl;
+		}
+	}
+
+	void resetStats() {
+		stats.assign(tiers.size(), TierStats());
+	}
+};
+
+// A clip played on top of the base animation, either blended in (override) or added as a
+// difference from the clip's first frame (additive)
+struct AnimationLayer
+{
+	int clip;
+	float t = 0.0f;
+	float weight = 1.0f;
+	bool additive = false;
+	const BoneMask* mask = nullptr;
+};
+
+class AnimationInstance
+{
+public:
+	Animation* animation;
+	std::string currentAnimation;	// name of currentClip, so update by name only looks up on change
+	int currentClip = Animation::INVALID_CLIP;
+	mathLib::Matrix matrices[256];
+	float t;
+
+	// Clip switches cross-fade over this many seconds; 0 snaps like before
+	float crossFadeDuration = 0.2f;
+	std::vector<AnimationLayer> layers;
+
+	// Optional cache shared with other instances of the same Animation; only used for plain
+	// single-clip playback
+	PoseCache* poseCache = nullptr;
+
+	// Optional LOD; set lodTier before each update (e.g. from AnimationLOD::selectTier).
+	// Only plain single-clip playback is reduced; fades and layers always run at full quality.
+	AnimationLOD* lod = nullptr;
+	int lodTier = 0;
+
+	// Clip being faded out
+	int previousClip = Animation::INVALID_CLIP;
+	float previousT = 0.0f;
+	float fadeTime = 0.0f;
+	bool fading = false;
+
+	// Reused between updates so blending does not allocate
+	AnimationPose pose;
+	AnimationPose layerPose;
+	AnimationPose referencePose;
+
+	// Last two palettes evaluated by a reduced-rate LOD tier
+	std::vector<mathLib::Matrix> lodFrom;
+	std::vector<mathLib::Matrix> lodTo;
+	float lodElapsed = 0.0f;
+	int lodClip = Animation::INVALID_CLIP;
+	int lodLastTier = -1;
+
+	int addLayer(int clip, float weight, bool additive = false, const BoneMask* mask = nullptr) {
+		if (!animation->validClip(clip)) {
+			return -1;
+		}
+		AnimationLayer layer;
+		layer.clip = clip;
+		layer.weight = weight;
+		layer.additive = additive;
+		layer.mask = mask;
+		layers.push_back(layer);
+		return (int)layers.size() - 1;
+	}
+
+	void resetAnimationTime()
+	{
+		t = 0;
+	}
+
+	bool animationFinished()
+	{
+		if (t > animation->clips[currentClip].duration())
+		{
+			return true;
+		}
+		return false;
+	}
+
+	int addLayer(const std::string& clip, float weight, bool additive = false, const BoneMask* mask = nullptr) {
+		return addLayer(animation->findClip(clip), weight, additive, mask);
+	}
+
+	// Resolves the name only when it differs from the current one. Unknown names leave the
+	// palette untouched.
+	void update(const std::string& name, float dt) {
+		if (name != currentAnimation) {
+			int clip = animation->findClip(name);
+			if (clip == Animation::INVALID_CLIP) {
+				currentAnimation = name;
+				currentClip = clip;
+				return;
+			}
+			update(clip, dt);
+			return;
+		}
+		update(currentClip, dt);
+	}
+
+	void update(int clip, float dt) {
+		if (!animation->validClip(clip)) {
+			return;
+		}
+		if (clip == currentClip) {
+			t += dt;
+		}
+		else {
+			if (crossFadeDuration > 0.0f && currentClip != Animation::INVALID_CLIP) {
+				previousClip = currentClip;
+				previousT = t;
+				fadeTime = 0.0f;
+				fading = true;
+			}
+			currentClip = clip;
+			currentAnimation = animation->clipName(clip);
+			t = 0;
+		}
+		if (animationFinished() == true) {
+			resetAnimationTime();
+		}
+
+		if (fading) {
+			fadeTime += dt;
+			previousT += dt;
+			if (previousT > animation->clips[previousClip].duration()) {
+				previousT = 0.0f;
+			}
+			fading = fadeTime < crossFadeDuration;
+		}
+
+		AnimationSequence& sequence = animation->clips[clip];
+		if (!fading && layers.empty()) {
+			if (lod) {
+				updateLOD(clip, sequence, dt);
+				return;
+			}
+			if (poseCache) {
+				memcpy(matrices, poseCache->palette(clip, t), animation->boneSize() * sizeof(mathLib::Matrix));
+				return;
+			}
+			animation->evaluatePalette(sequence, t, matrices);
+			return;
+		}
+
+		if (fading) {
+			animation->clips[previousClip].samplePose(previousT, pose);
+			sequence.samplePose(t, layerPose);
+			pose.blend(layerPose, fadeTime / crossFadeDuration);
+		}
+		else {
+			sequence.samplePose(t, pose);
+		}
+
+		for (size_t i = 0; i < layers.size(); i++) {
+			AnimationLayer& layer = layers[i];
+			AnimationSequence& layerSequence = animation->clips[layer.clip];
+			layer.t += dt;
+			if (layer.t > layerSequence.duration()) {
+				layer.t = 0.0f;
+			}
+			if (layer.weight <= 0.0f) continue;
+			layerSequence.samplePose(layer.t, layerPose);
+			if (layer.additive) {
+				layerSequence.samplePose(0.0f, referencePose);
+				pose.addLayer(layerPose, referencePose, layer.weight, layer.mask);
+			}
+			else {
+				pose.blend(layerPose, layer.weight, layer.mask);
+			}
+		}
+
+		animation->evaluatePose(pose, matrices);
+	}
+
+private:
+	void updateLOD(int clip, AnimationSequence& sequence, float dt) {
+		auto start = std::chrono::high_resolution_clock::now();
+		int tierIndex = mathLib::clamp(lodTier, 0, (int)lod->tiers.size() - 1);
+		const AnimationLODTier& tier = lod->tiers[tierIndex];
+		const char* frozen = tier.reducedSkeleton && !lod->frozenBones.empty() ? lod->frozenBones.data() : nullptr;
+		int bones = animation->boneSize();
+		bool evaluated = true;
+
+		if (tier.updateInterval <= 0.0f && !frozen) {
+			if (poseCache) {
+				memcpy(matrices, poseCache->palette(clip, t), bones * sizeof(mathLib::Matrix));
+			}
+			else {
+				animation->evaluatePalette(sequence, t, matrices);
+			}
+			lodLastTier = -1;
+		}
+		else {
+			lodFrom.resize(bones);
+			lodTo.resize(bones);
+			bool restart = clip != lodClip || tierIndex != lodLastTier;
+			lodElapsed += dt;
+			evaluated = restart || lodElapsed >= tier.updateInterval;
+			if (evaluated) {
+				if (!restart) lodFrom.swap(lodTo);
+				animation->evaluatePalette(sequence, t, lodTo.data(), frozen);
+				if (restart) {
+					lodFrom = lodTo;
+					lodElapsed = 0.0f;
+				}
+				else {
+					lodElapsed -= tier.updateInterval;
+					if (lodElapsed >= tier.updateInterval) lodElapsed = 0.0f;
+				}
+				lodClip = clip;
+				lodLastTier = tierIndex;
+			}
+
+			// Blend of the last two evaluations, one interval behind
+			float alpha = tier.updateInterval > 0.0f ? mathLib::clamp(lodElapsed / tier.updateInterval, 0.0f, 1.0f) : 1.0f;
+			const float* from = lodFrom[0].m;
+			const float* to = lodTo[0].m;
+			float* out = matrices[0].m;
+			for (int i = 0; i < bones * 16; i++) {
+				out[i] = from[i] + (to[i] - from[i]) * alpha;
+			}
+		}
+
+		std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+		lod->record(tierIndex, evaluated, elapsed.count());
+	}
+};
+
+// Updates many animated instances at once. Each instance has its own clip and time, and all
+// palettes live back to back in one buffer, boneSize matrices per instance.
+class AnimationBatch
+{
+public:
+	struct Entry
+	{
+		Animation* animation;
+		int clip;
+		float t;
+		float speed;
+		int paletteOffset;
+	};
+
+	std::vector<Entry> entries;
+	std::vector<mathLib::Matrix> palettes;
+	int instancesPerJob = 8;
+
+	// Entries of poseCache->animation share palettes through the cache when set
+	PoseCache* poseCache = nullptr;
+
+	// The bones constant buffer is always MAX_PALETTE matrices long, so the buffer keeps that
+	// much tail room and any palette(id) can be uploaded directly
+	static const int MAX_PALETTE = 256;
+
+	// Returns the instance id, or -1 for an unknown clip
+	int add(Animation* animation, int clip, float t = 0.0f) {
+		if (!animation->validClip(clip)) {
+			return -1;
+		}
+		Entry entry;
+		entry.animation = animation;
+		entry.clip = clip;
+		entry.t = t;
+		entry.speed = 1.0f;
+		entry.paletteOffset = entries.empty() ? 0 : entries.back().paletteOffset + entries.back().animation->boneSize();
+		entries.push_back(entry);
+		palettes.resize(entry.paletteOffset + animation->boneSize() + MAX_PALETTE);
+		return (int)entries.size() - 1;
+	}
+
+	int add(Animation* animation, const std::string& clip, float t = 0.0f) {
+		return add(animation, animation->findClip(clip), t);
+	}
+
+	void setClip(int id, int clip) {
+		if (entries[id].animation->validClip(clip) && clip != entries[id].clip) {
+			entries[id].clip = clip;
+			entries[id].t = 0.0f;
+		}
+	}
+
+	mathLib::Matrix* palette(int id) {
+		return &palettes[entries[id].paletteOffset];
+	}
+
+	int size() const {
+		return (int)entries.size();
+	}
+
+	// Advances every instance by dt and evaluates its palette, across the pool when one is given
+	void update(float dt, JobSystem* jobs = nullptr) {
+		if (poseCache) {
+			updateCached(dt, jobs);
+			return;
+		}
+		auto evaluate = [this, dt](int begin, int end) {
+			for (int i = begin; i < end; i++) {
+				Entry& entry = entries[i];
+				AnimationSequence& sequence = entry.animation->clips[entry.clip];
+				entry.t += dt * entry.speed;
+				if (entry.t > sequence.duration()) {
+					entry.t = 0.0f;
+				}
+				entry.animation->evaluatePalette(sequence, entry.t, &palettes[entry.paletteOffset]);
+			}
+		};
+		if (jobs) {
+			jobs->parallelFor((int)entries.size(), instancesPerJob, evaluate);
+		}
+		else {
+			evaluate(0, (int)entries.size());
+		}
+	}
+
+private:
+	std::vector<int> entrySlots;
+
+	// Cache lookups run serially so slot assignment is deterministic; the distinct palettes are
+	// then evaluated, and copied out, in parallel
+	void updateCached(float dt, JobSystem* jobs) {
+		poseCache->trim();
+		entrySlots.resize(entries.size());
+		for (size_t i = 0; i < entries.size(); i++) {
+			Entry& entry = entries[i];
+			AnimationSequence& sequence = entry.animation->clips[entry.clip];
+			entry.t += dt * entry.speed;
+			if (entry.t > sequence.duration()) {
+				entry.t = 0.0f;
+			}
+			bool pending;
+			entrySlots[i] = entry.animation == poseCache->animation ? poseCache->acquire(entry.clip, entry.t, pending) : -1;
+		}
+		poseCache->evaluatePending(jobs);
+
+		auto copyOut = [this](int begin, int end) {
+			for (int i = begin; i < end; i++) {
+				Entry& entry = entries[i];
+				if (entrySlots[i] < 0) {
+					entry.animation->evaluatePalette(entry.animation->clips[entry.clip], entry.t, &palettes[entry.paletteOffset]);
+					continue;
+				}
+				memcpy(&palettes[entry.paletteOffset], poseCache->slotPalette(entrySlots[i]), entry.animation->boneSize() * sizeof(mathLib::Matrix));
+			}
+		};
+		if (jobs) {
+			jobs->parallelFor((int)entries.size(), instancesPerJob * 4, copyOut);
+		}
+		else {
+			copyOut(0, (int)entries.size());
+		}
+	}
+};
@@ -0,0 +1,272 @@
+#pragma once
+#include "jobSystem.h"
+#include "texture.h"
+#include "mesh.h"
+#include "animation.h"
+#include "GEMPack.h"
+#include <map>
+#include <memory>
+#include <set>
+
+// Loads models and textures in the background. File reads, pack cooking, image decoding, collision
+// BVHs and clip setup run on the job system; everything that touches the device is queued and run
+// by pump() on the thread that owns it. Requests return handles. Targets passed in must stay put
+// and should not be used until their handle is ready. Meshes are shared through modelCache, or
+// through a cache of the loader's own if none is given.
+class AssetLoader
+{
+public:
+	AssetLoader(JobSystem& jobSystem, DxCore& device, TextureManager& textureManager, ModelCache* modelCache = nullptr)
+		: jobs(jobSystem), core(device), textures(textureManager), staticModels(modelCache ? *modelCache : ownModels) {
+	}
+
+	// Same as TextureManager::loadTexture; a file that is already loaded or requested is shared
+	int loadTexture(const std::string& filename, bool isNormalMap = false) {
+		return requestTexture(filename, isNormalMap, false);
+	}
+
+	// Same as TextureManager::loadNormalTexture: a missing normal map is not an error
+	int loadNormalTexture(const std::string& baseTextureName) {
+		return requestTexture(TextureManager::normalMapName(baseTextureName), true, true);
+	}
+
+	// LoadMesh::Init in the background. Its textures (and normal maps, if asked) are requested when
+	// the model arrives; the handle is ready once the buffers exist, finish() waits for the textures
+	// too. Requests for the same file share one pack, StaticModel and collision shape, and a file
+	// already in the model cache is placed straight away.
+	int loadMesh(LoadMesh& target, const std::string& filename, CollisionShapeCache* collisionShapes = nullptr, bool normalMaps = false) {
+		int handle = newHandle();
+		LoadMesh* mesh = &target;
+		mesh->planeWorld.identity();
+		mesh->model = staticModels.acquire(filename);
+		mesh->collisionShape = collisionShapes ? collisionShapes->find(filename) : nullptr;
+		auto request = models.find(filename);
+		bool building = request != models.end() && !request->second->loaded;
+		if (mesh->model && (!collisionShapes || mesh->collisionShape) && !building) {
+			requestModelTextures(mesh->model->textureFilenames, normalMaps);
+			ready[handle] = 1;
+			return handle;
+		}
+
+		std::shared_ptr<ModelRequest> model = requestModel(filename, collisionShapes);
+		whenLoaded(model, [this, handle, mesh, model, filename, normalMaps]() {
+			mesh->collisionShape = model->shape;
+			if (!mesh->model) mesh->model = staticModels.acquire(filename);
+			if (!mesh->model) mesh->model = staticModels.add(core, filename, model->opened ? model->pack.get() : nullptr);
+			requestModelTextures(mesh->model->textureFilenames, normalMaps);
+			ready[handle] = 1;
+		});
+		return handle;
+	}
+
+	// LoadAnimation::Init in the background; the skeleton and clips are built on the worker
+	int loadAnimation(LoadAnimation& target, const std::string& filename, bool compressClips = false, bool normalMaps = false) {
+		int handle = newHandle();
+		LoadAnimation* animated = &target;
+		animated->planeWorld.identity();
+		std::shared_ptr<GEMLoader::GEMPack> pack = std::make_shared<GEMLoader::GEMPack>();
+		startJob([this, handle, animated, pack, filename, compressClips, normalMaps]() {
+			bool loaded = pack->openOrCook(filename);
+			if (loaded) animated->loadAnimationData(*pack, compressClips);
+			queueMain([this, handle, animated, pack, loaded, normalMaps]() {
+				if (loaded) {
+					animated->createBuffers(core, *pack);
+					requestModelTextures(animated->textureFilenames, normalMaps);
+				}
+				ready[handle] = 1;
+			});
+		});
+		return handle;
+	}
+
+	bool isReady(int handle) const {
+		return ready[handle] != 0;
+	}
+
+	// Requests still in flight, including textures models asked for
+	int pending() const {
+		return outstanding;
+	}
+
+	// Runs the device work queued by finished jobs; call every frame while loading. A job system
+	// without workers only runs jobs inside finish().
+	void pump() {
+		std::vector<std::function<void()>> work;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			work.swap(mainQueue);
+		}
+		for (size_t i = 0; i < work.size(); i++) {
+			work[i]();
+			outstanding--;
+		}
+	}
+
+	// Blocks until every request and everything it led to is done
+	void finish() {
+		while (outstanding > 0) {
+			jobs.wait();
+			pump();
+		}
+	}
+
+private:
+	// One pack and collision shape per file, shared by every request for it
+	struct ModelRequest {
+		std::shared_ptr<GEMLoader::GEMPack> pack;
+		TriangleMeshShape* shape = nullptr;
+		TriangleMeshShape* unbuiltShape = nullptr;  // asked for while the pack was still loading
+		bool loaded = false;  // pack open and shape built; cleared again while a late shape builds
+		bool opened = false;  // set by the worker before loaded
+		std::vector<std::function<void()>> waiting;
+	};
+
+	JobSystem& jobs;
+	DxCore& core;
+	TextureManager& textures;
+	ModelCache ownModels;
+	ModelCache& staticModels;
+	std::vector<char> ready;
+	std::map<std::string, std::shared_ptr<ModelRequest>> models;  // packs stay mapped while the loader lives
+	std::set<std::string> requestedTextures;
+	int outstanding = 0;  // jobs started and main-thread steps not yet run; owning thread only
+
+	std::mutex mutex;
+	std::vector<std::function<void()>> mainQueue;
+
+	int newHandle() {
+		ready.push_back(0);
+		return (int)ready.size() - 1;
+	}
+
+	// Counts as outstanding until the main-thread step it ends with has run
+	template<typename Fn>
+	void startJob(Fn job) {
+		outstanding++;
+		jobs.submit(job);
+	}
+
+	void queueMain(std::function<void()> work) {
+		std::lock_guard<std::mutex> lock(mutex);
+		mainQueue.push_back(std::move(work));
+	}
+
+	int requestTexture(const std::string& filename, bool isNormalMap, bool optional) {
+		int handle = newHandle();
+		if (textures.contains(filename) || !requestedTextures.insert(filename).second) {
+			ready[handle] = 1;
+			return handle;
+		}
+		std::shared_ptr<TextureData> data = std::make_shared<TextureData>();
+		startJob([this, handle, filename, isNormalMap, optional, data]() {
+			bool decoded = data->decode(filename);
+			queueMain([this, handle, filename, isNormalMap, optional, data, decoded]() {
+				Texture* texture = new Texture();
+				if (decoded) {
+					texture->upload(filename, *data, &core, isNormalMap);
+				}
+				else {
+					std::cout << "Failed to load texture file: " << filename << std::endl;
+					texture->srv = nullptr;
+				}
+				if (optional && texture->srv == nullptr) delete texture;
+				else textures.addTexture(filename, texture);
+				ready[handle] = 1;
+			});
+		});
+		return handle;
+	}
+
+	void requestModelTextures(const std::vector<std::string>& names, bool normalMaps) {
+		for (size_t i = 0; i < names.size(); i++) {
+			requestTexture(names[i], false, false);
+			if (normalMaps) loadNormalTexture(names[i]);
+		}
+	}
+
+	std::shared_ptr<ModelRequest> requestModel(const std::string& filename, CollisionShapeCache* collisionShapes) {
+		auto it = models.find(filename);
+		if (it != models.end()) {
+			// A shape cache given only to a later request still gets a shape
+			if (collisionShapes && !it->second->shape) {
+				std::shared_ptr<ModelRequest> model = it->second;
+				TriangleMeshShape* shape = collisionShapes->find(filename);
+				if (!shape) {
+					// Requests for the file are held back until the shape is filled in
+					shape = collisionShapes->create(filename);
+					if (model->loaded) {
+						model->loaded = false;
+						buildShape(model, shape);
+					}
+					else {
+						model->unbuiltShape = shape;
+					}
+				}
+				model->shape = shape;
+			}
+			return it->second;
+		}
+
+		std::shared_ptr<ModelRequest> model = std::make_shared<ModelRequest>();
+		model->pack = std::make_shared<GEMLoader::GEMPack>();
+		models.insert({ filename, model });
+
+		// The cache is only touched here; the worker fills the new, still unshared shape
+		TriangleMeshShape* newShape = nullptr;
+		if (collisionShapes) {
+			model->shape = collisionShapes->find(filename);
+			if (!model->shape) newShape = model->shape = collisionShapes->create(filename);
+		}
+		startJob([this, model, filename, newShape]() {
+			model->opened = model->pack->openOrCook(filename);
+			if (model->opened && newShape) {
+				StaticModel::buildCollisionShape(*model->pack, *newShape);
+			}
+			queueMain([this, model]() {
+				if (model->unbuiltShape) {
+					buildShape(model, model->unbuiltShape);
+					model->unbuiltShape = nullptr;
+				}
+				else {
+					finishModel(model);
+				}
+			});
+		});
+		return model;
+	}
+
+	// Fills in a shape asked for after the pack job started; the model counts as loaded once it is done
+	void buildShape(const std::shared_ptr<ModelRequest>& model, TriangleMeshShape* shape) {
+		startJob([this, model, shape]() {
+			if (model->opened) StaticModel::buildCollisionShape(*model->pack, *shape);
+			queueMain([this, model]() {
+				finishModel(model);
+			});
+		});
+	}
+
+	void finishModel(const std::shared_ptr<ModelRequest>& model) {
+		model->loaded = true;
+		for (size_t i = 0; i < model->waiting.size(); i++) {
+			model->waiting[i]();
+		}
+		model->waiting.clear();
+	}
+
+	// Runs fn on the owning thread once the model's pack is open and its shape built
+	void whenLoaded(const std::shared_ptr<ModelRequest>& model, std::function<void()> fn) {
+		outstanding++;
+		if (model->loaded) {
+			// pump() counts it off; a shape requested before then sends it back to wait
+			queueMain([this, model, fn]() {
+				if (model->loaded) fn();
+				else whenLoaded(model, fn);
+			});
+			return;
+		}
+		model->waiting.push_back([this, fn]() {
+			fn();
+			outstanding--;
+		});
+	}
+};
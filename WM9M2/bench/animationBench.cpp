@@ -0,0 +1,147 @@
+// Per-instance cost of blended against single-clip animation updates on the TRex: plain playback,
+// a cross-fade between two clips, a masked override layer and an additive layer, next to two
+// separate palette evaluations (what a blend done after the hierarchy walk would cost). It also
+// counts heap allocations in the steady-state updates, which should be zero.
+//
+// animation.h pulls in mesh.h and so the DirectX headers, but nothing here creates a device. From
+// this directory's parent, in a developer command prompt:
+//
+//   cl /O2 /EHsc bench\animationBench.cpp mathLib.cpp adapter.cpp
+//
+// Run it from the directory that holds Models/.
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include "../animation.h"
+
+static size_t allocations = 0;
+
+// Kept out of line: once g++ inlines malloc() or free() into std::allocator it reports
+// -Wmismatched-new-delete against the operator new or delete on the other side
+#ifdef _MSC_VER
+#define BENCH_NOINLINE __declspec(noinline)
+#else
+#define BENCH_NOINLINE __attribute__((noinline))
+#endif
+BENCH_NOINLINE void* operator new(size_t size) {
+	allocations++;
+	void* p = malloc(size ? size : 1);
+	if (!p) throw std::bad_alloc();
+	return p;
+}
+void* operator new[](size_t size) { return operator new(size); }
+BENCH_NOINLINE void operator delete(void* p) noexcept { free(p); }
+BENCH_NOINLINE void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p) noexcept { operator delete(p); }
+void operator delete[](void* p, size_t) noexcept { operator delete(p); }
+
+namespace {
+	const int INSTANCES = 64;
+	const int FRAMES = 200;
+	const int PASSES = 10;
+	const float DT = 1.0f / 60.0f;
+
+	struct Result {
+		double microseconds;
+		size_t allocations;
+	};
+
+	// Runs FRAMES updates over every instance after one warm-up frame that sizes the buffers, and
+	// keeps the fastest of PASSES runs
+	template<typename Update>
+	Result measure(std::vector<AnimationInstance>& instances, Update update) {
+		for (size_t i = 0; i < instances.size(); i++) update(instances[i]);
+		size_t before = allocations;
+		double best = 1e30;
+		for (int pass = 0; pass < PASSES; pass++) {
+			auto t0 = std::chrono::high_resolution_clock::now();
+			for (int frame = 0; frame < FRAMES; frame++) {
+				for (size_t i = 0; i < instances.size(); i++) update(instances[i]);
+			}
+			double us = std::chrono::duration<double, std::micro>(std::chrono::high_resolution_clock::now() - t0).count();
+			best = us < best ? us : best;
+		}
+		Result result = { best / ((double)FRAMES * instances.size()), allocations - before };
+		return result;
+	}
+
+	void print(const char* name, const Result& result, double baseline) {
+		printf("%-28s %7.2f us  %5.2fx  %zu allocations\n", name, result.microseconds, result.microseconds / baseline, result.allocations);
+	}
+}
+
+int main() {
+	GEMLoader::GEMPack pack;
+	if (!pack.openOrCook("Models/TRex.gem")) {
+		printf("Models/TRex.gem not found\n");
+		return 1;
+	}
+	LoadAnimation trex;
+	trex.loadAnimationData(pack);
+	Animation& animation = trex.animation;
+	int idle = animation.findClip("Idle");
+	int run = animation.findClip("Run");
+	int roar = animation.findClip("roar");
+	if (idle == Animation::INVALID_CLIP || run == Animation::INVALID_CLIP || roar == Animation::INVALID_CLIP) {
+		printf("TRex clips missing\n");
+		return 1;
+	}
+
+	BoneMask upperBody;
+	upperBody.setBranch(animation.skeleton, "Spin2", 1.0f);
+
+	std::vector<AnimationInstance> instances(INSTANCES);
+	std::vector<mathLib::Matrix> scratch(animation.boneSize());
+	auto reset = [&](float crossFade) {
+		for (size_t i = 0; i < instances.size(); i++) {
+			AnimationInstance& instance = instances[i];
+			instance.animation = &animation;
+			instance.layers.clear();
+			instance.crossFadeDuration = crossFade;
+			instance.currentClip = Animation::INVALID_CLIP;
+			instance.currentAnimation.clear();
+			instance.fading = false;
+			instance.t = 0.0f;
+			// Spread the instances over the clip so they do not all sample the same frame
+			instance.update(run, 0.37f * i);
+		}
+	};
+
+	reset(0.0f);
+	Result single = measure(instances, [&](AnimationInstance& instance) {
+		instance.update(run, DT);
+	});
+
+	// Two evaluations of the full palette per instance: the cost without local-space blending
+	Result twoPalettes = measure(instances, [&](AnimationInstance& instance) {
+		instance.update(run, DT);
+		animation.evaluatePalette(animation.clips[idle], instance.t, scratch.data());
+	});
+
+	// A fade long enough to last the whole run
+	reset(1e6f);
+	Result crossFade = measure(instances, [&](AnimationInstance& instance) {
+		instance.update(idle, DT);
+	});
+
+	reset(0.0f);
+	for (size_t i = 0; i < instances.size(); i++) instances[i].addLayer(roar, 0.7f, false, &upperBody);
+	Result masked = measure(instances, [&](AnimationInstance& instance) {
+		instance.update(run, DT);
+	});
+
+	reset(0.0f);
+	for (size_t i = 0; i < instances.size(); i++) instances[i].addLayer(roar, 0.5f, true);
+	Result additive = measure(instances, [&](AnimationInstance& instance) {
+		instance.update(run, DT);
+	});
+
+	printf("TRex, %d bones, %d instances, best of %d x %d frames\n", animation.boneSize(), INSTANCES, PASSES, FRAMES);
+	print("single clip", single, single.microseconds);
+	print("two palettes (no blending)", twoPalettes, single.microseconds);
+	print("cross-fade Run -> Idle", crossFade, single.microseconds);
+	print("override layer, masked", masked, single.microseconds);
+	print("additive layer", additive, single.microseconds);
+	return 0;
+}
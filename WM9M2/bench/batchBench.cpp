@@ -0,0 +1,108 @@
+// AnimationBatch::update cost against instance count and worker count: 1 to 1000 TRex instances,
+// each on its own clip and start time, evaluated inline and then across 1, 2, 4, ... workers. Every
+// run starts from the same batch; the palettes are hashed so runs can be checked against inline.
+//
+// Only animationCore.h is needed, so this builds without the DirectX headers. From this directory's
+// parent:
+//
+//   cl /O2 /EHsc bench\batchBench.cpp mathLib.cpp
+//   g++ -std=c++14 -O2 bench/batchBench.cpp mathLib.cpp -o batchBench -pthread
+//
+// batchBench [max instances] [max workers] runs 1, 10, 100, ... instances up to max instances
+// (default 1000) and 0 (inline), 1, 2, 4, ... workers up to max workers, which defaults to
+// hardware_concurrency - 1. Speed-up only shows on a machine with that many free cores.
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "../animationCore.h"
+
+namespace {
+	const int FRAMES = 60;
+	const int PASSES = 3;
+	const float DT = 1.0f / 60.0f;
+
+	struct Run {
+		double microseconds;
+		unsigned long long hash;
+	};
+
+	Run runBatch(Animation& animation, int instanceCount, JobSystem* pool) {
+		AnimationBatch batch;
+		for (int i = 0; i < instanceCount; i++) {
+			batch.add(&animation, i % animation.clips.size(), i * 0.013f);
+		}
+
+		// One frame to touch the palettes before timing
+		batch.update(DT, pool);
+		double best = 0.0;
+		for (int pass = 0; pass < PASSES; pass++) {
+			auto t0 = std::chrono::high_resolution_clock::now();
+			for (int frame = 0; frame < FRAMES; frame++) {
+				batch.update(DT, pool);
+			}
+			double us = std::chrono::duration<double, std::micro>(std::chrono::high_resolution_clock::now() - t0).count() / FRAMES;
+			if (pass == 0 || us < best) best = us;
+		}
+
+		Run run = { best, 1469598103934665603ull };
+		int bones = animation.boneSize();
+		for (int i = 0; i < instanceCount; i++) {
+			const mathLib::Matrix* palette = batch.palette(i);
+			for (int b = 0; b < bones; b++) {
+				unsigned int bits[16];
+				memcpy(bits, palette[b].m, sizeof(bits));
+				for (int k = 0; k < 16; k++) run.hash = (run.hash ^ bits[k]) * 1099511628211ull;
+			}
+		}
+		return run;
+	}
+}
+
+int main(int argc, char** argv) {
+	int maxInstances = argc > 1 ? atoi(argv[1]) : 1000;
+	int hardware = (int)std::thread::hardware_concurrency();
+	int maxWorkers = argc > 2 ? atoi(argv[2]) : (hardware > 1 ? hardware - 1 : 0);
+
+	GEMLoader::GEMPack pack;
+	if (!pack.openOrCook("Models/TRex.gem")) {
+		printf("Models/TRex.gem not found; run from the directory holding Models\n");
+		return 1;
+	}
+	Animation animation;
+	animation.load(pack);
+	if (animation.clips.empty()) {
+		printf("Models/TRex.gem has no clips\n");
+		return 1;
+	}
+	printf("TRex, %d bones, %d clips, best of %d x %d frames, %d hardware threads\n", animation.boneSize(), (int)animation.clips.size(), PASSES, FRAMES, hardware);
+
+	std::vector<int> workerCounts;
+	workerCounts.push_back(0);
+	for (int w = 1; w < maxWorkers; w *= 2) workerCounts.push_back(w);
+	if (maxWorkers > 0) workerCounts.push_back(maxWorkers);
+
+	// Pools are built once; JobSystem(0) would pick the hardware default, so inline runs pass none
+	std::vector<std::unique_ptr<JobSystem>> pools(workerCounts.size());
+	for (size_t w = 1; w < workerCounts.size(); w++) {
+		pools[w].reset(new JobSystem(workerCounts[w]));
+	}
+
+	printf("%10s %8s %12s %12s %8s  %s\n", "instances", "workers", "frame", "per instance", "speed-up", "palettes");
+	bool identical = true;
+	for (int instanceCount = 1; instanceCount <= maxInstances; instanceCount *= 10) {
+		Run inlineRun = { 0.0, 0 };
+		for (size_t w = 0; w < workerCounts.size(); w++) {
+			Run run = runBatch(animation, instanceCount, pools[w].get());
+			if (w == 0) inlineRun = run;
+			bool same = run.hash == inlineRun.hash;
+			identical = identical && same;
+			printf("%10d %8d %9.1f us %9.3f us %7.2fx  %s\n", instanceCount, workerCounts[w], run.microseconds, run.microseconds / instanceCount,
+				inlineRun.microseconds / run.microseconds, same ? "match inline" : "DIFFER");
+		}
+	}
+	return identical ? 0 : 1;
+}
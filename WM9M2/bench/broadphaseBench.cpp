@@ -0,0 +1,78 @@
+// Broadphase query cost against object count: a forest of static boxes at constant density, from
+// 10 to 1M objects, queried with player-sized boxes through CollisionWorld::queryOverlaps and
+// through a linear scan of the object list. Results are checked against the scan.
+//
+//   g++ -std=c++14 -O2 bench/broadphaseBench.cpp mathLib.cpp -o broadphaseBench -pthread
+//
+// (from this directory's parent; cl /O2 /EHsc works the same way)
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <vector>
+#include "../collision.h"
+
+namespace {
+	double millisecondsSince(std::chrono::high_resolution_clock::time_point start) {
+		return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+	}
+
+	AABB boxAt(float x, float z, float halfWidth, float height) {
+		return AABB(mathLib::Vec3(x - halfWidth, 0.0f, z - halfWidth), mathLib::Vec3(x + halfWidth, height, z + halfWidth));
+	}
+}
+
+int main() {
+	const int counts[] = { 10, 100, 1000, 10000, 100000, 1000000 };
+	const int QUERIES = 20000;
+	printf("%9s %10s %10s %12s %8s\n", "objects", "build", "query", "linear scan", "hits");
+	for (int count : counts) {
+		std::mt19937 rng(7);
+		// One tree per 25 square units, like the pines in the demo scene
+		float side = sqrtf(count * 25.0f);
+		std::uniform_real_distribution<float> position(0.0f, side);
+		std::uniform_real_distribution<float> size(0.3f, 1.5f);
+
+		CollisionWorld world;
+		for (int i = 0; i < count; i++) {
+			world.addObject(boxAt(position(rng), position(rng), size(rng), 4.0f + size(rng) * 4.0f), true);
+		}
+		auto t0 = std::chrono::high_resolution_clock::now();
+		world.updateBroadphase();
+		double build = millisecondsSince(t0);
+
+		std::vector<AABB> queries(QUERIES);
+		for (int i = 0; i < QUERIES; i++) {
+			queries[i] = boxAt(position(rng), position(rng), 1.0f, 3.0f);
+		}
+
+		long long hits = 0;
+		t0 = std::chrono::high_resolution_clock::now();
+		for (int i = 0; i < QUERIES; i++) {
+			world.queryOverlaps(queries[i], [&](int) { hits++; });
+		}
+		double query = millisecondsSince(t0) * 1e6 / QUERIES;
+
+		// The scan is slow at the top end, so it only runs over a sample of the queries
+		const std::vector<CollisionWorld::CollisionObject>& objects = world.getObjects();
+		int scanned = (std::min)(QUERIES, (int)(2e8 / count) + 1);
+		long long scanHits = 0;
+		long long treeHits = 0;
+		t0 = std::chrono::high_resolution_clock::now();
+		for (int i = 0; i < scanned; i++) {
+			for (size_t k = 0; k < objects.size(); k++) {
+				if (objects[k].boundingBox.intersects(queries[i])) scanHits++;
+			}
+		}
+		double scan = millisecondsSince(t0) * 1e6 / scanned;
+		for (int i = 0; i < scanned; i++) {
+			world.queryOverlaps(queries[i], [&](int) { treeHits++; });
+		}
+		if (treeHits != scanHits) {
+			printf("mismatch at %d objects: %lld from the tree, %lld from the scan\n", count, treeHits, scanHits);
+			return 1;
+		}
+
+		printf("%9d %8.2f ms %7.0f ns %9.0f ns %8lld\n", count, build, query, scan, hits);
+	}
+	return 0;
+}
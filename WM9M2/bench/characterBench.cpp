@@ -0,0 +1,161 @@
+// Per-frame cost of hundreds of NPC character controllers: capsules wandering over a ground box
+// between triangle-mesh trees and a few crates, at 60 Hz. Each count runs once with every
+// controller moved in turn against the static world, and once through moveCharacters, where the
+// NPCs also collide with each other's boxes (single-threaded and on the job system). Times are
+// the mean per frame over the fastest of a few runs.
+//
+//   g++ -std=c++14 -O2 bench/characterBench.cpp mathLib.cpp -o characterBench -pthread
+//
+// (from this directory's parent; cl /O2 /EHsc works the same way)
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <thread>
+#include <vector>
+#include "../collision.h"
+
+namespace {
+	const int FRAMES = 120;
+	const int PASSES = 3;
+	const float DT = 1.0f / 60.0f;
+	const float AREA = 80.0f;   // side of the square the NPCs wander over
+
+	// A pine: an eight-sided trunk under an eight-sided cone, 32 triangles
+	void buildTree(TriangleMeshShape& shape) {
+		const int SIDES = 8;
+		std::vector<float> vertices;
+		auto ring = [&](float radius, float y) {
+			for (int i = 0; i < SIDES; i++) {
+				float angle = 6.2831853f * i / SIDES;
+				vertices.push_back(cosf(angle) * radius);
+				vertices.push_back(y);
+				vertices.push_back(sinf(angle) * radius);
+			}
+		};
+		ring(0.3f, 0.0f);
+		ring(0.3f, 2.0f);
+		ring(2.0f, 2.0f);
+		vertices.push_back(0.0f);
+		vertices.push_back(8.0f);
+		vertices.push_back(0.0f);
+		std::vector<unsigned int> indices;
+		for (int i = 0; i < SIDES; i++) {
+			unsigned int j = (i + 1) % SIDES;
+			unsigned int trunk[] = { (unsigned)i, j, SIDES + j, (unsigned)i, SIDES + j, (unsigned)(SIDES + i) };
+			unsigned int crown[] = { (unsigned)(2 * SIDES + i), 2 * SIDES + j, 3 * SIDES, (unsigned)(2 * SIDES + i), 2 * SIDES + j, SIDES + j };
+			indices.insert(indices.end(), trunk, trunk + 6);
+			indices.insert(indices.end(), crown, crown + 6);
+		}
+		shape.addTriangles(vertices.data(), 3 * sizeof(float), (int)vertices.size() / 3, indices.data(), (int)indices.size());
+		shape.build();
+	}
+
+	struct Npc {
+		CharacterController controller;
+		mathLib::Vec3 target;
+		int objectId = -1;
+	};
+
+	mathLib::Vec3 walkTowards(const Npc& npc) {
+		mathLib::Vec3 d(npc.target.x - npc.controller.position.x, 0.0f, npc.target.z - npc.controller.position.z);
+		float length = d.getLength();
+		if (length < 1e-3f) return mathLib::Vec3(0, 0, 0);
+		float speed = 3.0f * DT;
+		return mathLib::Vec3(d.x / length * speed, 0.0f, d.z / length * speed);
+	}
+
+	// Gives NPCs that reached their target a new one
+	void retarget(std::vector<Npc>& npcs, std::mt19937& rng) {
+		std::uniform_real_distribution<float> position(2.0f, AREA - 2.0f);
+		for (Npc& npc : npcs) {
+			float dx = npc.target.x - npc.controller.position.x;
+			float dz = npc.target.z - npc.controller.position.z;
+			if (dx * dx + dz * dz < 1.0f) npc.target = mathLib::Vec3(position(rng), 0.0f, position(rng));
+		}
+	}
+
+	std::vector<Npc> spawn(int count, std::mt19937& rng) {
+		std::uniform_real_distribution<float> position(2.0f, AREA - 2.0f);
+		std::vector<Npc> npcs(count);
+		for (Npc& npc : npcs) {
+			npc.controller = CharacterController(mathLib::Vec3(position(rng), 0.0f, position(rng)), 0.4f, 1.8f);
+			npc.target = mathLib::Vec3(position(rng), 0.0f, position(rng));
+		}
+		return npcs;
+	}
+
+	double microsecondsSince(std::chrono::high_resolution_clock::time_point start) {
+		return std::chrono::duration<double, std::micro>(std::chrono::high_resolution_clock::now() - start).count();
+	}
+}
+
+int main() {
+	std::mt19937 rng(5);
+	std::uniform_real_distribution<float> position(0.0f, AREA);
+
+	CollisionWorld world;
+	world.addObject(AABB(mathLib::Vec3(-10.0f, -1.0f, -10.0f), mathLib::Vec3(AREA + 10.0f, 0.0f, AREA + 10.0f)), true, "ground");
+	TriangleMeshShape tree;
+	buildTree(tree);
+	for (int i = 0; i < 60; i++) {
+		world.addMeshObject(&tree, mathLib::Matrix::translation(mathLib::Vec3(position(rng), 0.0f, position(rng))), "pine");
+	}
+	// Crates: some low enough to step onto, some not
+	std::uniform_real_distribution<float> height(0.2f, 1.2f);
+	for (int i = 0; i < 40; i++) {
+		float x = position(rng), z = position(rng);
+		world.addObject(AABB(mathLib::Vec3(x - 1.0f, 0.0f, z - 1.0f), mathLib::Vec3(x + 1.0f, height(rng), z + 1.0f)), true, "crate");
+	}
+	world.updateBroadphase();
+
+	int threads = (int)std::thread::hardware_concurrency();
+	JobSystem jobs(threads > 1 ? threads - 1 : 0);
+	printf("%d frames at 60 Hz, 60 mesh trees, 40 crates, %d worker threads\n", FRAMES, jobs.workerCount());
+	printf("%6s %25s %25s %25s\n", "NPCs", "static world only", "moveCharacters", "moveCharacters, jobs");
+
+	const int counts[] = { 100, 250, 500, 1000 };
+	for (int count : counts) {
+		double results[3] = { 1e30, 1e30, 1e30 };
+		int grounded = 0;
+		for (int run = 0; run < 3 * PASSES; run++) {
+			int mode = run % 3;
+			std::mt19937 npcRng(count);
+			std::vector<Npc> npcs = spawn(count, npcRng);
+			CollisionWorld scene = world;
+			std::vector<CharacterMove> moves(count);
+			if (mode > 0) {
+				for (int i = 0; i < count; i++) {
+					npcs[i].controller.collideWithDynamic = true;
+					npcs[i].objectId = scene.addObject(npcs[i].controller.bounds(), false, "npc");
+					moves[i].controller = &npcs[i].controller;
+					moves[i].objectId = npcs[i].objectId;
+				}
+				scene.updateBroadphase();
+			}
+
+			double total = 0.0;
+			for (int frame = 0; frame < FRAMES; frame++) {
+				retarget(npcs, npcRng);
+				auto t0 = std::chrono::high_resolution_clock::now();
+				if (mode == 0) {
+					for (Npc& npc : npcs) npc.controller.move(scene, walkTowards(npc), DT);
+				}
+				else {
+					for (int i = 0; i < count; i++) moves[i].walk = walkTowards(npcs[i]);
+					moveCharacters(scene, moves.data(), count, DT, mode == 2 ? &jobs : nullptr);
+				}
+				total += microsecondsSince(t0);
+			}
+			results[mode] = (std::min)(results[mode], total / FRAMES);
+			if (run == 1) {
+				for (const Npc& npc : npcs) grounded += npc.controller.grounded ? 1 : 0;
+			}
+		}
+		printf("%6d", count);
+		for (int mode = 0; mode < 3; mode++) {
+			printf("   %7.3f ms (%5.2f us each)", results[mode] * 1e-3, results[mode] / count);
+		}
+		printf("   %d%% grounded\n", grounded * 100 / count);
+	}
+	return 0;
+}
@@ -0,0 +1,109 @@
+// Herd update cost against worker count: 10k TRexPlayer actors wandering between 1k crates on a
+// ground box, each with its own box in the world so they block each other, driven through
+// TRexPlayer::updateHerd. Every worker count starts from the same scene; the final positions are
+// hashed so runs can be checked for identical results.
+//
+// player.h pulls in animation.h and so the DirectX headers, but nothing here creates a device. From
+// this directory's parent, in a developer command prompt:
+//
+//   cl /O2 /EHsc bench\herdBench.cpp mathLib.cpp adapter.cpp
+//
+// herdBench [actors] [max workers] runs 0 (inline), 1, 2, 4, ... workers up to max workers, which
+// defaults to hardware_concurrency - 1. Speed-up only shows on a machine with that many free cores.
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+#include "../player.h"
+
+namespace {
+	const int FRAMES = 30;
+	const float DT = 1.0f / 60.0f;
+
+	struct Run {
+		double milliseconds;
+		unsigned long long hash;
+	};
+
+	Run runHerd(int actorCount, int workers) {
+		std::mt19937 rng(3);
+		float side = sqrtf(actorCount * 16.0f);
+		std::uniform_real_distribution<float> position(0.0f, side);
+		std::uniform_real_distribution<float> direction(-1.0f, 1.0f);
+
+		CollisionWorld world;
+		world.addObject(AABB(mathLib::Vec3(-10.0f, -1.0f, -10.0f), mathLib::Vec3(side + 10.0f, 0.0f, side + 10.0f)), true, "ground");
+		for (int i = 0; i < 1000; i++) {
+			float x = position(rng), z = position(rng);
+			world.addObject(AABB(mathLib::Vec3(x - 1.0f, 0.0f, z - 1.0f), mathLib::Vec3(x + 1.0f, 2.0f, z + 1.0f)), true, "crate");
+		}
+
+		std::vector<TRexPlayer> actors;
+		actors.reserve(actorCount);
+		std::vector<TRexPlayer*> pointers(actorCount);
+		std::vector<int> objectIds(actorCount);
+		std::vector<mathLib::Vec3> directions(actorCount);
+		for (int i = 0; i < actorCount; i++) {
+			actors.push_back(TRexPlayer(mathLib::Vec3(position(rng), 0.0f, position(rng)), 4.0f));
+			actors[i].controller.collideWithDynamic = true;
+			pointers[i] = &actors[i];
+			objectIds[i] = world.addObject(actors[i].controller.bounds(), false, "trex");
+			mathLib::Vec3 d(direction(rng), 0.0f, direction(rng));
+			directions[i] = d.normalize();
+		}
+
+		JobSystem* pool = nullptr;
+		std::unique_ptr<JobSystem> owned;
+		if (workers > 0) {
+			owned.reset(new JobSystem(workers));
+			pool = owned.get();
+		}
+
+		// One frame to settle everyone onto the ground before timing
+		TRexPlayer::updateHerd(pointers.data(), directions.data(), objectIds.data(), actorCount, DT, world, pool);
+		auto t0 = std::chrono::high_resolution_clock::now();
+		for (int frame = 0; frame < FRAMES; frame++) {
+			TRexPlayer::updateHerd(pointers.data(), directions.data(), objectIds.data(), actorCount, DT, world, pool);
+		}
+		double ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - t0).count();
+
+		Run run = { ms / FRAMES, 1469598103934665603ull };
+		for (int i = 0; i < actorCount; i++) {
+			unsigned int bits[3];
+			memcpy(bits, &actors[i].position.x, sizeof(float));
+			memcpy(bits + 1, &actors[i].position.y, sizeof(float));
+			memcpy(bits + 2, &actors[i].position.z, sizeof(float));
+			for (int k = 0; k < 3; k++) run.hash = (run.hash ^ bits[k]) * 1099511628211ull;
+		}
+		return run;
+	}
+}
+
+int main(int argc, char** argv) {
+	int actorCount = argc > 1 ? atoi(argv[1]) : 10000;
+	int hardware = (int)std::thread::hardware_concurrency();
+	int maxWorkers = argc > 2 ? atoi(argv[2]) : (hardware > 1 ? hardware - 1 : 0);
+	printf("%d actors, 1000 crates, %d frames, %d hardware threads\n", actorCount, FRAMES, hardware);
+	printf("%8s %10s %8s  %s\n", "workers", "frame", "speed-up", "positions");
+
+	std::vector<int> workerCounts;
+	workerCounts.push_back(0);
+	for (int w = 1; w < maxWorkers; w *= 2) workerCounts.push_back(w);
+	if (maxWorkers > 0) workerCounts.push_back(maxWorkers);
+
+	Run inlineRun = { 0.0, 0 };
+	bool identical = true;
+	for (int workers : workerCounts) {
+		Run run = runHerd(actorCount, workers);
+		if (workers == 0) inlineRun = run;
+		bool same = run.hash == inlineRun.hash;
+		identical = identical && same;
+		printf("%8d %7.2f ms %7.2fx  %s\n", workers, run.milliseconds, inlineRun.milliseconds / run.milliseconds, same ? "match inline" : "DIFFER");
+	}
+	return identical ? 0 : 1;
+}
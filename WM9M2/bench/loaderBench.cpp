@@ -0,0 +1,172 @@
+// Load time and heap traffic of GEMModelLoader for every model in Models/: the stream path
+// (load(filename, ...)), the mapped path (load(filename, mapping, ...)) and opening the cooked pack
+// (GEMPack::open). Allocations are counted by a replacement operator new on the first run; times
+// are the best of the remaining runs. The stream and mapped results are hashed and must match.
+//
+//   g++ -std=c++14 -O2 bench/loaderBench.cpp -o loaderBench
+//
+// (from this directory's parent; cl /O2 /EHsc works the same way). Run it from the directory that
+// holds Models/, or pass other .gem files on the command line. Missing or stale packs are cooked
+// next to their sources first, as the game does.
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
+#include "../GEMPack.h"
+
+static size_t allocations = 0;
+static size_t allocatedBytes = 0;
+
+// Kept out of line: once g++ inlines malloc() or free() into std::allocator it reports
+// -Wmismatched-new-delete against the operator new or delete on the other side
+#ifdef _MSC_VER
+#define BENCH_NOINLINE __declspec(noinline)
+#else
+#define BENCH_NOINLINE __attribute__((noinline))
+#endif
+BENCH_NOINLINE void* operator new(size_t size) {
+	allocations++;
+	allocatedBytes += size;
+	void* p = malloc(size ? size : 1);
+	if (!p) throw std::bad_alloc();
+	return p;
+}
+void* operator new[](size_t size) { return operator new(size); }
+BENCH_NOINLINE void operator delete(void* p) noexcept { free(p); }
+BENCH_NOINLINE void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p) noexcept { operator delete(p); }
+void operator delete[](void* p, size_t) noexcept { operator delete(p); }
+
+namespace {
+	const int RUNS = 15;
+
+	struct Result {
+		double milliseconds;
+		size_t allocations;
+		size_t bytes;
+		unsigned long long hash;
+		bool ok;
+	};
+
+	struct Hash {
+		unsigned long long value = 1469598103934665603ull;
+		void mix(const void* data, size_t size) {
+			const unsigned char* bytes = (const unsigned char*)data;
+			for (size_t i = 0; i < size; i++) value = (value ^ bytes[i]) * 1099511628211ull;
+		}
+		void mix(const std::string& s) { mix(s.data(), s.size()); }
+	};
+
+	unsigned long long hashModel(const std::vector<GEMLoader::GEMMesh>& meshes, const GEMLoader::GEMAnimation& animation) {
+		Hash h;
+		for (const GEMLoader::GEMMesh& mesh : meshes) {
+			for (const GEMLoader::GEMMaterialProperty& property : mesh.material.properties) {
+				h.mix(property.name);
+				h.mix(property.value);
+			}
+			auto staticVertices = mesh.staticVertices();
+			auto animatedVertices = mesh.animatedVertices();
+			auto indices = mesh.indexSpan();
+			h.mix(staticVertices.data(), staticVertices.size() * sizeof(GEMLoader::GEMStaticVertex));
+			h.mix(animatedVertices.data(), animatedVertices.size() * sizeof(GEMLoader::GEMAnimatedVertex));
+			h.mix(indices.data(), indices.size() * sizeof(unsigned int));
+		}
+		for (const GEMLoader::GEMBone& bone : animation.bones) {
+			h.mix(bone.name);
+			h.mix(&bone.offset, sizeof(bone.offset));
+			h.mix(&bone.parentIndex, sizeof(bone.parentIndex));
+		}
+		for (const GEMLoader::GEMAnimationSequence& sequence : animation.animations) {
+			h.mix(sequence.name);
+			for (const GEMLoader::GEMAnimationFrame& frame : sequence.frames) {
+				h.mix(frame.positions.data(), frame.positions.size() * sizeof(frame.positions[0]));
+				h.mix(frame.rotations.data(), frame.rotations.size() * sizeof(frame.rotations[0]));
+				h.mix(frame.scales.data(), frame.scales.size() * sizeof(frame.scales[0]));
+			}
+		}
+		return h.value;
+	}
+
+	// Runs load RUNS times; load returns false on failure and may set hash
+	template<typename Load>
+	Result measure(Load load) {
+		Result result = { 1e30, 0, 0, 0, true };
+		for (int run = 0; run < RUNS; run++) {
+			size_t allocationsBefore = allocations;
+			size_t bytesBefore = allocatedBytes;
+			auto t0 = std::chrono::high_resolution_clock::now();
+			bool ok = load(run == 0 ? &result.hash : nullptr);
+			double ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - t0).count();
+			result.ok = result.ok && ok;
+			if (run == 0) {
+				result.allocations = allocations - allocationsBefore;
+				result.bytes = allocatedBytes - bytesBefore;
+			}
+			else if (ms < result.milliseconds) {
+				result.milliseconds = ms;
+			}
+		}
+		return result;
+	}
+
+	void print(const std::string& filename, const char* path, const Result& result) {
+		if (!result.ok) {
+			printf("%-22s %-7s failed\n", filename.c_str(), path);
+			return;
+		}
+		printf("%-22s %-7s %8.3f ms %7zu allocs %9.1f KB\n", filename.c_str(), path, result.milliseconds, result.allocations, result.bytes / 1024.0);
+	}
+}
+
+int main(int argc, char** argv) {
+	std::vector<std::string> files;
+	for (int i = 1; i < argc; i++) files.push_back(argv[i]);
+	if (files.empty()) {
+		const char* models[] = { "TRex.gem", "acacia.gem", "acacia_003.gem", "grass_003.gem", "pine.gem" };
+		for (const char* model : models) files.push_back(std::string("Models/") + model);
+	}
+
+	bool identical = true;
+	printf("best of %d runs; allocations from the first\n", RUNS - 1);
+	for (const std::string& filename : files) {
+		GEMLoader::GEMModelLoader probe;
+		bool animated = probe.isAnimatedModel(filename);
+
+		Result stream = measure([&](unsigned long long* hash) {
+			GEMLoader::GEMModelLoader loader;
+			std::vector<GEMLoader::GEMMesh> meshes;
+			GEMLoader::GEMAnimation animation;
+			GEMLoader::GEMError error = animated ? loader.load(filename, meshes, animation) : loader.load(filename, meshes);
+			if (hash) *hash = hashModel(meshes, animation);
+			return error == GEMLoader::GEM_OK;
+		});
+		Result mapped = measure([&](unsigned long long* hash) {
+			GEMLoader::GEMModelLoader loader;
+			GEMLoader::GEMMappedFile mapping;
+			std::vector<GEMLoader::GEMMesh> meshes;
+			GEMLoader::GEMAnimation animation;
+			GEMLoader::GEMError error = animated ? loader.load(filename, mapping, meshes, animation) : loader.load(filename, mapping, meshes);
+			if (hash) *hash = hashModel(meshes, animation);
+			return error == GEMLoader::GEM_OK;
+		});
+		// Cooks the pack first if it is missing or stale, so every timed run maps a valid one
+		GEMLoader::GEMPack cook;
+		bool cooked = cook.openOrCook(filename);
+		cook.close();
+		Result pack = measure([&](unsigned long long*) {
+			GEMLoader::GEMPack loaded;
+			return cooked && loaded.open(filename + ".pack");
+		});
+
+		print(filename, "stream", stream);
+		print(filename, "mapped", mapped);
+		print(filename, "pack", pack);
+		if (stream.ok && mapped.ok && stream.hash != mapped.hash) {
+			printf("%-22s stream and mapped results differ\n", filename.c_str());
+			identical = false;
+		}
+	}
+	return identical ? 0 : 1;
+}
@@ -0,0 +1,133 @@
+// Ray throughput against object count: a forest of static boxes at constant density, from 100 to
+// 1M objects, hit with rays cast from player height in random directions. Rays go through
+// CollisionWorld::raycast one at a time, as a batch (four-ray packets down the tree) and as a batch
+// across the job system, and through a slab test against every entry of the object list. Results
+// are checked against the list.
+//
+//   g++ -std=c++14 -O2 bench/raycastBench.cpp mathLib.cpp -o raycastBench -pthread
+//
+// (from this directory's parent; cl /O2 /EHsc works the same way. Add -DMATHLIB_NO_SIMD for the
+// scalar packet test.)
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <thread>
+#include <vector>
+#include "../collision.h"
+
+namespace {
+	const int RAYS = 20000;
+	const int PASSES = 3;
+
+	double secondsSince(std::chrono::high_resolution_clock::time_point start) {
+		return std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+	}
+
+	// Fastest of PASSES runs
+	template<typename Fn>
+	double bestSeconds(Fn fn) {
+		double best = 1e30;
+		for (int pass = 0; pass < PASSES; pass++) {
+			auto t0 = std::chrono::high_resolution_clock::now();
+			fn();
+			double seconds = secondsSince(t0);
+			best = seconds < best ? seconds : best;
+		}
+		return best;
+	}
+
+	AABB boxAt(float x, float z, float halfWidth, float height) {
+		return AABB(mathLib::Vec3(x - halfWidth, 0.0f, z - halfWidth), mathLib::Vec3(x + halfWidth, height, z + halfWidth));
+	}
+
+	// Entry distance of ray into box, or a negative value for a miss
+	float slab(const Ray& ray, const AABB& box) {
+		float tNear = 0.0f;
+		float tFar = ray.maxDistance;
+		for (int a = 0; a < 3; a++) {
+			float inverse = 1.0f / (fabsf(ray.direction.v[a]) > 1e-20f ? ray.direction.v[a] : 1e-20f);
+			float t1 = (box.minPoint.v[a] - ray.origin.v[a]) * inverse;
+			float t2 = (box.maxPoint.v[a] - ray.origin.v[a]) * inverse;
+			if (t1 > t2) std::swap(t1, t2);
+			tNear = t1 > tNear ? t1 : tNear;
+			tFar = t2 < tFar ? t2 : tFar;
+		}
+		return tNear <= tFar ? tNear : -1.0f;
+	}
+
+	// Nearest hit over the whole object list, lower id first on ties like the world
+	int linearRaycast(const std::vector<CollisionWorld::CollisionObject>& objects, const Ray& ray) {
+		float best = FLT_MAX;
+		int bestId = -1;
+		for (size_t k = 0; k < objects.size(); k++) {
+			float t = slab(ray, objects[k].boundingBox);
+			if (t >= 0.0f && t < best) {
+				best = t;
+				bestId = (int)k;
+			}
+		}
+		return bestId;
+	}
+
+	void print(const char* name, double seconds, int rays) {
+		printf("  %-22s %12.0f rays/s\n", name, rays / seconds);
+	}
+}
+
+int main() {
+	const int counts[] = { 100, 1000, 10000, 100000, 1000000 };
+	int threads = (int)std::thread::hardware_concurrency();
+	JobSystem jobs(threads > 1 ? threads - 1 : 0);
+	printf("%d rays per run, best of %d, %d worker threads\n", RAYS, PASSES, jobs.workerCount());
+	for (int count : counts) {
+		std::mt19937 rng(11);
+		// One tree per 25 square units, like the pines in the demo scene
+		float side = sqrtf(count * 25.0f);
+		std::uniform_real_distribution<float> position(0.0f, side);
+		std::uniform_real_distribution<float> size(0.3f, 1.5f);
+		std::uniform_real_distribution<float> direction(-1.0f, 1.0f);
+
+		CollisionWorld world;
+		for (int i = 0; i < count; i++) {
+			world.addObject(boxAt(position(rng), position(rng), size(rng), 4.0f + size(rng) * 4.0f), true);
+		}
+		world.updateBroadphase();
+
+		// Eye-height rays, mostly level, out to 50 units
+		std::vector<Ray> rays(RAYS);
+		for (int i = 0; i < RAYS; i++) {
+			mathLib::Vec3 d(direction(rng), direction(rng) * 0.2f, direction(rng));
+			rays[i] = Ray(mathLib::Vec3(position(rng), 1.7f, position(rng)), d.normalize(), 50.0f);
+		}
+		std::vector<RayHit> hits(RAYS);
+
+		double single = bestSeconds([&]() {
+			for (int i = 0; i < RAYS; i++) hits[i] = world.raycast(rays[i]);
+		});
+		double batch = bestSeconds([&]() { world.raycast(rays.data(), hits.data(), RAYS); });
+		double parallel = bestSeconds([&]() { world.raycast(rays.data(), hits.data(), RAYS, &jobs); });
+
+		// The list is slow at the top end, so it only runs over a sample of the rays
+		const std::vector<CollisionWorld::CollisionObject>& objects = world.getObjects();
+		int scanned = (std::min)(RAYS, (int)(2e8 / count) + 1);
+		std::vector<int> scanIds(scanned);
+		auto t0 = std::chrono::high_resolution_clock::now();
+		for (int i = 0; i < scanned; i++) scanIds[i] = linearRaycast(objects, rays[i]);
+		double scan = secondsSince(t0);
+		int hitCount = 0;
+		for (int i = 0; i < RAYS; i++) hitCount += hits[i].hit ? 1 : 0;
+		for (int i = 0; i < scanned; i++) {
+			if (hits[i].objectId != scanIds[i]) {
+				printf("mismatch at %d objects, ray %d: %d from the world, %d from the list\n", count, i, hits[i].objectId, scanIds[i]);
+				return 1;
+			}
+		}
+
+		printf("%d objects, %d%% of rays hit\n", count, hitCount * 100 / RAYS);
+		print("single rays", single, RAYS);
+		print("batch", batch, RAYS);
+		print("batch on the jobs", parallel, RAYS);
+		print("linear object list", scan, scanned);
+	}
+	return 0;
+}
@@ -1,5 +1,6 @@
 ﻿#pragma once
 #include "mathLib.h"
+#include "collision.h"
 #include <cmath>
 
 // Forward declaration
@@ -19,12 +20,13 @@ public:
 
     float mouseSensitivity;
     float smoothness;  
+    float collisionMargin;  // distance kept from anything blocking the view
 
     TRexPlayer* player;
 
     TPSCamera(TRexPlayer* targetPlayer = nullptr, float dist = 15.0f, float h = 8.0f)
         : player(targetPlayer), distance(dist), height(h),
-        yaw(0), pitch(-25.0f), mouseSensitivity(0.15f), smoothness(8.0f) {
+        yaw(0), pitch(-25.0f), mouseSensitivity(0.15f), smoothness(8.0f), collisionMargin(0.5f) {
         up = mathLib::Vec3(0, 1, 0);
         position = mathLib::Vec3(0, height, distance);
         target = mathLib::Vec3(0, 0, 0);
@@ -53,7 +55,7 @@ public:
         while (yaw < 0.0f) yaw += 360.0f;
     }
 
-    void updatePosition(const mathLib::Vec3& playerPos, float dt) {
+    void updatePosition(const mathLib::Vec3& playerPos, float dt, CollisionWorld* collisionWorld = nullptr) {
         float radYaw = mathLib::radians(yaw);
         float radPitch = mathLib::radians(pitch);
 
@@ -67,6 +69,17 @@ public:
         position = position + (desiredPosition - position) * lerpFactor;
 
         target = playerPos + mathLib::Vec3(0, 1.5f, 0);
+
+        // Pull the camera in front of anything between it and the player (static objects only)
+        if (collisionWorld) {
+            mathLib::Vec3 toCamera = position - target;
+            RayHit hit = collisionWorld->raycast(Ray(target, toCamera, 1.0f), false);
+            if (hit.hit) {
+                float length = sqrtf(toCamera.getLengthSquare());
+                float t = length > 0.0f ? (std::max)(0.0f, hit.distance - collisionMargin / length) : 0.0f;
+                position = target + toCamera * t;
+            }
+        }
     }
 
     mathLib::Matrix getViewMatrix() {
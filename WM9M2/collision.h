@@ -1,9 +1,13 @@
 ﻿#pragma once
-#include "mathLib.h"
 #include <vector>
 #include <cfloat>
 #include <string>
 #include <algorithm>
+#include <unordered_map>
+#include <map>
+#include <cstdint>
+#include "jobSystem.h"
+#include "mathLib.h"
 
 #ifndef NOMINMAX
 #define NOMINMAX
@@ -54,28 +58,1202 @@ public:
 
     // Transform AABB by a matrix
     AABB transform(const mathLib::Matrix& matrix) const {
-        // Transform all 8 corners of the AABB
-        mathLib::Vec3 corners[8] = {
-            mathLib::Vec3(minPoint.x, minPoint.y, minPoint.z),
-            mathLib::Vec3(maxPoint.x, minPoint.y, minPoint.z),
-            mathLib::Vec3(minPoint.x, maxPoint.y, minPoint.z),
-            mathLib::Vec3(maxPoint.x, maxPoint.y, minPoint.z),
-            mathLib::Vec3(minPoint.x, minPoint.y, maxPoint.z),
-            mathLib::Vec3(maxPoint.x, minPoint.y, maxPoint.z),
-            mathLib::Vec3(minPoint.x, maxPoint.y, maxPoint.z),
-            mathLib::Vec3(maxPoint.x, maxPoint.y, maxPoint.z)
-        };
+        // Transform all 8 corners of the AABB as one SoA batch
+        float xs[8] = { minPoint.x, maxPoint.x, minPoint.x, maxPoint.x, minPoint.x, maxPoint.x, minPoint.x, maxPoint.x };
+        float ys[8] = { minPoint.y, minPoint.y, maxPoint.y, maxPoint.y, minPoint.y, minPoint.y, maxPoint.y, maxPoint.y };
+        float zs[8] = { minPoint.z, minPoint.z, minPoint.z, minPoint.z, maxPoint.z, maxPoint.z, maxPoint.z, maxPoint.z };
+        mathLib::transformPointsSoA(matrix, xs, ys, zs, xs, ys, zs, 8);
 
         AABB result;
-        for (int i = 0; i < 8; i++) {
-            mathLib::Vec3 transformed = matrix.mulPoint(corners[i]);
-            result.expand(transformed);
+        mathLib::boundsSoA(xs, ys, zs, 8, result.minPoint, result.maxPoint);
+        return result;
+    }
+
+    // Grow to contain another box
+    void merge(const AABB& other) {
+        minPoint = mathLib::Min(minPoint, other.minPoint);
+        maxPoint = mathLib::Max(maxPoint, other.maxPoint);
+    }
+
+    float surfaceArea() const {
+        mathLib::Vec3 size = getSize();
+        if (size.x < 0 || size.y < 0 || size.z < 0) return 0.0f;
+        return 2.0f * (size.x * size.y + size.y * size.z + size.z * size.x);
+    }
+};
+
+// Ray or segment: points origin + direction * t for t in [0, maxDistance]. A segment from a
+// to b is direction = b - a with maxDistance = 1.
+struct Ray {
+    mathLib::Vec3 origin;
+    mathLib::Vec3 direction;
+    float maxDistance = FLT_MAX;
+
+    Ray() {}
+    Ray(const mathLib::Vec3& o, const mathLib::Vec3& d, float maxDist = FLT_MAX) : origin(o), direction(d), maxDistance(maxDist) {}
+};
+
+struct RayHit {
+    bool hit = false;
+    float distance = FLT_MAX;   // t along the ray, in units of direction
+    mathLib::Vec3 point;
+    mathLib::Vec3 normal;       // face of the box that was entered
+    int objectId = -1;
+};
+
+// Four rays in structure-of-arrays form, so one slab test checks a box against all of them (in SSE
+// registers where available)
+struct alignas(16) RayPacket {
+    float ox[4], oy[4], oz[4];
+    float idx[4], idy[4], idz[4];   // reciprocal directions
+    float best[4];                  // nearest hit so far; negative for unused lanes
+    int ids[4];
+    mathLib::Vec3 averageDirection;
+
+    void set(const Ray* rays, int count) {
+        averageDirection = mathLib::Vec3(0, 0, 0);
+        for (int i = 0; i < 4; i++) {
+            const Ray& r = rays[i < count ? i : 0];
+            ox[i] = r.origin.x;
+            oy[i] = r.origin.y;
+            oz[i] = r.origin.z;
+            // Keep zero components finite so the slab products never hit 0 * inf
+            idx[i] = 1.0f / (fabsf(r.direction.x) > 1e-20f ? r.direction.x : 1e-20f);
+            idy[i] = 1.0f / (fabsf(r.direction.y) > 1e-20f ? r.direction.y : 1e-20f);
+            idz[i] = 1.0f / (fabsf(r.direction.z) > 1e-20f ? r.direction.z : 1e-20f);
+            best[i] = i < count ? r.maxDistance : -1.0f;
+            ids[i] = -1;
+            if (i < count) averageDirection = averageDirection + r.direction;
         }
+    }
 
-        return result;
+    // Entry distance of each ray into box, written to the 16-byte aligned entry[4]; lanes that miss
+    // (or only hit beyond best) are clear in the returned mask
+    int slab(const AABB& box, float* entry) const {
+#if MATHLIB_SSE
+        __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.minPoint.x), _mm_load_ps(ox)), _mm_load_ps(idx));
+        __m128 t2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.maxPoint.x), _mm_load_ps(ox)), _mm_load_ps(idx));
+        __m128 tNear = _mm_min_ps(t1, t2);
+        __m128 tFar = _mm_max_ps(t1, t2);
+        t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.minPoint.y), _mm_load_ps(oy)), _mm_load_ps(idy));
+        t2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.maxPoint.y), _mm_load_ps(oy)), _mm_load_ps(idy));
+        tNear = _mm_max_ps(tNear, _mm_min_ps(t1, t2));
+        tFar = _mm_min_ps(tFar, _mm_max_ps(t1, t2));
+        t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.minPoint.z), _mm_load_ps(oz)), _mm_load_ps(idz));
+        t2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.maxPoint.z), _mm_load_ps(oz)), _mm_load_ps(idz));
+        tNear = _mm_max_ps(tNear, _mm_min_ps(t1, t2));
+        tFar = _mm_min_ps(tFar, _mm_max_ps(t1, t2));
+        __m128 t = _mm_max_ps(tNear, _mm_setzero_ps());
+        _mm_store_ps(entry, t);
+        __m128 hit = _mm_and_ps(_mm_cmple_ps(t, tFar), _mm_cmple_ps(t, _mm_load_ps(best)));
+        return _mm_movemask_ps(hit);
+#else
+        // Same lane-by-lane arithmetic, including the min/max order, so both paths agree exactly
+        int mask = 0;
+        for (int i = 0; i < 4; i++) {
+            float t1 = (box.minPoint.x - ox[i]) * idx[i];
+            float t2 = (box.maxPoint.x - ox[i]) * idx[i];
+            float tNear = t1 < t2 ? t1 : t2;
+            float tFar = t1 > t2 ? t1 : t2;
+            t1 = (box.minPoint.y - oy[i]) * idy[i];
+            t2 = (box.maxPoint.y - oy[i]) * idy[i];
+            float lo = t1 < t2 ? t1 : t2;
+            float hi = t1 > t2 ? t1 : t2;
+            tNear = tNear > lo ? tNear : lo;
+            tFar = tFar < hi ? tFar : hi;
+            t1 = (box.minPoint.z - oz[i]) * idz[i];
+            t2 = (box.maxPoint.z - oz[i]) * idz[i];
+            lo = t1 < t2 ? t1 : t2;
+            hi = t1 > t2 ? t1 : t2;
+            tNear = tNear > lo ? tNear : lo;
+            tFar = tFar < hi ? tFar : hi;
+            entry[i] = tNear > 0.0f ? tNear : 0.0f;
+            if (entry[i] <= tFar && entry[i] <= best[i]) mask |= 1 << i;
+        }
+        return mask;
+#endif
+    }
+};
+
+// Bounding Volume Hierarchy over object ids
+// build() splits with a binned surface area heuristic; refit() only updates the boxes
+// bottom-up, so moving objects keep the tree shape and stay cheap to update.
+class BVH {
+public:
+    struct Node {
+        AABB box;
+        int left;    // children, -1 for leaves
+        int right;
+        int first;   // leaves: range in items
+        int count;
+        int parent;
+    };
+
+    std::vector<Node> nodes;
+    std::vector<int> items;       // object ids in leaf order
+    std::vector<int> leafOfItem;  // object id -> leaf node, for refit
+
+    // Leaves are never deeper than this (see buildNode), so traversal fits a fixed stack of
+    // MAX_DEPTH + 2 entries: one pending sibling per level plus the two children just pushed
+    static const int MAX_DEPTH = 48;
+
+    void clear() {
+        nodes.clear();
+        items.clear();
+        leafOfItem.clear();
+    }
+
+    bool empty() const {
+        return nodes.empty();
+    }
+
+    // boxes is indexed by object id; only the ids listed are put in the tree
+    void build(const std::vector<AABB>& boxes, const std::vector<int>& ids, int maxLeafSize = 4) {
+        clear();
+        if (ids.empty()) return;
+        items = ids;
+        centroids.resize(boxes.size());
+        for (size_t i = 0; i < ids.size(); i++) {
+            centroids[ids[i]] = boxes[ids[i]].getCenter();
+        }
+        nodes.reserve(ids.size() * 2);
+        buildNode(boxes, 0, (int)items.size(), -1, 0, maxLeafSize < 1 ? 1 : maxLeafSize);
+
+        leafOfItem.assign(boxes.size(), -1);
+        for (size_t n = 0; n < nodes.size(); n++) {
+            if (nodes[n].left >= 0) continue;
+            for (int i = nodes[n].first; i < nodes[n].first + nodes[n].count; i++) {
+                leafOfItem[items[i]] = (int)n;
+            }
+        }
+    }
+
+    // Recomputes every node box from the current object boxes. Children are always stored
+    // after their parent, so one reverse sweep is enough.
+    void refit(const std::vector<AABB>& boxes) {
+        for (int n = (int)nodes.size() - 1; n >= 0; n--) {
+            Node& node = nodes[n];
+            node.box = AABB();
+            if (node.left < 0) {
+                for (int i = node.first; i < node.first + node.count; i++) {
+                    node.box.merge(boxes[items[i]]);
+                }
+            }
+            else {
+                node.box.merge(nodes[node.left].box);
+                node.box.merge(nodes[node.right].box);
+            }
+        }
+    }
+
+    // Refit only the paths from the listed objects' leaves to the root, stopping where a node's
+    // box comes out unchanged. Cheaper than refit() when few objects moved.
+    void refit(const std::vector<AABB>& boxes, const std::vector<int>& movedIds) {
+        for (size_t k = 0; k < movedIds.size(); k++) {
+            int id = movedIds[k];
+            if (id >= (int)leafOfItem.size() || leafOfItem[id] < 0) continue;
+            int n = leafOfItem[id];
+            while (n >= 0) {
+                Node& node = nodes[n];
+                AABB box;
+                if (node.left < 0) {
+                    for (int i = node.first; i < node.first + node.count; i++) {
+                        box.merge(boxes[items[i]]);
+                    }
+                }
+                else {
+                    box.merge(nodes[node.left].box);
+                    box.merge(nodes[node.right].box);
+                }
+                if (sameBox(box, node.box)) break;
+                node.box = box;
+                n = node.parent;
+            }
+        }
+    }
+
+    static bool sameBox(const AABB& a, const AABB& b) {
+        return a.minPoint.x == b.minPoint.x && a.minPoint.y == b.minPoint.y && a.minPoint.z == b.minPoint.z &&
+            a.maxPoint.x == b.maxPoint.x && a.maxPoint.y == b.maxPoint.y && a.maxPoint.z == b.maxPoint.z;
+    }
+
+    // Calls fn(objectId) for every object whose box overlaps the query box
+    template<typename Fn>
+    void query(const AABB& box, const std::vector<AABB>& boxes, Fn fn) const {
+        if (nodes.empty()) return;
+        int stack[MAX_DEPTH + 2];
+        int top = 0;
+        stack[top++] = 0;
+        while (top > 0) {
+            const Node& node = nodes[stack[--top]];
+            if (!node.box.intersects(box)) continue;
+            if (node.left < 0) {
+                for (int i = node.first; i < node.first + node.count; i++) {
+                    if (boxes[items[i]].intersects(box)) fn(items[i]);
+                }
+            }
+            else {
+                stack[top++] = node.right;
+                stack[top++] = node.left;
+            }
+        }
+    }
+
+    // Nearest hits for a packet of rays, improving packet.best/ids in place
+    void raycast(RayPacket& packet, const std::vector<AABB>& boxes) const {
+        raycast(packet, boxes, [](int, int, float entry) { return entry; });
+    }
+
+    // As above, but narrow(id, lane, boxEntry) gives the real hit distance for items that are
+    // not plain boxes, or a negative value for a miss
+    template<typename Narrow>
+    void raycast(RayPacket& packet, const std::vector<AABB>& boxes, Narrow narrow) const {
+        if (nodes.empty()) return;
+        int stack[MAX_DEPTH + 2];
+        int top = 0;
+        stack[top++] = 0;
+        alignas(16) float entry[4];
+        while (top > 0) {
+            const Node& node = nodes[stack[--top]];
+            if (!packet.slab(node.box, entry)) continue;
+            if (node.left < 0) {
+                for (int i = node.first; i < node.first + node.count; i++) {
+                    int id = items[i];
+                    int mask = packet.slab(boxes[id], entry);
+                    if (!mask) continue;
+                    for (int lane = 0; lane < 4; lane++) {
+                        if (!(mask & (1 << lane))) continue;
+                        float hit = narrow(id, lane, entry[lane]);
+                        if (hit < 0.0f || hit > packet.best[lane]) continue;
+                        // Ties go to the lower id so the answer does not depend on tree shape
+                        if (hit < packet.best[lane] || packet.ids[lane] < 0 || id < packet.ids[lane]) {
+                            packet.best[lane] = hit;
+                            packet.ids[lane] = id;
+                        }
+                    }
+                }
+            }
+            else {
+                // Visit the child nearer along the packet's direction first so best shrinks early
+                const AABB& l = nodes[node.left].box;
+                const AABB& r = nodes[node.right].box;
+                float order = (r.minPoint.x + r.maxPoint.x - l.minPoint.x - l.maxPoint.x) * packet.averageDirection.x +
+                    (r.minPoint.y + r.maxPoint.y - l.minPoint.y - l.maxPoint.y) * packet.averageDirection.y +
+                    (r.minPoint.z + r.maxPoint.z - l.minPoint.z - l.maxPoint.z) * packet.averageDirection.z;
+                if (order >= 0.0f) {
+                    stack[top++] = node.right;
+                    stack[top++] = node.left;
+                }
+                else {
+                    stack[top++] = node.left;
+                    stack[top++] = node.right;
+                }
+            }
+        }
+    }
+
+private:
+    std::vector<mathLib::Vec3> centroids;
+
+    static const int BINS = 12;
+
+    int buildNode(const std::vector<AABB>& boxes, int first, int count, int parent, int depth, int maxLeafSize) {
+        int index = (int)nodes.size();
+        nodes.push_back(Node());
+        Node node;
+        node.left = -1;
+        node.right = -1;
+        node.first = first;
+        node.count = count;
+        node.parent = parent;
+
+        AABB centroidBounds;
+        for (int i = first; i < first + count; i++) {
+            node.box.merge(boxes[items[i]]);
+            centroidBounds.expand(centroids[items[i]]);
+        }
+
+        if (count <= maxLeafSize) {
+            nodes[index] = node;
+            return index;
+        }
+
+        int mid = -1;
+        mathLib::Vec3 extent = centroidBounds.getSize();
+        int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+
+        // Median splits from here would need medianLevels(count) more levels. SAH splits can be
+        // lopsided, so they are only allowed while that still leaves a level spare; the children
+        // are no bigger than this node, so they can always finish with medians within MAX_DEPTH.
+        bool sah = depth + medianLevels(count, maxLeafSize) < MAX_DEPTH && extent.v[axis] > 0.0f;
+        if (sah) {
+            mid = sahSplit(boxes, first, count, centroidBounds, node.box.surfaceArea());
+        }
+        if (mid < 0) {
+            if (count <= maxLeafSize * 4 && sah) {
+                // SAH says a leaf is cheaper
+                nodes[index] = node;
+                return index;
+            }
+            // Median split on the widest axis; always terminates, even for identical centroids
+            mid = first + count / 2;
+            std::nth_element(items.begin() + first, items.begin() + mid, items.begin() + first + count,
+                [this, axis](int a, int b) { return centroids[a].v[axis] < centroids[b].v[axis]; });
+        }
+
+        node.count = 0;
+        node.left = buildNode(boxes, first, mid - first, index, depth + 1, maxLeafSize);
+        node.right = buildNode(boxes, mid, first + count - mid, index, depth + 1, maxLeafSize);
+        nodes[index] = node;
+        return index;
+    }
+
+    // Levels of median splits until count items fit in leaves
+    static int medianLevels(int count, int maxLeafSize) {
+        int levels = 0;
+        while (count > maxLeafSize) {
+            count = (count + 1) / 2;
+            levels++;
+        }
+        return levels;
+    }
+
+    // Binned SAH over all three axes; returns the partition point, or -1 when no split beats a leaf
+    int sahSplit(const std::vector<AABB>& boxes, int first, int count, const AABB& centroidBounds, float parentArea) {
+        float bestCost = (float)count;  // cost of keeping a leaf, in intersection tests
+        int bestAxis = -1;
+        int bestBin = -1;
+        for (int axis = 0; axis < 3; axis++) {
+            float lo = centroidBounds.minPoint.v[axis];
+            float extent = centroidBounds.maxPoint.v[axis] - lo;
+            if (extent <= 0.0f) continue;
+            float scale = BINS / extent;
+
+            AABB binBoxes[BINS];
+            int binCounts[BINS] = { 0 };
+            for (int i = first; i < first + count; i++) {
+                int b = (int)((centroids[items[i]].v[axis] - lo) * scale);
+                b = b < 0 ? 0 : (b >= BINS ? BINS - 1 : b);
+                binCounts[b]++;
+                binBoxes[b].merge(boxes[items[i]]);
+            }
+
+            float rightArea[BINS];
+            int rightCount[BINS];
+            AABB acc;
+            int n = 0;
+            for (int b = BINS - 1; b > 0; b--) {
+                acc.merge(binBoxes[b]);
+                n += binCounts[b];
+                rightArea[b] = acc.surfaceArea();
+                rightCount[b] = n;
+            }
+            acc = AABB();
+            n = 0;
+            for (int b = 0; b < BINS - 1; b++) {
+                acc.merge(binBoxes[b]);
+                n += binCounts[b];
+                if (n == 0 || rightCount[b + 1] == 0) continue;
+                float cost = 0.125f + (acc.surfaceArea() * n + rightArea[b + 1] * rightCount[b + 1]) / parentArea;
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestBin = b;
+                }
+            }
+        }
+        if (bestAxis < 0) return -1;
+
+        float lo = centroidBounds.minPoint.v[bestAxis];
+        float scale = BINS / (centroidBounds.maxPoint.v[bestAxis] - lo);
+        auto it = std::partition(items.begin() + first, items.begin() + first + count, [&](int id) {
+            int b = (int)((centroids[id].v[bestAxis] - lo) * scale);
+            b = b < 0 ? 0 : (b >= BINS ? BINS - 1 : b);
+            return b <= bestBin;
+        });
+        int mid = (int)(it - items.begin());
+        return (mid == first || mid == first + count) ? -1 : mid;
+    }
+};
+
+// Uniform spatial hash grid for moving objects
+// Each object is registered in every cell its box touches. Moves that stay within the same
+// cells cost nothing; others touch only the cells entered and left. Cells live in a dense
+// array (reused through a free list) so pair finding walks memory linearly.
+// Static objects can be registered too; pairs between two of them are never reported.
+class SpatialHashGrid {
+public:
+    explicit SpatialHashGrid(float _cellSize = 4.0f) : cellSize(_cellSize), inverseCellSize(1.0f / _cellSize) {}
+
+    float getCellSize() const {
+        return cellSize;
+    }
+
+    // Only allowed while the grid is empty
+    void setCellSize(float size) {
+        cellSize = size;
+        inverseCellSize = 1.0f / size;
+    }
+
+    void clear() {
+        ranges.clear();
+        cells.clear();
+        freeCells.clear();
+        cellIndex.clear();
+        hasBounds = false;
+    }
+
+    void insert(int id, const AABB& box, bool isStatic = false) {
+        if (id >= (int)ranges.size()) ranges.resize(id + 1);
+        CellRange r = cellRange(box);
+        r.inGrid = true;
+        r.isStatic = isStatic;
+        ranges[id] = r;
+        forEachCell(r, [&](int x, int y, int z) { addToCell(x, y, z, id); });
+    }
+
+    void move(int id, const AABB& box) {
+        if (id >= (int)ranges.size() || !ranges[id].inGrid) {
+            insert(id, box);
+            return;
+        }
+        CellRange old = ranges[id];
+        CellRange r = cellRange(box);
+        r.inGrid = true;
+        r.isStatic = old.isStatic;
+        if (sameCells(old, r)) return;
+        forEachCell(old, [&](int x, int y, int z) {
+            if (!r.contains(x, y, z)) removeFromCell(x, y, z, id);
+        });
+        forEachCell(r, [&](int x, int y, int z) {
+            if (!old.contains(x, y, z)) addToCell(x, y, z, id);
+        });
+        ranges[id] = r;
+    }
+
+    void remove(int id) {
+        if (id >= (int)ranges.size() || !ranges[id].inGrid) return;
+        forEachCell(ranges[id], [&](int x, int y, int z) { removeFromCell(x, y, z, id); });
+        ranges[id].inGrid = false;
+    }
+
+    // Calls fn(objectId) once for every object overlapping box; statics only when asked for
+    template<typename Fn>
+    void query(const AABB& box, const std::vector<AABB>& boxes, Fn fn, bool includeStatic = false) const {
+        CellRange q = cellRange(box);
+        forEachCell(q, [&](int x, int y, int z) {
+            auto it = cellIndex.find(cellKey(x, y, z));
+            if (it == cellIndex.end()) return;
+            const std::vector<int>& objects = cells[it->second].objects;
+            for (size_t i = 0; i < objects.size(); i++) {
+                int id = objects[i];
+                // Report only from the first cell shared with the query, so no id repeats
+                const CellRange& r = ranges[id];
+                if (r.isStatic && !includeStatic) continue;
+                if ((std::max)(r.minX, q.minX) != x || (std::max)(r.minY, q.minY) != y || (std::max)(r.minZ, q.minZ) != z) continue;
+                if (boxes[id].intersects(box)) fn(id);
+            }
+        });
+    }
+
+    // Number of cells box would occupy
+    int cellSpan(const AABB& box) const {
+        CellRange r = cellRange(box);
+        return (r.maxX - r.minX + 1) * (r.maxY - r.minY + 1) * (r.maxZ - r.minZ + 1);
+    }
+
+    // Appends every overlapping pair: lower id first, or the moving object first when the other
+    // is static. With a job system the cells are split
+    // across threads; results are concatenated in cell order, so the output is the same.
+    void findPairs(const std::vector<AABB>& boxes, std::vector<std::pair<int, int>>& pairs, JobSystem* jobs = nullptr) const {
+        if (!jobs || jobs->workerCount() == 0) {
+            pairsInCells(boxes, 0, (int)cells.size(), pairs);
+            return;
+        }
+        int chunks = (jobs->workerCount() + 1) * 4;
+        int grain = ((int)cells.size() + chunks - 1) / chunks;
+        if (grain < 1) grain = 1;
+        chunkPairs.resize(chunks);
+        jobs->parallelFor((int)cells.size(), grain, [&](int begin, int end) {
+            std::vector<std::pair<int, int>>& out = chunkPairs[begin / grain];
+            out.clear();
+            pairsInCells(boxes, begin, end, out);
+        });
+        for (int c = 0; c * grain < (int)cells.size(); c++) {
+            pairs.insert(pairs.end(), chunkPairs[c].begin(), chunkPairs[c].end());
+        }
+    }
+
+    int cellCount() const {
+        return (int)cellIndex.size();
+    }
+
+    // Walks the cells along the ray in order (3D DDA) and calls visit(objects, best) for each
+    // occupied one; visit returns the nearest hit so far, and the walk stops once no later
+    // cell can beat it. The walk is clipped to the cells ever used, so unbounded rays are fine.
+    template<typename Fn>
+    void raycast(const Ray& ray, float best, Fn visit) const {
+        if (!hasBounds) return;
+        float o[3] = { ray.origin.x, ray.origin.y, ray.origin.z };
+        float d[3] = { ray.direction.x, ray.direction.y, ray.direction.z };
+        int lo[3] = { boundsMin[0], boundsMin[1], boundsMin[2] };
+        int hi[3] = { boundsMax[0], boundsMax[1], boundsMax[2] };
+
+        float tEnter = 0.0f;
+        float tExit = best;
+        for (int a = 0; a < 3; a++) {
+            float minEdge = lo[a] * cellSize;
+            float maxEdge = (hi[a] + 1) * cellSize;
+            if (fabsf(d[a]) < 1e-20f) {
+                if (o[a] < minEdge || o[a] > maxEdge) return;
+                continue;
+            }
+            float t0 = (minEdge - o[a]) / d[a];
+            float t1 = (maxEdge - o[a]) / d[a];
+            if (t0 > t1) std::swap(t0, t1);
+            tEnter = (std::max)(tEnter, t0);
+            tExit = (std::min)(tExit, t1);
+        }
+        if (tEnter > tExit) return;
+
+        int cell[3], step[3];
+        float next[3], delta[3];
+        for (int a = 0; a < 3; a++) {
+            cell[a] = (int)floorf((o[a] + d[a] * tEnter) * inverseCellSize);
+            cell[a] = cell[a] < lo[a] ? lo[a] : (cell[a] > hi[a] ? hi[a] : cell[a]);
+            if (fabsf(d[a]) < 1e-20f) {
+                step[a] = 0;
+                next[a] = FLT_MAX;
+                delta[a] = FLT_MAX;
+                continue;
+            }
+            step[a] = d[a] > 0.0f ? 1 : -1;
+            float edge = (cell[a] + (d[a] > 0.0f ? 1 : 0)) * cellSize;
+            next[a] = (edge - o[a]) / d[a];
+            delta[a] = cellSize / fabsf(d[a]);
+        }
+
+        while (true) {
+            auto it = cellIndex.find(cellKey(cell[0], cell[1], cell[2]));
+            if (it != cellIndex.end()) best = visit(cells[it->second].objects, best);
+            int a = next[0] < next[1] ? (next[0] < next[2] ? 0 : 2) : (next[1] < next[2] ? 1 : 2);
+            if (next[a] >= best || next[a] > tExit) return;
+            cell[a] += step[a];
+            if (cell[a] < lo[a] || cell[a] > hi[a]) return;
+            next[a] += delta[a];
+        }
+    }
+
+private:
+    struct CellRange {
+        int minX, minY, minZ;
+        int maxX, maxY, maxZ;
+        bool inGrid;
+        bool isStatic;
+
+        bool contains(int x, int y, int z) const {
+            return x >= minX && x <= maxX && y >= minY && y <= maxY && z >= minZ && z <= maxZ;
+        }
+    };
+
+    struct Cell {
+        int x, y, z;
+        std::vector<int> objects;
+    };
+
+    float cellSize;
+    float inverseCellSize;
+    std::vector<CellRange> ranges;  // by object id
+    std::vector<Cell> cells;
+    std::vector<int> freeCells;
+    std::unordered_map<uint64_t, int> cellIndex;
+    mutable std::vector<std::vector<std::pair<int, int>>> chunkPairs;
+    bool hasBounds = false;     // cell range ever touched; only grows until clear()
+    int boundsMin[3];
+    int boundsMax[3];
+
+    void growBounds(int x, int y, int z) {
+        int c[3] = { x, y, z };
+        for (int a = 0; a < 3; a++) {
+            if (!hasBounds || c[a] < boundsMin[a]) boundsMin[a] = c[a];
+            if (!hasBounds || c[a] > boundsMax[a]) boundsMax[a] = c[a];
+        }
+        hasBounds = true;
+    }
+
+    static uint64_t cellKey(int x, int y, int z) {
+        return ((uint64_t)(x & 0x1FFFFF) << 42) | ((uint64_t)(y & 0x1FFFFF) << 21) | (uint64_t)(z & 0x1FFFFF);
+    }
+
+    CellRange cellRange(const AABB& box) const {
+        CellRange r;
+        r.minX = (int)floorf(box.minPoint.x * inverseCellSize);
+        r.minY = (int)floorf(box.minPoint.y * inverseCellSize);
+        r.minZ = (int)floorf(box.minPoint.z * inverseCellSize);
+        r.maxX = (int)floorf(box.maxPoint.x * inverseCellSize);
+        r.maxY = (int)floorf(box.maxPoint.y * inverseCellSize);
+        r.maxZ = (int)floorf(box.maxPoint.z * inverseCellSize);
+        r.inGrid = false;
+        r.isStatic = false;
+        return r;
+    }
+
+    static bool sameCells(const CellRange& a, const CellRange& b) {
+        return a.minX == b.minX && a.minY == b.minY && a.minZ == b.minZ && a.maxX == b.maxX && a.maxY == b.maxY && a.maxZ == b.maxZ;
+    }
+
+    template<typename Fn>
+    static void forEachCell(const CellRange& r, Fn fn) {
+        for (int x = r.minX; x <= r.maxX; x++)
+            for (int y = r.minY; y <= r.maxY; y++)
+                for (int z = r.minZ; z <= r.maxZ; z++)
+                    fn(x, y, z);
+    }
+
+    void addToCell(int x, int y, int z, int id) {
+        uint64_t key = cellKey(x, y, z);
+        auto it = cellIndex.find(key);
+        int index;
+        if (it != cellIndex.end()) {
+            index = it->second;
+        }
+        else {
+            if (!freeCells.empty()) {
+                index = freeCells.back();
+                freeCells.pop_back();
+            }
+            else {
+                index = (int)cells.size();
+                cells.push_back(Cell());
+            }
+            cells[index].x = x;
+            cells[index].y = y;
+            cells[index].z = z;
+            cellIndex[key] = index;
+            growBounds(x, y, z);
+        }
+        cells[index].objects.push_back(id);
+    }
+
+    void removeFromCell(int x, int y, int z, int id) {
+        auto it = cellIndex.find(cellKey(x, y, z));
+        if (it == cellIndex.end()) return;
+        std::vector<int>& objects = cells[it->second].objects;
+        for (size_t i = 0; i < objects.size(); i++) {
+            if (objects[i] == id) {
+                objects[i] = objects.back();
+                objects.pop_back();
+                break;
+            }
+        }
+        if (objects.empty()) {
+            freeCells.push_back(it->second);
+            cellIndex.erase(it);
+        }
+    }
+
+    void pairsInCells(const std::vector<AABB>& boxes, int begin, int end, std::vector<std::pair<int, int>>& out) const {
+        for (int c = begin; c < end; c++) {
+            const Cell& cell = cells[c];
+            const std::vector<int>& objects = cell.objects;
+            for (size_t i = 0; i < objects.size(); i++) {
+                int a = objects[i];
+                const CellRange& ra = ranges[a];
+                for (size_t j = i + 1; j < objects.size(); j++) {
+                    int b = objects[j];
+                    const CellRange& rb = ranges[b];
+                    if (ra.isStatic && rb.isStatic) continue;
+                    // A pair sharing several cells is only reported from the first of them
+                    if ((std::max)(ra.minX, rb.minX) != cell.x || (std::max)(ra.minY, rb.minY) != cell.y || (std::max)(ra.minZ, rb.minZ) != cell.z) continue;
+                    if (!boxes[a].intersects(boxes[b])) continue;
+                    if (ra.isStatic) out.push_back(std::make_pair(b, a));
+                    else if (rb.isStatic || a < b) out.push_back(std::make_pair(a, b));
+                    else out.push_back(std::make_pair(b, a));
+                }
+            }
+        }
     }
 };
 
+// Exact primitive tests used by the triangle mesh colliders
+namespace collisionMath {
+    inline mathLib::Vec3 sub(const mathLib::Vec3& a, const mathLib::Vec3& b) {
+        return mathLib::Vec3(a.x - b.x, a.y - b.y, a.z - b.z);
+    }
+
+    inline mathLib::Vec3 madd(const mathLib::Vec3& a, const mathLib::Vec3& b, float s) {
+        return mathLib::Vec3(a.x + b.x * s, a.y + b.y * s, a.z + b.z * s);
+    }
+
+    inline mathLib::Vec3 crossProduct(const mathLib::Vec3& a, const mathLib::Vec3& b) {
+        return mathLib::Vec3(a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x);
+    }
+
+    inline float clamp01(float v) {
+        return v < 0.0f ? 0.0f : (v > 1.0f ? 1.0f : v);
+    }
+
+    // Double-sided ray/triangle intersection (Moller-Trumbore); t is along the unnormalised direction
+    inline bool rayTriangle(const mathLib::Vec3& origin, const mathLib::Vec3& dir, const mathLib::Vec3& a, const mathLib::Vec3& b, const mathLib::Vec3& c, float maxT, float& t) {
+        mathLib::Vec3 e1 = sub(b, a);
+        mathLib::Vec3 e2 = sub(c, a);
+        mathLib::Vec3 p = crossProduct(dir, e2);
+        float det = e1.dot(p);
+        if (fabsf(det) < 1e-12f) return false;
+        float inv = 1.0f / det;
+        mathLib::Vec3 s = sub(origin, a);
+        float u = s.dot(p) * inv;
+        if (u < 0.0f || u > 1.0f) return false;
+        mathLib::Vec3 q = crossProduct(s, e1);
+        float v = dir.dot(q) * inv;
+        if (v < 0.0f || u + v > 1.0f) return false;
+        float hit = e2.dot(q) * inv;
+        if (hit < 0.0f || hit > maxT) return false;
+        t = hit;
+        return true;
+    }
+
+    // Closest point to p on triangle abc (Ericson, Real-Time Collision Detection 5.1.5)
+    inline mathLib::Vec3 closestPointTriangle(const mathLib::Vec3& p, const mathLib::Vec3& a, const mathLib::Vec3& b, const mathLib::Vec3& c) {
+        mathLib::Vec3 ab = sub(b, a), ac = sub(c, a), ap = sub(p, a);
+        float d1 = ab.dot(ap), d2 = ac.dot(ap);
+        if (d1 <= 0.0f && d2 <= 0.0f) return a;
+        mathLib::Vec3 bp = sub(p, b);
+        float d3 = ab.dot(bp), d4 = ac.dot(bp);
+        if (d3 >= 0.0f && d4 <= d3) return b;
+        float vc = d1 * d4 - d3 * d2;
+        if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f) return madd(a, ab, d1 / (d1 - d3));
+        mathLib::Vec3 cp = sub(p, c);
+        float d5 = ab.dot(cp), d6 = ac.dot(cp);
+        if (d6 >= 0.0f && d5 <= d6) return c;
+        float vb = d5 * d2 - d1 * d6;
+        if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f) return madd(a, ac, d2 / (d2 - d6));
+        float va = d3 * d6 - d5 * d4;
+        if (va <= 0.0f && (d4 - d3) >= 0.0f && (d5 - d6) >= 0.0f) {
+            return madd(b, sub(c, b), (d4 - d3) / ((d4 - d3) + (d5 - d6)));
+        }
+        float denom = 1.0f / (va + vb + vc);
+        return madd(madd(a, ab, vb * denom), ac, vc * denom);
+    }
+
+    // Squared distance between segments p1q1 and p2q2 (Ericson 5.1.9)
+    inline float segmentSegmentDistanceSq(const mathLib::Vec3& p1, const mathLib::Vec3& q1, const mathLib::Vec3& p2, const mathLib::Vec3& q2) {
+        mathLib::Vec3 d1 = sub(q1, p1), d2 = sub(q2, p2), r = sub(p1, p2);
+        float a = d1.dot(d1), e = d2.dot(d2), f = d2.dot(r);
+        float s, t;
+        if (a <= 1e-12f && e <= 1e-12f) {
+            s = t = 0.0f;
+        }
+        else if (a <= 1e-12f) {
+            s = 0.0f;
+            t = clamp01(f / e);
+        }
+        else {
+            float c = d1.dot(r);
+            if (e <= 1e-12f) {
+                t = 0.0f;
+                s = clamp01(-c / a);
+            }
+            else {
+                float b = d1.dot(d2);
+                float denom = a * e - b * b;
+                s = denom > 1e-12f ? clamp01((b * f - c * e) / denom) : 0.0f;
+                t = (b * s + f) / e;
+                if (t < 0.0f) {
+                    t = 0.0f;
+                    s = clamp01(-c / a);
+                }
+                else if (t > 1.0f) {
+                    t = 1.0f;
+                    s = clamp01((b - c) / a);
+                }
+            }
+        }
+        mathLib::Vec3 diff = sub(madd(p1, d1, s), madd(p2, d2, t));
+        return diff.dot(diff);
+    }
+
+    inline float segmentTriangleDistanceSq(const mathLib::Vec3& p, const mathLib::Vec3& q, const mathLib::Vec3& a, const mathLib::Vec3& b, const mathLib::Vec3& c) {
+        float t;
+        if (rayTriangle(p, sub(q, p), a, b, c, 1.0f, t)) return 0.0f;
+        mathLib::Vec3 cp = sub(closestPointTriangle(p, a, b, c), p);
+        mathLib::Vec3 cq = sub(closestPointTriangle(q, a, b, c), q);
+        float best = (std::min)(cp.dot(cp), cq.dot(cq));
+        best = (std::min)(best, segmentSegmentDistanceSq(p, q, a, b));
+        best = (std::min)(best, segmentSegmentDistanceSq(p, q, b, c));
+        best = (std::min)(best, segmentSegmentDistanceSq(p, q, c, a));
+        return best;
+    }
+
+    inline float segmentBoxDistanceSq(const mathLib::Vec3& p, const mathLib::Vec3& q, const AABB& box) {
+        // Segment passing through the box
+        float t0 = 0.0f, t1 = 1.0f;
+        bool inside = true;
+        for (int a = 0; a < 3 && inside; a++) {
+            float d = q.v[a] - p.v[a];
+            if (fabsf(d) < 1e-20f) {
+                inside = p.v[a] >= box.minPoint.v[a] && p.v[a] <= box.maxPoint.v[a];
+                continue;
+            }
+            float ta = (box.minPoint.v[a] - p.v[a]) / d;
+            float tb = (box.maxPoint.v[a] - p.v[a]) / d;
+            if (ta > tb) std::swap(ta, tb);
+            t0 = (std::max)(t0, ta);
+            t1 = (std::min)(t1, tb);
+            inside = t0 <= t1;
+        }
+        if (inside) return 0.0f;
+
+        // Otherwise the closest points are an endpoint against the box, or the segment against an edge
+        float best = FLT_MAX;
+        const mathLib::Vec3* ends[2] = { &p, &q };
+        for (int i = 0; i < 2; i++) {
+            mathLib::Vec3 c = mathLib::Max(box.minPoint, mathLib::Min(box.maxPoint, *ends[i]));
+            mathLib::Vec3 d = sub(c, *ends[i]);
+            best = (std::min)(best, d.dot(d));
+        }
+        for (int axis = 0; axis < 3; axis++) {
+            int u = (axis + 1) % 3, w = (axis + 2) % 3;
+            for (int k = 0; k < 4; k++) {
+                mathLib::Vec3 e0, e1;
+                e0.v[axis] = box.minPoint.v[axis];
+                e1.v[axis] = box.maxPoint.v[axis];
+                e0.v[u] = e1.v[u] = (k & 1) ? box.maxPoint.v[u] : box.minPoint.v[u];
+                e0.v[w] = e1.v[w] = (k & 2) ? box.maxPoint.v[w] : box.minPoint.v[w];
+                best = (std::min)(best, segmentSegmentDistanceSq(p, q, e0, e1));
+            }
+        }
+        return best;
+    }
+
+    // Closest points between segment pq and a convex shape given by its closest-point function.
+    // Distance to a convex set is convex along the segment, so a golden-section search on the
+    // segment parameter finds the minimum. Returns the squared distance.
+    template<typename Closest>
+    inline float closestSegmentShape(const mathLib::Vec3& p, const mathLib::Vec3& q, Closest closest, mathLib::Vec3& onSegment, mathLib::Vec3& onShape) {
+        mathLib::Vec3 d = sub(q, p);
+        auto distanceSq = [&](float s) {
+            mathLib::Vec3 x = madd(p, d, s);
+            mathLib::Vec3 e = sub(x, closest(x));
+            return e.dot(e);
+        };
+        const float ratio = 0.618034f;
+        float lo = 0.0f, hi = 1.0f;
+        float s1 = hi - ratio * (hi - lo), s2 = lo + ratio * (hi - lo);
+        float f1 = distanceSq(s1), f2 = distanceSq(s2);
+        for (int i = 0; i < 16; i++) {
+            if (f1 < f2) {
+                hi = s2;
+                s2 = s1;
+                f2 = f1;
+                s1 = hi - ratio * (hi - lo);
+                f1 = distanceSq(s1);
+            }
+            else {
+                lo = s1;
+                s1 = s2;
+                f1 = f2;
+                s2 = lo + ratio * (hi - lo);
+                f2 = distanceSq(s2);
+            }
+        }
+        // The ends are not reached by the interior probes, so check them too
+        float best = 0.5f * (lo + hi);
+        float fBest = distanceSq(best);
+        float f0 = distanceSq(0.0f), fEnd = distanceSq(1.0f);
+        if (f0 < fBest) { best = 0.0f; fBest = f0; }
+        if (fEnd < fBest) { best = 1.0f; fBest = fEnd; }
+        onSegment = madd(p, d, best);
+        onShape = closest(onSegment);
+        return fBest;
+    }
+
+    // Separating axis test between a box (center, half extents) moving by d over [0, 1] and a
+    // triangle. Returns the time of first contact and the normal of the axis that separated last.
+    // With d = 0 this is a plain overlap test; touching does not count.
+    inline bool sweepBoxTriangle(const mathLib::Vec3& center, const mathLib::Vec3& half, const mathLib::Vec3& d,
+        const mathLib::Vec3& a, const mathLib::Vec3& b, const mathLib::Vec3& c, float& time, mathLib::Vec3& normal) {
+        mathLib::Vec3 edges[3] = { sub(b, a), sub(c, b), sub(a, c) };
+        mathLib::Vec3 axes[13];
+        int count = 0;
+        axes[count++] = mathLib::Vec3(1, 0, 0);
+        axes[count++] = mathLib::Vec3(0, 1, 0);
+        axes[count++] = mathLib::Vec3(0, 0, 1);
+        axes[count++] = crossProduct(edges[0], edges[1]);
+        for (int e = 0; e < 3; e++) {
+            axes[count++] = mathLib::Vec3(0, -edges[e].z, edges[e].y);
+            axes[count++] = mathLib::Vec3(edges[e].z, 0, -edges[e].x);
+            axes[count++] = mathLib::Vec3(-edges[e].y, edges[e].x, 0);
+        }
+
+        float entry = -FLT_MAX;
+        float exit = FLT_MAX;
+        int entryAxis = -1;
+        for (int i = 0; i < count; i++) {
+            const mathLib::Vec3& L = axes[i];
+            float lengthSq = L.dot(L);
+            if (lengthSq < 1e-12f) continue;
+            float r = half.x * fabsf(L.x) + half.y * fabsf(L.y) + half.z * fabsf(L.z);
+            float boxCenter = center.dot(L);
+            float pa = a.dot(L), pb = b.dot(L), pc = c.dot(L);
+            float triMin = (std::min)(pa, (std::min)(pb, pc));
+            float triMax = (std::max)(pa, (std::max)(pb, pc));
+            // Overlap while triMin - r < boxCenter + speed * t < triMax + r
+            float lo = triMin - r - boxCenter;
+            float hi = triMax + r - boxCenter;
+            float speed = d.dot(L);
+            if (fabsf(speed) < 1e-12f * sqrtf(lengthSq)) {
+                if (lo >= 0.0f || hi <= 0.0f) return false;
+                continue;
+            }
+            float t0 = lo / speed;
+            float t1 = hi / speed;
+            if (t0 > t1) std::swap(t0, t1);
+            if (t0 > entry) {
+                entry = t0;
+                entryAxis = i;
+            }
+            if (t1 < exit) exit = t1;
+            if (entry >= exit) return false;
+        }
+        if (entry >= exit || entry > 1.0f || exit <= 0.0f) return false;
+
+        time = entry;
+        if (entryAxis < 0) {
+            normal = mathLib::Vec3(0, 0, 0);
+            return true;
+        }
+        const mathLib::Vec3& L = axes[entryAxis];
+        float inv = 1.0f / sqrtf(L.dot(L));
+        normal = mathLib::Vec3(L.x * inv, L.y * inv, L.z * inv);
+        if (normal.dot(d) > 0.0f) normal = -normal;
+        return true;
+    }
+}
+
+// Triangle soup with its own BVH, in the mesh's local space. One shape is built per model file
+// and shared by every instance of it (see CollisionShapeCache).
+class TriangleMeshShape {
+public:
+    std::vector<mathLib::Vec3> positions;
+    std::vector<int> indices;           // three per triangle
+    std::vector<AABB> triangleBoxes;    // by triangle, used as the BVH's boxes
+    BVH tree;
+    AABB bounds;
+
+    // positions points at the first vertex position, stride is the vertex size in bytes. Triangles
+    // with an index outside [0, vertexCount) are dropped, so a bad file cannot send build() or the
+    // queries past the end of positions.
+    void addTriangles(const void* vertexPositions, int stride, int vertexCount, const unsigned int* triangleIndices, int indexCount) {
+        int base = (int)positions.size();
+        const char* p = (const char*)vertexPositions;
+        for (int i = 0; i < vertexCount; i++) {
+            const float* v = (const float*)(p + (size_t)i * stride);
+            positions.push_back(mathLib::Vec3(v[0], v[1], v[2]));
+        }
+        unsigned int limit = vertexCount > 0 ? (unsigned int)vertexCount : 0u;
+        for (int i = 0; i + 2 < indexCount; i += 3) {
+            if (triangleIndices[i] >= limit || triangleIndices[i + 1] >= limit || triangleIndices[i + 2] >= limit) continue;
+            indices.push_back(base + (int)triangleIndices[i]);
+            indices.push_back(base + (int)triangleIndices[i + 1]);
+            indices.push_back(base + (int)triangleIndices[i + 2]);
+        }
+    }
+
+    void build() {
+        int count = triangleCount();
+        triangleBoxes.resize(count);
+        std::vector<int> ids(count);
+        bounds = AABB();
+        for (int i = 0; i < count; i++) {
+            AABB box;
+            for (int k = 0; k < 3; k++) box.expand(positions[indices[i * 3 + k]]);
+            triangleBoxes[i] = box;
+            bounds.merge(box);
+            ids[i] = i;
+        }
+        tree.build(triangleBoxes, ids, 2);
+    }
+
+    int triangleCount() const {
+        return (int)indices.size() / 3;
+    }
+
+    size_t memoryBytes() const {
+        return positions.size() * sizeof(mathLib::Vec3) + indices.size() * sizeof(int) +
+            triangleBoxes.size() * sizeof(AABB) + tree.nodes.size() * sizeof(BVH::Node) + tree.items.size() * sizeof(int);
+    }
+
+    void triangle(int index, mathLib::Vec3& a, mathLib::Vec3& b, mathLib::Vec3& c) const {
+        a = positions[indices[index * 3]];
+        b = positions[indices[index * 3 + 1]];
+        c = positions[indices[index * 3 + 2]];
+    }
+
+    // Calls fn(triangleIndex) for triangles whose bounds overlap a local-space box
+    template<typename Fn>
+    void queryTriangles(const AABB& box, Fn fn) const {
+        tree.query(box, triangleBoxes, fn);
+    }
+
+    // Nearest triangle hit by a local-space ray
+    bool raycast(const Ray& ray, float& t, int& hitTriangle) const {
+        RayPacket packet;
+        packet.set(&ray, 1);
+        tree.raycast(packet, triangleBoxes, [&](int tri, int, float) {
+            mathLib::Vec3 a, b, c;
+            triangle(tri, a, b, c);
+            float hit;
+            return collisionMath::rayTriangle(ray.origin, ray.direction, a, b, c, packet.best[0], hit) ? hit : -1.0f;
+        });
+        if (packet.ids[0] < 0) return false;
+        t = packet.best[0];
+        hitTriangle = packet.ids[0];
+        return true;
+    }
+};
+
+// One placed instance of a shared triangle mesh. Candidate triangles are found in local space;
+// the exact tests run on world-space triangles, so any affine transform (including non-uniform
+// scale) is handled exactly.
+struct MeshCollider {
+    const TriangleMeshShape* shape = nullptr;
+    mathLib::Matrix world;
+    mathLib::Matrix inverse;
+
+    MeshCollider() {}
+    MeshCollider(const TriangleMeshShape* s, const mathLib::Matrix& w) : shape(s), world(w), inverse(w.invert()) {}
+
+    AABB worldBounds() const {
+        return shape->bounds.transform(world);
+    }
+
+    void worldTriangle(int index, mathLib::Vec3& a, mathLib::Vec3& b, mathLib::Vec3& c) const {
+        shape->triangle(index, a, b, c);
+        a = world.mulPoint(a);
+        b = world.mulPoint(b);
+        c = world.mulPoint(c);
+    }
+
+    bool overlapsBox(const AABB& box) const {
+        mathLib::Vec3 center = box.getCenter();
+        mathLib::Vec3 half = collisionMath::sub(box.maxPoint, center);
+        mathLib::Vec3 zero(0, 0, 0);
+        bool hit = false;
+        shape->queryTriangles(box.transform(inverse), [&](int tri) {
+            if (hit) return;
+            mathLib::Vec3 a, b, c, n;
+            float t;
+            worldTriangle(tri, a, b, c);
+            hit = collisionMath::sweepBoxTriangle(center, half, zero, a, b, c, t, n);
+        });
+        return hit;
+    }
+
+    // Capsule is the segment pq swept by radius
+    bool overlapsCapsule(const mathLib::Vec3& p, const mathLib::Vec3& q, float radius) const {
+        AABB box;
+        box.expand(p);
+        box.expand(q);
+        box.minPoint = box.minPoint - mathLib::Vec3(radius, radius, radius);
+        box.maxPoint = box.maxPoint + mathLib::Vec3(radius, radius, radius);
+        bool hit = false;
+        shape->queryTriangles(box.transform(inverse), [&](int tri) {
+            if (hit) return;
+            mathLib::Vec3 a, b, c;
+            worldTriangle(tri, a, b, c);
+            hit = collisionMath::segmentTriangleDistanceSq(p, q, a, b, c) < radius * radius;
+        });
+        return hit;
+    }
+
+    // t is in the world ray's units: an affine transform keeps the ray parameter unchanged
+    bool raycast(const Ray& ray, float& t, mathLib::Vec3& normal) const {
+        Ray local(inverse.mulPoint(ray.origin), inverse.mulVec(ray.direction), ray.maxDistance);
+        int tri;
+        if (!shape->raycast(local, t, tri)) return false;
+        mathLib::Vec3 a, b, c;
+        worldTriangle(tri, a, b, c);
+        normal = collisionMath::crossProduct(collisionMath::sub(b, a), collisionMath::sub(c, a));
+        normal = normal.normalize();
+        if (normal.dot(ray.direction) > 0.0f) normal = -normal;
+        return true;
+    }
+
+    // Earliest contact of a box moving by displacement. A box that already overlaps a triangle at the
+    // start only stops on it (at time 0) if the move goes further in against its face, as with
+    // boxes, so a mover can always slide along or back out but cannot sink through
+    bool sweepBox(const AABB& box, const mathLib::Vec3& displacement, float& time, mathLib::Vec3& normal) const {
+        AABB swept = box;
+        AABB moved = box;
+        moved.minPoint = box.minPoint + displacement;
+        moved.maxPoint = box.maxPoint + displacement;
+        swept.merge(moved);
+        mathLib::Vec3 center = box.getCenter();
+        mathLib::Vec3 half = collisionMath::sub(box.maxPoint, center);
+        bool hit = false;
+        shape->queryTriangles(swept.transform(inverse), [&](int tri) {
+            mathLib::Vec3 a, b, c, n;
+            float t;
+            worldTriangle(tri, a, b, c);
+            if (!collisionMath::sweepBoxTriangle(center, half, displacement, a, b, c, t, n)) return;
+            if (t < 0.0f) {
+                // Face normal turned towards the box centre
+                n = collisionMath::crossProduct(collisionMath::sub(b, a), collisionMath::sub(c, a));
+                float length = n.getLength();
+                if (length < 1e-12f) return;
+                n = mathLib::Vec3(n.x / length, n.y / length, n.z / length);
+                if (collisionMath::sub(center, a).dot(n) < 0.0f) n = -n;
+                if (displacement.dot(n) >= 0.0f) return;
+                t = 0.0f;
+            }
+            if (!hit || t < time) {
+                hit = true;
+                time = t;
+                normal = n;
+            }
+        });
+        return hit;
+    }
+};
+
+// Builds each model's collision shape once and hands the same one to every instance
+class CollisionShapeCache {
+public:
+    std::map<std::string, TriangleMeshShape*> shapes;
+
+    TriangleMeshShape* find(const std::string& name) {
+        auto it = shapes.find(name);
+        if (it != shapes.end()) {
+            return it->second;
+        }
+        return nullptr;
+    }
+
+    // Returns a new empty shape registered under name; the caller fills it and calls build()
+    TriangleMeshShape* create(const std::string& name) {
+        TriangleMeshShape* shape = new TriangleMeshShape();
+        shapes.insert({ name, shape });
+        return shape;
+    }
+
+    ~CollisionShapeCache() {
+        for (auto it = shapes.cbegin(); it != shapes.cend(); ) {
+            delete it->second;
+            shapes.erase(it++);
+        }
+    }
+};
+
+// Result of sweeping a box through the world
+struct SweepHit {
+    bool hit = false;
+    float time = 1.0f;                  // fraction of the displacement travelled before contact
+    mathLib::Vec3 normal;               // contact normal, pointing away from the object hit
+    mathLib::Vec3 remainingVelocity;    // velocity left after contact, with the normal part removed
+    int objectId = -1;
+};
+
 // Collision World manages all collidable objects
 class CollisionWorld {
 public:
@@ -84,59 +1262,600 @@ public:
         bool isStatic;  // Static objects don't move
         std::string name;
 
+        bool removed = false;
+        int mesh = -1;  // index into meshColliders, or -1 for a plain box
+
+        // Activity, updated by updateContacts()
+        bool moved = false;     // changed during the last tick
+        bool sleeping = false;  // dynamic object idle for sleepAfterTicks ticks
+        int idleTicks = 0;
+        bool pendingMove = false;
+
         CollisionObject(const AABB& box, bool static_obj = true, const std::string& n = "")
             : boundingBox(box), isStatic(static_obj), name(n) {
         }
     };
 
+    // How dynamic objects are tracked: a refitted BVH, or a spatial hash grid for many movers
+    enum DynamicBroadphase { DYNAMIC_BVH, DYNAMIC_HASH_GRID };
+
+    // Pair of touching objects kept across ticks (a < b)
+    struct ContactPair {
+        int a;
+        int b;
+        int firstTick;  // tick the pair started touching
+    };
+
+    struct ActivityStats {
+        int objects = 0;            // live objects
+        int dynamicObjects = 0;
+        int awakeObjects = 0;
+        int sleepingObjects = 0;
+        int movedThisTick = 0;
+        int contactPairs = 0;
+        int pairsAdded = 0;         // during the last tick
+        int pairsRemoved = 0;
+        int pairTests = 0;          // narrow tests run by the last tick
+    };
+
+    int sleepAfterTicks = 60;       // dynamic objects that have not moved for this long go to sleep
+
 private:
     std::vector<CollisionObject> objects;
 
+    // Broadphase: SAH tree over static objects, rebuilt lazily after adds; refitted tree over
+    // dynamic objects. boxes mirrors each object's boundingBox for the trees.
+    std::vector<AABB> boxes;
+    BVH staticTree;
+    BVH dynamicTree;
+    bool staticDirty = false;
+    bool dynamicDirty = false;
+    bool dynamicMoved = false;
+
+    DynamicBroadphase dynamicMode = DYNAMIC_BVH;
+    SpatialHashGrid grid;
+    std::vector<MeshCollider> meshColliders;
+    // In grid mode small statics are also put in the grid; ones covering more cells than this
+    // (terrain, large walls) go in their own tree instead
+    static const int MAX_STATIC_GRID_CELLS = 64;
+    std::vector<int> gridStatics;
+    BVH largeStaticTree;
+
+    // Activity tracking: per-tick work only touches objects that changed
+    std::vector<int> pendingMoves;      // changed since the last updateContacts()
+    std::vector<int> movedLastTick;
+    std::vector<int> refitIds;          // dynamic BVH leaves to refit
+    std::vector<int> awakeIds;
+    std::vector<int> awakeIndex;        // by object id, -1 when asleep or static
+    std::vector<ContactPair> contacts;
+    std::unordered_map<uint64_t, int> contactIndex;
+    std::vector<std::vector<int>> contactsOf;  // contact indices by object id
+    int tickCount = 0;
+    int staticCount = 0;
+    int dynamicCount = 0;
+    ActivityStats lastTick;
+
 public:
-    // Add a collision object
-    void addObject(const AABB& box, bool isStatic = true, const std::string& name = "") {
+    // Switch how dynamic objects are tracked; existing ones are moved over
+    void setDynamicBroadphase(DynamicBroadphase mode, float cellSize = 4.0f) {
+        grid.clear();
+        grid.setCellSize(cellSize);
+        gridStatics.clear();
+        largeStaticTree.clear();
+        staticDirty = true;
+        dynamicMode = mode;
+        if (mode == DYNAMIC_HASH_GRID) {
+            dynamicTree.clear();
+            for (size_t i = 0; i < objects.size(); i++) {
+                if (!objects[i].isStatic && !objects[i].removed) grid.insert((int)i, boxes[i]);
+            }
+        }
+        dynamicDirty = mode == DYNAMIC_BVH;
+    }
+
+    // Add a collision object and return its id
+    int addObject(const AABB& box, bool isStatic = true, const std::string& name = "") {
         objects.push_back(CollisionObject(box, isStatic, name));
+        boxes.push_back(box);
+        awakeIndex.push_back(-1);
+        contactsOf.push_back(std::vector<int>());
+        int id = (int)objects.size() - 1;
+        if (isStatic) {
+            staticDirty = true;
+            staticCount++;
+        }
+        else {
+            if (dynamicMode == DYNAMIC_HASH_GRID) grid.insert(id, box);
+            else dynamicDirty = true;
+            dynamicCount++;
+            setAwake(id, true);
+        }
+        markMoved(id);
+        return id;
+    }
+
+    // Move an object; dynamic objects only refit their tree or touch the grid cells they cross.
+    // Setting the same box again costs nothing and does not count as a move.
+    void updateObject(int id, const AABB& box) {
+        if (BVH::sameBox(boxes[id], box)) return;
+        objects[id].boundingBox = box;
+        boxes[id] = box;
+        if (objects[id].isStatic) {
+            staticDirty = true;
+        }
+        else {
+            if (dynamicMode == DYNAMIC_HASH_GRID) grid.move(id, box);
+            else {
+                dynamicMoved = true;
+                refitIds.push_back(id);
+            }
+            wake(id);
+        }
+        markMoved(id);
+    }
+
+    // Static object using a triangle mesh for exact tests; its broadphase box is the mesh's world bounds.
+    // Returns -1 without adding anything for a missing or empty shape, whose bounds would be inverted
+    int addMeshObject(const TriangleMeshShape* shape, const mathLib::Matrix& world, const std::string& name = "") {
+        if (shape == nullptr || shape->triangleCount() == 0) return -1;
+        MeshCollider collider(shape, world);
+        int id = addObject(collider.worldBounds(), true, name);
+        objects[id].mesh = (int)meshColliders.size();
+        meshColliders.push_back(collider);
+        return id;
+    }
+
+    // Exact test of one object against a box
+    bool overlapsObject(int id, const AABB& box) const {
+        if (objects[id].mesh >= 0) return meshColliders[objects[id].mesh].overlapsBox(box);
+        return boxes[id].intersects(box);
+    }
+
+    // Exact test of one object against the capsule swept by radius along segment pq
+    bool overlapsObject(int id, const mathLib::Vec3& p, const mathLib::Vec3& q, float radius) const {
+        if (objects[id].mesh >= 0) return meshColliders[objects[id].mesh].overlapsCapsule(p, q, radius);
+        return collisionMath::segmentBoxDistanceSq(p, q, boxes[id]) < radius * radius;
+    }
+
+    // Calls fn(objectId) for objects that really touch box (triangles for mesh objects)
+    template<typename Fn>
+    void overlapBox(const AABB& box, Fn fn, bool includeStatic = true, bool includeDynamic = true) {
+        queryOverlaps(box, [&](int id) {
+            if (overlapsObject(id, box)) fn(id);
+        }, includeStatic, includeDynamic);
+    }
+
+    // Calls fn(objectId) for objects touching the capsule swept by radius along segment pq
+    template<typename Fn>
+    void overlapCapsule(const mathLib::Vec3& p, const mathLib::Vec3& q, float radius, Fn fn, bool includeStatic = true, bool includeDynamic = true) {
+        AABB box;
+        box.expand(p);
+        box.expand(q);
+        box.minPoint = box.minPoint - mathLib::Vec3(radius, radius, radius);
+        box.maxPoint = box.maxPoint + mathLib::Vec3(radius, radius, radius);
+        queryOverlaps(box, [&](int id) {
+            if (overlapsObject(id, p, q, radius)) fn(id);
+        }, includeStatic, includeDynamic);
+    }
+
+    // Removed objects keep their id slot; ids are never reused
+    void removeObject(int id) {
+        if (objects[id].removed) return;
+        objects[id].removed = true;
+        if (objects[id].isStatic) {
+            staticDirty = true;
+            staticCount--;
+        }
+        else {
+            if (dynamicMode == DYNAMIC_HASH_GRID) grid.remove(id);
+            else dynamicDirty = true;
+            dynamicCount--;
+            setAwake(id, false);
+        }
+        markMoved(id);
+    }
+
+    // Once per tick, after moving objects: refreshes the persistent contact pairs of everything
+    // that changed, clears last tick's moved flags and puts idle dynamic objects to sleep. Work is
+    // proportional to the objects that changed (plus the awake ones for the sleep countdown);
+    // untouched pairs are kept as they are.
+    void updateContacts() {
+        updateBroadphase();
+        tickCount++;
+        lastTick = ActivityStats();
+
+        for (size_t i = 0; i < movedLastTick.size(); i++) {
+            objects[movedLastTick[i]].moved = false;
+        }
+        movedLastTick.swap(pendingMoves);
+        pendingMoves.clear();
+        std::sort(movedLastTick.begin(), movedLastTick.end());
+
+        for (size_t k = 0; k < movedLastTick.size(); k++) {
+            CollisionObject& obj = objects[movedLastTick[k]];
+            obj.pendingMove = false;
+            obj.moved = true;
+            obj.idleTicks = 0;
+        }
+        // Past about a quarter of the world moving, one findPairs pass beats a query per object
+        if (movedLastTick.size() * 4 > (size_t)(staticCount + dynamicCount)) rebuildContacts();
+        else {
+            for (size_t k = 0; k < movedLastTick.size(); k++) refreshContacts(movedLastTick[k]);
+        }
+
+        // Sleep countdown for awake objects that did not move
+        for (int i = (int)awakeIds.size() - 1; i >= 0; i--) {
+            int id = awakeIds[i];
+            if (objects[id].moved) continue;
+            if (++objects[id].idleTicks >= sleepAfterTicks) {
+                objects[id].sleeping = true;
+                setAwake(id, false);
+            }
+        }
+
+        lastTick.objects = staticCount + dynamicCount;
+        lastTick.dynamicObjects = dynamicCount;
+        lastTick.awakeObjects = (int)awakeIds.size();
+        lastTick.sleepingObjects = dynamicCount - (int)awakeIds.size();
+        lastTick.movedThisTick = (int)movedLastTick.size();
+        lastTick.contactPairs = (int)contacts.size();
+    }
+
+    // Wake a sleeping dynamic object (moving it does this too)
+    void wake(int id) {
+        CollisionObject& obj = objects[id];
+        obj.idleTicks = 0;
+        if (!obj.sleeping) return;
+        obj.sleeping = false;
+        setAwake(id, true);
+    }
+
+    const std::vector<ContactPair>& getContacts() const {
+        return contacts;
+    }
+
+    // Counters from the last updateContacts()
+    const ActivityStats& getActivityStats() const {
+        return lastTick;
     }
 
     // Clear all objects
     void clear() {
         objects.clear();
+        boxes.clear();
+        staticTree.clear();
+        dynamicTree.clear();
+        grid.clear();
+        gridStatics.clear();
+        largeStaticTree.clear();
+        meshColliders.clear();
+        pendingMoves.clear();
+        movedLastTick.clear();
+        refitIds.clear();
+        awakeIds.clear();
+        awakeIndex.clear();
+        contacts.clear();
+        contactIndex.clear();
+        contactsOf.clear();
+        staticCount = 0;
+        dynamicCount = 0;
+        lastTick = ActivityStats();
+        staticDirty = false;
+        dynamicDirty = false;
+        dynamicMoved = false;
+    }
+
+    // Brings both trees up to date; queries call this themselves. Once it has run, queries only
+    // read the world until the next change, so they can run on several threads at once.
+    void updateBroadphase() {
+        if (staticDirty) {
+            buildTree(staticTree, true);
+            if (dynamicMode == DYNAMIC_HASH_GRID) syncGridStatics();
+            staticDirty = false;
+        }
+        if (dynamicDirty) {
+            buildTree(dynamicTree, false);
+            dynamicDirty = false;
+            dynamicMoved = false;
+            refitIds.clear();
+        }
+        else if (dynamicMoved) {
+            // Walking up from each moved leaf beats a full sweep until a good share has moved
+            if (refitIds.size() * 8 < dynamicTree.items.size()) dynamicTree.refit(boxes, refitIds);
+            else dynamicTree.refit(boxes);
+            dynamicMoved = false;
+            refitIds.clear();
+        }
+    }
+
+    // Calls fn(objectId) for every object overlapping box
+    template<typename Fn>
+    void queryOverlaps(const AABB& box, Fn fn, bool includeStatic = true, bool includeDynamic = true) {
+        updateBroadphase();
+        if (includeStatic) staticTree.query(box, boxes, fn);
+        if (includeDynamic) {
+            if (dynamicMode == DYNAMIC_HASH_GRID) grid.query(box, boxes, fn);
+            else dynamicTree.query(box, boxes, fn);
+        }
+    }
+
+    // Every overlapping pair that involves a dynamic object: dynamic/dynamic pairs have the lower
+    // id first, dynamic/static pairs the dynamic id first. The order is the same with or without
+    // a job system. Pairs with mesh objects are checked against the triangles.
+    void findPairs(std::vector<std::pair<int, int>>& pairs, JobSystem* jobs = nullptr) {
+        updateBroadphase();
+        pairs.clear();
+        collectPairs(pairs, jobs);
+        if (meshColliders.empty()) return;
+        pairs.erase(std::remove_if(pairs.begin(), pairs.end(), [&](const std::pair<int, int>& pair) {
+            return objects[pair.second].mesh >= 0 && !overlapsObject(pair.second, boxes[pair.first]);
+        }), pairs.end());
     }
 
     // Check collision and get response
     mathLib::Vec3 checkCollision(const AABB& movingBox, const mathLib::Vec3& velocity) {
         mathLib::Vec3 responseVelocity = velocity;
 
-        for (const auto& obj : objects) {
-            if (obj.isStatic && movingBox.intersects(obj.boundingBox)) {
-                // Calculate penetration depth on each axis
-                mathLib::Vec3 penetration = calculatePenetration(movingBox, obj.boundingBox);
+        updateBroadphase();
+        staticTree.query(movingBox, boxes, [&](int id) {
+            const CollisionObject& obj = objects[id];
+            if (obj.mesh >= 0 && !meshColliders[obj.mesh].overlapsBox(movingBox)) return;
+            // Calculate penetration depth on each axis
+            mathLib::Vec3 penetration = calculatePenetration(movingBox, obj.boundingBox);
+
+            // Find axis with minimum penetration (separation axis)
+            float minPen = FLT_MAX;
+            int axis = -1;
+
+            if (std::abs(penetration.x) < minPen && std::abs(velocity.x) > 0.001f) {
+                minPen = std::abs(penetration.x);
+                axis = 0;
+            }
+            if (std::abs(penetration.y) < minPen && std::abs(velocity.y) > 0.001f) {
+                minPen = std::abs(penetration.y);
+                axis = 1;
+            }
+            if (std::abs(penetration.z) < minPen && std::abs(velocity.z) > 0.001f) {
+                minPen = std::abs(penetration.z);
+                axis = 2;
+            }
+
+            // Apply response on the minimum penetration axis
+            if (axis == 0) responseVelocity.x = 0;
+            if (axis == 1) responseVelocity.y = 0;
+            if (axis == 2) responseVelocity.z = 0;
+        });
+
+        return responseVelocity;
+    }
+
+    // Time of impact of box moving by displacement against a fixed target (slab test on the
+    // Minkowski sum). Boxes that already overlap only count if the move pushes them deeper.
+    static bool sweepBox(const AABB& box, const mathLib::Vec3& displacement, const AABB& target, float& time, mathLib::Vec3& normal) {
+        float entry = -FLT_MAX;
+        float exit = FLT_MAX;
+        int entryAxis = -1;
+        float entrySign = 0.0f;
+        for (int axis = 0; axis < 3; axis++) {
+            float d = displacement.v[axis];
+            float lo = target.minPoint.v[axis] - box.maxPoint.v[axis];   // gap to close moving forward
+            float hi = target.maxPoint.v[axis] - box.minPoint.v[axis];   // gap to close moving backward
+            if (fabsf(d) < 1e-8f) {
+                // Not moving on this axis: must already overlap (touching does not count)
+                if (lo >= 0.0f || hi <= 0.0f) return false;
+                continue;
+            }
+            float t0 = lo / d;
+            float t1 = hi / d;
+            float sign = d > 0.0f ? -1.0f : 1.0f;
+            if (t0 > t1) std::swap(t0, t1);
+            if (t0 > entry) {
+                entry = t0;
+                entryAxis = axis;
+                entrySign = sign;
+            }
+            if (t1 < exit) exit = t1;
+        }
+        if (entryAxis < 0 || entry >= exit || entry >= 1.0f || exit <= 0.0f) return false;
+
+        if (entry < 0.0f) {
+            // Started inside: stop on the shallowest axis if the move goes deeper along it
+            float minPen = FLT_MAX;
+            int axis = -1;
+            float sign = 0.0f;
+            for (int a = 0; a < 3; a++) {
+                float back = box.maxPoint.v[a] - target.minPoint.v[a];
+                float front = target.maxPoint.v[a] - box.minPoint.v[a];
+                if (back < minPen) { minPen = back; axis = a; sign = -1.0f; }
+                if (front < minPen) { minPen = front; axis = a; sign = 1.0f; }
+            }
+            if (displacement.v[axis] * sign >= 0.0f) return false;
+            entry = 0.0f;
+            entryAxis = axis;
+            entrySign = sign;
+        }
+
+        time = entry;
+        normal = mathLib::Vec3(0, 0, 0);
+        normal.v[entryAxis] = entrySign;
+        return true;
+    }
+
+    // Earliest contact of box moving by displacement. Candidates come from the broadphase using
+    // the box swept over the whole move, so large steps cannot skip thin objects.
+    SweepHit sweep(const AABB& box, const mathLib::Vec3& displacement, int ignoreId = -1, bool includeDynamic = false) {
+        SweepHit result;
+        AABB swept = box;
+        AABB moved = box;
+        moved.minPoint = box.minPoint + displacement;
+        moved.maxPoint = box.maxPoint + displacement;
+        swept.merge(moved);
 
-                // Find axis with minimum penetration (separation axis)
-                float minPen = FLT_MAX;
-                int axis = -1;
+        queryOverlaps(swept, [&](int id) {
+            if (id == ignoreId) return;
+            float time;
+            mathLib::Vec3 normal;
+            if (objects[id].mesh >= 0) {
+                if (!meshColliders[objects[id].mesh].sweepBox(box, displacement, time, normal)) return;
+            }
+            else if (!sweepBox(box, displacement, boxes[id], time, normal)) {
+                return;
+            }
+            // Ties go to the lower id so the result does not depend on traversal order
+            if (!result.hit || time < result.time || (time == result.time && id < result.objectId)) {
+                result.hit = true;
+                result.time = time;
+                result.normal = normal;
+                result.objectId = id;
+            }
+        }, true, includeDynamic);
+
+        if (result.hit) {
+            float left = 1.0f - result.time;
+            mathLib::Vec3 rest(displacement.x * left, displacement.y * left, displacement.z * left);
+            float into = rest.dot(result.normal);
+            result.remainingVelocity = mathLib::Vec3(rest.x - result.normal.x * into, rest.y - result.normal.y * into, rest.z - result.normal.z * into);
+        }
+        return result;
+    }
 
-                if (std::abs(penetration.x) < minPen && std::abs(velocity.x) > 0.001f) {
-                    minPen = std::abs(penetration.x);
-                    axis = 0;
+    // Moves box by displacement, sliding along whatever it hits; returns the displacement
+    // actually applied. skin keeps the box a hair away from surfaces so the next sweep starts
+    // outside them.
+    mathLib::Vec3 moveAndSlide(const AABB& box, const mathLib::Vec3& displacement, int maxIterations = 4, float skin = 0.001f, int ignoreId = -1) {
+        AABB current = box;
+        mathLib::Vec3 total(0, 0, 0);
+        mathLib::Vec3 move = displacement;
+        for (int i = 0; i < maxIterations; i++) {
+            if (move.dot(move) < 1e-12f) break;
+            SweepHit hit = sweep(current, move, ignoreId);
+            float travel = 1.0f;
+            if (hit.hit) {
+                float length = sqrtf(move.dot(move));
+                travel = (std::max)(0.0f, hit.time - skin / length);
+            }
+            mathLib::Vec3 step(move.x * travel, move.y * travel, move.z * travel);
+            total = total + step;
+            current.minPoint = current.minPoint + step;
+            current.maxPoint = current.maxPoint + step;
+            if (!hit.hit) break;
+            move = hit.remainingVelocity;
+        }
+        return total;
+    }
+
+    // Nearest hit along each ray. Rays go through the trees four at a time with SSE slab tests;
+    // with a job system, groups of packets run in parallel. Results do not depend on threading.
+    void raycast(const Ray* rays, RayHit* hits, int count, JobSystem* jobs = nullptr, bool includeDynamic = true) {
+        updateBroadphase();
+        int packets = (count + 3) / 4;
+        auto run = [&](int begin, int end) {
+            RayPacket packet;
+            for (int p = begin; p < end; p++) {
+                int first = p * 4;
+                int n = (std::min)(4, count - first);
+                packet.set(rays + first, n);
+                if (meshColliders.empty()) {
+                    staticTree.raycast(packet, boxes);
                 }
-                if (std::abs(penetration.y) < minPen && std::abs(velocity.y) > 0.001f) {
-                    minPen = std::abs(penetration.y);
-                    axis = 1;
+                else {
+                    staticTree.raycast(packet, boxes, [&](int id, int lane, float entry) {
+                        if (objects[id].mesh < 0) return entry;
+                        Ray ray = rays[first + lane];
+                        ray.maxDistance = packet.best[lane];
+                        float t;
+                        mathLib::Vec3 normal;
+                        return meshColliders[objects[id].mesh].raycast(ray, t, normal) ? t : -1.0f;
+                    });
                 }
-                if (std::abs(penetration.z) < minPen && std::abs(velocity.z) > 0.001f) {
-                    minPen = std::abs(penetration.z);
-                    axis = 2;
+                if (includeDynamic && dynamicMode == DYNAMIC_BVH) dynamicTree.raycast(packet, boxes);
+                for (int lane = 0; lane < n; lane++) {
+                    const Ray& ray = rays[first + lane];
+                    float best = packet.best[lane];
+                    int id = packet.ids[lane];
+                    if (includeDynamic && dynamicMode == DYNAMIC_HASH_GRID) {
+                        gridRaycast(ray, best, id);
+                    }
+                    finishHit(ray, best, id, hits[first + lane]);
                 }
+            }
+        };
+        if (!jobs || jobs->workerCount() == 0) run(0, packets);
+        else jobs->parallelFor(packets, 16, run);
+    }
 
-                // Apply response on the minimum penetration axis
-                if (axis == 0) responseVelocity.x = 0;
-                if (axis == 1) responseVelocity.y = 0;
-                if (axis == 2) responseVelocity.z = 0;
+    RayHit raycast(const Ray& ray, bool includeDynamic = true) {
+        RayHit hit;
+        raycast(&ray, &hit, 1, nullptr, includeDynamic);
+        return hit;
+    }
+
+    // Calls fn(objectId, normal, depth) for every box or mesh triangle closer than radius to
+    // segment pq. normal points from the object towards the capsule; depth is how far the capsule
+    // has to move along it to just touch.
+    template<typename Fn>
+    void capsuleContacts(const mathLib::Vec3& p, const mathLib::Vec3& q, float radius, Fn fn, bool includeDynamic = false, int ignoreId = -1) {
+        AABB box;
+        box.expand(p);
+        box.expand(q);
+        box.minPoint = box.minPoint - mathLib::Vec3(radius, radius, radius);
+        box.maxPoint = box.maxPoint + mathLib::Vec3(radius, radius, radius);
+        float radiusSq = radius * radius;
+        mathLib::Vec3 middle((p.x + q.x) * 0.5f, (p.y + q.y) * 0.5f, (p.z + q.z) * 0.5f);
+
+        queryOverlaps(box, [&](int id) {
+            if (id == ignoreId) return;
+            mathLib::Vec3 onSegment, onShape;
+            if (objects[id].mesh < 0) {
+                const AABB& target = boxes[id];
+                float distSq = collisionMath::closestSegmentShape(p, q, [&](const mathLib::Vec3& x) {
+                    return mathLib::Max(target.minPoint, mathLib::Min(target.maxPoint, x));
+                }, onSegment, onShape);
+                if (distSq >= radiusSq) return;
+                if (distSq > 1e-12f) {
+                    float dist = sqrtf(distSq);
+                    mathLib::Vec3 e = collisionMath::sub(onSegment, onShape);
+                    fn(id, mathLib::Vec3(e.x / dist, e.y / dist, e.z / dist), radius - dist);
+                    return;
+                }
+                // Segment inside the box: leave through the nearest face
+                float depth = FLT_MAX;
+                mathLib::Vec3 normal;
+                for (int a = 0; a < 3; a++) {
+                    float below = onSegment.v[a] - target.minPoint.v[a];
+                    float above = target.maxPoint.v[a] - onSegment.v[a];
+                    if (below < depth) { depth = below; normal = mathLib::Vec3(0, 0, 0); normal.v[a] = -1.0f; }
+                    if (above < depth) { depth = above; normal = mathLib::Vec3(0, 0, 0); normal.v[a] = 1.0f; }
+                }
+                fn(id, normal, depth + radius);
+                return;
             }
-        }
 
-        return responseVelocity;
+            const MeshCollider& mesh = meshColliders[objects[id].mesh];
+            mesh.shape->queryTriangles(box.transform(mesh.inverse), [&](int tri) {
+                mathLib::Vec3 a, b, c;
+                mesh.worldTriangle(tri, a, b, c);
+                if (collisionMath::segmentTriangleDistanceSq(p, q, a, b, c) >= radiusSq) return;
+                float distSq = collisionMath::closestSegmentShape(p, q, [&](const mathLib::Vec3& x) {
+                    return collisionMath::closestPointTriangle(x, a, b, c);
+                }, onSegment, onShape);
+                if (distSq > 1e-12f) {
+                    float dist = sqrtf(distSq);
+                    mathLib::Vec3 e = collisionMath::sub(onSegment, onShape);
+                    fn(id, mathLib::Vec3(e.x / dist, e.y / dist, e.z / dist), radius - dist);
+                    return;
+                }
+                // Segment crosses the triangle: push back to the side the capsule's middle is on
+                mathLib::Vec3 normal = collisionMath::crossProduct(collisionMath::sub(b, a), collisionMath::sub(c, a));
+                float length = sqrtf(normal.dot(normal));
+                if (length < 1e-12f) return;
+                normal = mathLib::Vec3(normal.x / length, normal.y / length, normal.z / length);
+                float side = collisionMath::sub(middle, a).dot(normal);
+                if (side < 0.0f || (side == 0.0f && normal.y < 0.0f)) normal = -normal;
+                float behind = (std::max)(-collisionMath::sub(p, a).dot(normal), -collisionMath::sub(q, a).dot(normal));
+                fn(id, normal, radius + (std::max)(0.0f, behind));
+            });
+        }, true, includeDynamic);
     }
 
     // Get all collision objects (for debug rendering)
@@ -145,6 +1864,284 @@ public:
     }
 
 private:
+    std::vector<int> dynamicIds;
+    std::vector<std::vector<std::pair<int, int>>> chunkPairs;
+
+    void collectPairs(std::vector<std::pair<int, int>>& pairs, JobSystem* jobs) {
+        if (dynamicMode == DYNAMIC_HASH_GRID) {
+            grid.findPairs(boxes, pairs, jobs);
+        }
+        else {
+            for (size_t i = 0; i < objects.size(); i++) {
+                if (objects[i].isStatic || objects[i].removed) continue;
+                int a = (int)i;
+                dynamicTree.query(boxes[a], boxes, [&](int b) {
+                    if (b > a) pairs.push_back(std::make_pair(a, b));
+                });
+            }
+        }
+
+        // Dynamic/static pairs not already found in the grid
+        const BVH& statics = dynamicMode == DYNAMIC_HASH_GRID ? largeStaticTree : staticTree;
+        if (statics.empty()) return;
+        dynamicIds.clear();
+        for (size_t i = 0; i < objects.size(); i++) {
+            if (!objects[i].isStatic && !objects[i].removed) dynamicIds.push_back((int)i);
+        }
+        int count = (int)dynamicIds.size();
+        auto staticPairs = [&](int begin, int end, std::vector<std::pair<int, int>>& out) {
+            for (int k = begin; k < end; k++) {
+                int a = dynamicIds[k];
+                statics.query(boxes[a], boxes, [&](int b) { out.push_back(std::make_pair(a, b)); });
+            }
+        };
+        if (!jobs || jobs->workerCount() == 0) {
+            staticPairs(0, count, pairs);
+            return;
+        }
+        int chunks = (jobs->workerCount() + 1) * 4;
+        int grain = (count + chunks - 1) / chunks;
+        if (grain < 1) grain = 1;
+        chunkPairs.resize(chunks);
+        jobs->parallelFor(count, grain, [&](int begin, int end) {
+            std::vector<std::pair<int, int>>& out = chunkPairs[begin / grain];
+            out.clear();
+            staticPairs(begin, end, out);
+        });
+        for (int c = 0; c * grain < count; c++) {
+            pairs.insert(pairs.end(), chunkPairs[c].begin(), chunkPairs[c].end());
+        }
+    }
+
+    void gridRaycast(const Ray& ray, float& best, int& bestId) const {
+        grid.raycast(ray, best, [&](const std::vector<int>& cellObjects, float nearest) {
+            RayPacket packet;
+            packet.set(&ray, 1);
+            packet.best[0] = nearest;
+            packet.ids[0] = bestId;
+            alignas(16) float entry[4];
+            for (size_t i = 0; i < cellObjects.size(); i++) {
+                int id = cellObjects[i];
+                if (objects[id].isStatic) continue;  // already found through the static tree
+                if (!(packet.slab(boxes[id], entry) & 1)) continue;
+                float t = entry[0];
+                if (t < packet.best[0] || packet.ids[0] < 0 || id < packet.ids[0]) {
+                    packet.best[0] = t;
+                    packet.ids[0] = id;
+                }
+            }
+            bestId = packet.ids[0];
+            return packet.best[0];
+        });
+    }
+
+    // Fills in the hit point and the normal of the face entered
+    void finishHit(const Ray& ray, float t, int id, RayHit& hit) const {
+        hit = RayHit();
+        if (id < 0) return;
+        hit.hit = true;
+        hit.distance = t;
+        hit.objectId = id;
+        hit.point = mathLib::Vec3(ray.origin.x + ray.direction.x * t, ray.origin.y + ray.direction.y * t, ray.origin.z + ray.direction.z * t);
+        if (objects[id].mesh >= 0) {
+            // Cast again against just this mesh for the triangle's normal
+            Ray single = ray;
+            single.maxDistance = t;
+            float again;
+            meshColliders[objects[id].mesh].raycast(single, again, hit.normal);
+            return;
+        }
+        const AABB& box = boxes[id];
+        float bestEntry = -FLT_MAX;
+        int axis = -1;
+        for (int a = 0; a < 3; a++) {
+            float d = ray.direction.v[a];
+            if (fabsf(d) < 1e-20f) continue;
+            float entry = ((d > 0.0f ? box.minPoint.v[a] : box.maxPoint.v[a]) - ray.origin.v[a]) / d;
+            if (entry > bestEntry) {
+                bestEntry = entry;
+                axis = a;
+            }
+        }
+        if (axis < 0 || bestEntry < 0.0f) {
+            // Started inside the box: report the face opposing the ray
+            mathLib::Vec3 direction = ray.direction;
+            hit.normal = -direction.normalize();
+            return;
+        }
+        hit.normal.v[axis] = ray.direction.v[axis] > 0.0f ? -1.0f : 1.0f;
+    }
+
+    // Incremental path: re-query one changed object and update only its pairs
+    void refreshContacts(int id) {
+        CollisionObject& obj = objects[id];
+        if (obj.removed) {
+            while (!contactsOf[id].empty()) removeContact(contactsOf[id].back());
+            return;
+        }
+
+        // New and still-touching pairs
+        queryOverlaps(boxes[id], [&](int other) {
+            if (other == id || (obj.isStatic && objects[other].isStatic)) return;
+            lastTick.pairTests++;
+            if (objects[other].mesh >= 0 && !overlapsObject(other, boxes[id])) return;
+            if (obj.mesh >= 0 && !overlapsObject(id, boxes[other])) return;
+            int a = (std::min)(id, other), b = (std::max)(id, other);
+            auto it = contactIndex.find(contactKey(a, b));
+            if (it != contactIndex.end()) return;
+            addContact(a, b);
+            // Something moving into a sleeping object wakes it
+            if (objects[other].sleeping) wake(other);
+        });
+
+        // Pairs this object no longer touches
+        std::vector<int>& mine = contactsOf[id];
+        for (int i = (int)mine.size() - 1; i >= 0; i--) {
+            const ContactPair& pair = contacts[mine[i]];
+            int other = pair.a == id ? pair.b : pair.a;
+            if (!boxes[id].intersects(boxes[other]) || objects[other].removed ||
+                (objects[other].mesh >= 0 && !overlapsObject(other, boxes[id]))) {
+                removeContact(mine[i]);
+            }
+        }
+    }
+
+    // Bulk path: rebuild the pair list from findPairs, keeping firstTick for pairs that persist
+    void rebuildContacts() {
+        std::vector<std::pair<int, int>> pairs;
+        findPairs(pairs);
+        lastTick.pairTests = (int)pairs.size();
+        std::vector<ContactPair> next;
+        next.reserve(pairs.size());
+        std::unordered_map<uint64_t, int> nextIndex;
+        nextIndex.reserve(pairs.size());
+        int kept = 0;
+        for (size_t i = 0; i < pairs.size(); i++) {
+            ContactPair pair;
+            pair.a = (std::min)(pairs[i].first, pairs[i].second);
+            pair.b = (std::max)(pairs[i].first, pairs[i].second);
+            pair.firstTick = tickCount;
+            uint64_t key = contactKey(pair.a, pair.b);
+            auto it = contactIndex.find(key);
+            if (it != contactIndex.end()) {
+                pair.firstTick = contacts[it->second].firstTick;
+                kept++;
+            }
+            else {
+                if (objects[pair.a].sleeping) wake(pair.a);
+                if (objects[pair.b].sleeping) wake(pair.b);
+            }
+            nextIndex[key] = (int)next.size();
+            next.push_back(pair);
+        }
+        lastTick.pairsAdded = (int)next.size() - kept;
+        lastTick.pairsRemoved = (int)contacts.size() - kept;
+        contacts.swap(next);
+        contactIndex.swap(nextIndex);
+        for (size_t i = 0; i < contactsOf.size(); i++) contactsOf[i].clear();
+        for (int i = 0; i < (int)contacts.size(); i++) {
+            contactsOf[contacts[i].a].push_back(i);
+            contactsOf[contacts[i].b].push_back(i);
+        }
+    }
+
+    static uint64_t contactKey(int a, int b) {
+        return ((uint64_t)(uint32_t)a << 32) | (uint32_t)b;
+    }
+
+    void markMoved(int id) {
+        if (objects[id].pendingMove) return;
+        objects[id].pendingMove = true;
+        pendingMoves.push_back(id);
+    }
+
+    void setAwake(int id, bool awake) {
+        if (awake == (awakeIndex[id] >= 0)) return;
+        if (awake) {
+            awakeIndex[id] = (int)awakeIds.size();
+            awakeIds.push_back(id);
+            return;
+        }
+        int last = awakeIds.back();
+        awakeIds[awakeIndex[id]] = last;
+        awakeIndex[last] = awakeIndex[id];
+        awakeIds.pop_back();
+        awakeIndex[id] = -1;
+    }
+
+    void addContact(int a, int b) {
+        int index = (int)contacts.size();
+        ContactPair pair;
+        pair.a = a;
+        pair.b = b;
+        pair.firstTick = tickCount;
+        contacts.push_back(pair);
+        contactIndex[contactKey(a, b)] = index;
+        contactsOf[a].push_back(index);
+        contactsOf[b].push_back(index);
+        lastTick.pairsAdded++;
+    }
+
+    static void replaceIndex(std::vector<int>& list, int from, int to) {
+        for (size_t i = 0; i < list.size(); i++) {
+            if (list[i] == from) {
+                if (to < 0) {
+                    list[i] = list.back();
+                    list.pop_back();
+                }
+                else {
+                    list[i] = to;
+                }
+                return;
+            }
+        }
+    }
+
+    // Swap-remove, patching the moved pair's entries in both objects' lists
+    void removeContact(int index) {
+        ContactPair pair = contacts[index];
+        contactIndex.erase(contactKey(pair.a, pair.b));
+        replaceIndex(contactsOf[pair.a], index, -1);
+        replaceIndex(contactsOf[pair.b], index, -1);
+        int last = (int)contacts.size() - 1;
+        if (index != last) {
+            const ContactPair& moved = contacts[last];
+            contacts[index] = moved;
+            contactIndex[contactKey(moved.a, moved.b)] = index;
+            replaceIndex(contactsOf[moved.a], last, index);
+            replaceIndex(contactsOf[moved.b], last, index);
+        }
+        contacts.pop_back();
+        lastTick.pairsRemoved++;
+    }
+
+    void syncGridStatics() {
+        for (size_t i = 0; i < gridStatics.size(); i++) {
+            grid.remove(gridStatics[i]);
+        }
+        gridStatics.clear();
+        std::vector<int> large;
+        for (size_t i = 0; i < objects.size(); i++) {
+            if (!objects[i].isStatic || objects[i].removed) continue;
+            if (grid.cellSpan(boxes[i]) > MAX_STATIC_GRID_CELLS) {
+                large.push_back((int)i);
+            }
+            else {
+                grid.insert((int)i, boxes[i], true);
+                gridStatics.push_back((int)i);
+            }
+        }
+        largeStaticTree.build(boxes, large);
+    }
+
+    void buildTree(BVH& tree, bool isStatic) {
+        std::vector<int> ids;
+        for (size_t i = 0; i < objects.size(); i++) {
+            if (objects[i].isStatic == isStatic && !objects[i].removed) ids.push_back((int)i);
+        }
+        tree.build(boxes, ids);
+    }
+
     mathLib::Vec3 calculatePenetration(const AABB& box1, const AABB& box2) {
         mathLib::Vec3 penetration;
 
@@ -155,4 +2152,223 @@ private:
 
         return penetration;
     }
-};
\ No newline at end of file
+};
+
+// Kinematic capsule character controller
+// The capsule stands on position (its feet) and is moved with collide-and-slide: motion is split
+// into substeps shorter than the radius so thin objects cannot be skipped, and after each
+// substep the capsule is pushed out of whatever it touches. Walkable surfaces push it up (so it
+// follows ramps and terrain), steeper ones push it sideways (so it slides along walls). Small
+// ledges are climbed with a step-up pass, and a short ground probe keeps it on the ground when
+// walking down slopes.
+class CharacterController {
+public:
+    mathLib::Vec3 position;         // bottom of the capsule
+    float radius = 0.5f;
+    float height = 2.0f;            // total, including both caps
+    float stepOffset = 0.35f;       // highest ledge climbed without jumping
+    float maxSlope = 45.0f;         // steepest walkable slope, degrees
+    float groundProbe = 0.3f;       // how far down to look for ground when walking off a slope
+    float skin = 0.01f;             // gap kept from surfaces
+    float gravity = 20.0f;
+    int maxIterations = 4;          // push-out passes per substep
+    bool collideWithDynamic = false;
+    int ignoreId = -1;              // the controller's own object in the world, if it has one
+
+    float verticalSpeed = 0.0f;
+    bool grounded = false;
+    mathLib::Vec3 groundNormal;
+    int groundObject = -1;
+
+    CharacterController(const mathLib::Vec3& startPos = mathLib::Vec3(0, 0, 0), float capsuleRadius = 0.5f, float capsuleHeight = 2.0f)
+        : position(startPos), radius(capsuleRadius), height(capsuleHeight), groundNormal(0, 1, 0) {
+    }
+
+    void jump(float speed) {
+        if (!grounded) return;
+        verticalSpeed = speed;
+        grounded = false;
+    }
+
+    AABB bounds() const {
+        return AABB(mathLib::Vec3(position.x - radius, position.y, position.z - radius),
+            mathLib::Vec3(position.x + radius, position.y + height, position.z + radius));
+    }
+
+    // Walks by the horizontal part of walk this frame and applies gravity over dt
+    void move(CollisionWorld& world, const mathLib::Vec3& walk, float dt) {
+        bool wasGrounded = grounded;
+        if (wasGrounded && verticalSpeed < 0.0f) verticalSpeed = 0.0f;
+        if (!wasGrounded || verticalSpeed > 0.0f) verticalSpeed -= gravity * dt;
+
+        // Horizontal, with a step-up attempt if something blocked us
+        mathLib::Vec3 start = position;
+        mathLib::Vec3 horizontal(walk.x, 0.0f, walk.z);
+        MoveResult result = moveBy(world, position, horizontal);
+        if (result.blocked && wasGrounded && stepOffset > 0.0f) {
+            stepUp(world, start, horizontal);
+        }
+
+        // Vertical
+        grounded = false;
+        groundObject = -1;
+        float dy = verticalSpeed * dt;
+        if (dy != 0.0f) {
+            result = moveBy(world, position, mathLib::Vec3(0.0f, dy, 0.0f));
+            if (result.ground && dy < 0.0f) land(result);
+            if (result.ceiling && dy > 0.0f) verticalSpeed = 0.0f;
+        }
+
+        // Stick to the ground when walking down slopes or over small dips
+        if (!grounded && wasGrounded && verticalSpeed <= 0.0f) {
+            mathLib::Vec3 probe = position;
+            result = moveBy(world, probe, mathLib::Vec3(0.0f, -groundProbe, 0.0f), true);
+            if (result.ground) {
+                position = probe;
+                land(result);
+            }
+        }
+    }
+
+private:
+    struct MoveResult {
+        bool blocked = false;   // hit something too steep to walk on
+        bool ground = false;    // rested on something walkable
+        bool ceiling = false;
+        mathLib::Vec3 groundNormal;
+        mathLib::Vec3 groundPoint;
+        int groundObject = -1;
+    };
+
+    void land(const MoveResult& result) {
+        grounded = true;
+        verticalSpeed = 0.0f;
+        groundNormal = result.groundNormal;
+        groundObject = result.groundObject;
+    }
+
+    float walkableY() const {
+        return cosf(maxSlope * (float)M_PI / 180.0f);
+    }
+
+    void segment(const mathLib::Vec3& feet, mathLib::Vec3& p, mathLib::Vec3& q) const {
+        p = mathLib::Vec3(feet.x, feet.y + radius, feet.z);
+        q = mathLib::Vec3(feet.x, feet.y + (std::max)(height - radius, radius), feet.z);
+    }
+
+    // With anySupport, every upward-facing contact counts as ground. Settling onto a ledge
+    // (step-up, ground probe) lands on its edge, whose normal is tilted even when the top is flat.
+    MoveResult moveBy(CollisionWorld& world, mathLib::Vec3& feet, mathLib::Vec3 displacement, bool anySupport = false) {
+        MoveResult result;
+        float minWalkableY = anySupport ? 0.05f : walkableY();
+        float length = sqrtf(displacement.dot(displacement));
+        int steps = (int)ceilf(length / (0.9f * radius));
+        if (steps < 1) steps = 1;
+        mathLib::Vec3 step(displacement.x / steps, displacement.y / steps, displacement.z / steps);
+
+        for (int s = 0; s < steps; s++) {
+            feet = feet + step;
+            for (int i = 0; i < maxIterations; i++) {
+                mathLib::Vec3 p, q;
+                segment(feet, p, q);
+                float deepest = 0.0f;
+                mathLib::Vec3 normal;
+                int hitId = -1;
+                world.capsuleContacts(p, q, radius, [&](int id, const mathLib::Vec3& n, float depth) {
+                    if (depth > deepest) {
+                        deepest = depth;
+                        normal = n;
+                        hitId = id;
+                    }
+                }, collideWithDynamic, ignoreId);
+                if (hitId < 0 || deepest <= skin * 0.5f) break;
+
+                float push = deepest + skin;
+                if (normal.y >= minWalkableY) {
+                    // Walkable: straight up, so slopes do not slide the capsule sideways. Ground
+                    // touches the bottom cap, whose centre is p.
+                    float dist = radius - deepest;
+                    result.groundPoint = mathLib::Vec3(p.x - normal.x * dist, p.y - normal.y * dist, p.z - normal.z * dist);
+                    feet.y += push / normal.y;
+                    result.ground = true;
+                    result.groundNormal = normal;
+                    result.groundObject = hitId;
+                    if (step.y < 0.0f) step.y = 0.0f;
+                }
+                else if (normal.y <= -0.5f) {
+                    feet = feet + normal * push;
+                    result.ceiling = true;
+                    if (step.y > 0.0f) step.y = 0.0f;
+                }
+                else {
+                    // Wall or steep slope: push out sideways and stop moving into it
+                    float sideLength = sqrtf(normal.x * normal.x + normal.z * normal.z);
+                    if (sideLength < 1e-6f) break;
+                    mathLib::Vec3 side(normal.x / sideLength, 0.0f, normal.z / sideLength);
+                    feet = feet + side * (push / sideLength);
+                    float into = step.dot(side);
+                    if (into < 0.0f) step = step - side * into;
+                    result.blocked = true;
+                }
+            }
+        }
+        return result;
+    }
+
+    // Lift by stepOffset, walk, then settle back down; kept only if it gets further than the
+    // plain move did and ends on walkable ground
+    void stepUp(CollisionWorld& world, const mathLib::Vec3& start, const mathLib::Vec3& horizontal) {
+        mathLib::Vec3 feet = start;
+        MoveResult up = moveBy(world, feet, mathLib::Vec3(0.0f, stepOffset, 0.0f));
+        float lifted = feet.y - start.y;
+        if (up.ceiling || lifted <= skin) return;
+        moveBy(world, feet, horizontal);
+        MoveResult down = moveBy(world, feet, mathLib::Vec3(0.0f, -(lifted + skin * 2.0f), 0.0f), true);
+        if (!down.ground) return;
+        if (down.groundNormal.y < walkableY()) {
+            // Resting on an edge or a steep face: look straight down just past the contact point,
+            // which finds the top of a ledge but not a slope that is too steep
+            float length = sqrtf(horizontal.dot(horizontal));
+            if (length < 1e-6f) return;
+            float inward = 0.02f / length;
+            const mathLib::Vec3& contact = down.groundPoint;
+            Ray probe(mathLib::Vec3(contact.x + horizontal.x * inward, contact.y + 0.05f, contact.z + horizontal.z * inward), mathLib::Vec3(0.0f, -1.0f, 0.0f), 0.1f);
+            RayHit top = world.raycast(probe, false);
+            if (!top.hit || top.normal.y < walkableY()) return;
+        }
+
+        float dxStep = feet.x - start.x, dzStep = feet.z - start.z;
+        float dxPlain = position.x - start.x, dzPlain = position.z - start.z;
+        if (dxStep * dxStep + dzStep * dzStep > dxPlain * dxPlain + dzPlain * dzPlain + skin * skin) {
+            position = feet;
+        }
+    }
+};
+
+// One controller's move in a batch; objectId is the controller's own box in the world, or -1
+struct CharacterMove {
+    CharacterController* controller = nullptr;
+    mathLib::Vec3 walk;
+    int objectId = -1;
+};
+
+// Resolves many controllers against one snapshot of the world. Every controller sees the others'
+// boxes where they were before the batch, so moves are independent and run on the job system;
+// the boxes are then written back in array order. Two actors walking into each other in the same
+// frame can end up overlapping slightly, which their next moves push apart.
+inline void moveCharacters(CollisionWorld& world, CharacterMove* moves, int count, float dt, JobSystem* jobs = nullptr) {
+    world.updateBroadphase();
+    auto run = [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            CharacterController& controller = *moves[i].controller;
+            if (moves[i].objectId >= 0) controller.ignoreId = moves[i].objectId;
+            controller.move(world, moves[i].walk, dt);
+        }
+    };
+    if (!jobs || jobs->workerCount() == 0) run(0, count);
+    else jobs->parallelFor(count, 32, run);
+
+    for (int i = 0; i < count; i++) {
+        if (moves[i].objectId >= 0) world.updateObject(moves[i].objectId, moves[i].controller->bounds());
+    }
+}
\ No newline at end of file
@@ -0,0 +1,217 @@
+// Fuzz harness for the model loaders. Each input is treated as a .gem file and run through
+// GEMModelLoader::validate, the stream and mapped loads and visits and the pack cooker, and the
+// answers are checked against each other (validate accepts a file exactly when the loaders do, and
+// nothing they hand out points past a mesh). The same bytes are then opened as a cooked pack,
+// which exercises GEMPack::attach directly. A disagreement aborts; memory errors are left to the
+// sanitizers.
+//
+// From this directory's parent, with clang and libFuzzer:
+//
+//   clang++ -std=c++14 -g -O1 -fsanitize=fuzzer,address,undefined
+//     -DGEM_FUZZ_LIBFUZZER fuzz/gemFuzz.cpp -o gemFuzz
+//   ./gemFuzz corpus/ Models/ fuzz/seeds/
+//
+// Without libFuzzer the file has its own main(), which runs the files named on the command line (or
+// stdin) once each; that is what AFL and a plain g++ sanitizer build use:
+//
+//   g++ -std=c++14 -g -O1 -fsanitize=address,undefined fuzz/gemFuzz.cpp -o gemFuzz
+//   afl-fuzz -i Models -o findings -- ./gemFuzz @@     (built with afl-g++ or afl-clang-fast++)
+//
+// Arrays in a .gem sit at whatever offset the data before them leaves, so mapped spans may be
+// misaligned. The loaders and this harness only copy them as bytes, so the alignment sanitizer
+// stays on for every path, the pack included. Seed with the files in Models/ and, to reach deeper
+// into attach, the .gem.pack files the game cooks beside them.
+// fuzz/seeds/ holds small files that once got through: zeroBoneClip.gem is an animated model with
+// no bones and one clip of 0x7fffffff frames, which validate() passed and the loaders then tried to
+// allocate.
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+#include "../GEMPack.h"
+
+using namespace GEMLoader;
+
+namespace {
+	void check(bool condition, const char* what) {
+		if (condition) return;
+		fprintf(stderr, "gemFuzz: %s\n", what);
+		abort();
+	}
+
+	// Indices may be misaligned in a mapping, so they are copied out rather than dereferenced
+	void checkIndices(const GEMSpan<unsigned int>& indices, size_t vertexCount) {
+		for (size_t i = 0; i < indices.size(); i++) {
+			check(indices.read(i) < vertexCount, "index past its mesh");
+		}
+	}
+
+	// Touches every byte handed out, so the sanitizers see any view that runs past its data
+	struct TouchVisitor : GEMVisitor {
+		unsigned int sum = 0;
+		void touch(const void* data, size_t bytes) {
+			const unsigned char* p = static_cast<const unsigned char*>(data);
+			for (size_t i = 0; i < bytes; i++) sum += p[i];
+		}
+		void mesh(unsigned int, const GEMMaterial&, const GEMMeshView& view) {
+			touch(view.staticVertices.data(), view.staticVertices.size() * sizeof(GEMStaticVertex));
+			touch(view.animatedVertices.data(), view.animatedVertices.size() * sizeof(GEMAnimatedVertex));
+			checkIndices(view.indices, view.staticVertices.size() + view.animatedVertices.size());
+		}
+		void skeleton(const std::vector<GEMBone>& bones, const GEMMatrix&) {
+			for (size_t i = 0; i < bones.size(); i++) {
+				check(bones[i].parentIndex >= -1 && bones[i].parentIndex < (int)bones.size(), "bone parent past the skeleton");
+			}
+		}
+		void clip(unsigned int, const GEMClipView& clip) {
+			for (int f = 0; f < clip.frameCount; f++) {
+				touch(clip.positions(f).data(), clip.boneCount * sizeof(GEMVec3));
+				touch(clip.rotations(f).data(), clip.boneCount * sizeof(GEMQuaternion));
+				touch(clip.scales(f).data(), clip.boneCount * sizeof(GEMVec3));
+			}
+		}
+	};
+
+	// The loaders take file names, so the input goes through files of this process's own
+	std::string scratchName(const char* extension) {
+		return "gemFuzz-" + std::to_string(getpid()) + extension;
+	}
+
+	bool writeFile(const std::string& name, const void* data, size_t size) {
+		std::ofstream file(name, std::ios::binary | std::ios::trunc);
+		file.write(static_cast<const char*>(data), size);
+		return (bool)file;
+	}
+
+	void walkPack(const GEMPack& pack) {
+		const GEMPackHeader& info = pack.info();
+		size_t stride = info.isAnimated ? sizeof(GEMAnimatedVertex) : sizeof(GEMStaticVertex);
+		unsigned int sum = 0;
+		for (int i = 0; i < (int)info.meshCount; i++) {
+			const GEMPackMesh& mesh = pack.mesh(i);
+			const unsigned char* vertices = static_cast<const unsigned char*>(pack.vertices(i));
+			for (size_t b = 0; b < mesh.vertexCount * stride; b++) sum += vertices[b];
+			const unsigned int* indices = pack.indices(i);
+			for (unsigned int k = 0; k < mesh.indexCount; k++) check(indices[k] < mesh.vertexCount, "pack index past its mesh");
+			sum += (unsigned int)strlen(pack.string(mesh.diffuse)) + (unsigned int)strlen(pack.string(mesh.normals));
+		}
+		for (int i = 0; i < (int)info.boneCount; i++) {
+			const GEMPackBone& bone = pack.bone(i);
+			check(bone.parentIndex >= -1 && bone.parentIndex < (int)info.boneCount, "pack bone parent past the skeleton");
+			sum += (unsigned int)strlen(pack.string(bone.name));
+		}
+		for (int i = 0; i < (int)info.clipCount; i++) {
+			const GEMPackClip& clip = pack.clip(i);
+			const float* data = pack.clipData(i);
+			for (long long k = 0; k < (long long)clip.frameCount * info.boneCount * 10; k++) sum += data[k] != 0.0f;
+		}
+		(void)sum;
+	}
+
+	void runOne(const uint8_t* data, size_t size) {
+		static bool quiet = false;
+		if (!quiet) {
+			// The loaders report every rejected file on std::cout
+			std::cout.setstate(std::ios::failbit);
+			quiet = true;
+		}
+		const char* bytes = reinterpret_cast<const char*>(data);
+		GEMError validated = GEMModelLoader::validate(bytes, size);
+		// An empty file cannot be mapped, so the mapped paths see it as unreadable
+		GEMError mappedExpected = size == 0 ? GEM_CANNOT_OPEN : validated;
+
+		std::string gem = scratchName(".gem");
+		if (!writeFile(gem, data, size)) return;
+		GEMModelLoader loader;
+		{
+			std::vector<GEMMesh> meshes;
+			GEMAnimation animation;
+			GEMError error = loader.load(gem, meshes, animation);
+			check((error == GEM_OK) == (validated == GEM_OK), "stream load and validate disagree");
+		}
+		{
+			std::vector<GEMMesh> meshes;
+			GEMError error = loader.load(gem, meshes);
+			check(validated != GEM_OK || error == GEM_OK, "static stream load rejects a valid file");
+		}
+		{
+			GEMMappedFile mapping;
+			std::vector<GEMMesh> meshes;
+			GEMAnimation animation;
+			GEMError error = loader.load(gem, mapping, meshes, animation);
+			check(error == mappedExpected, "mapped load and validate disagree");
+			for (size_t i = 0; i < meshes.size(); i++) {
+				checkIndices(meshes[i].indexSpan(), meshes[i].staticVertices().size() + meshes[i].animatedVertices().size());
+			}
+		}
+		{
+			TouchVisitor visitor;
+			GEMError error = loader.visit(gem, visitor);
+			check((error == GEM_OK) == (validated == GEM_OK), "stream visit and validate disagree");
+		}
+		{
+			TouchVisitor visitor;
+			GEMMappedFile mapping;
+			check(loader.visit(gem, mapping, visitor) == mappedExpected, "mapped visit and validate disagree");
+		}
+
+		std::string packName = scratchName(".pack");
+		std::vector<char> cooked;
+		bool cookedOk = GEMPackCooker::cook(gem, cooked);
+		check(cookedOk == (validated == GEM_OK), "cooker and validate disagree");
+		if (cookedOk && writeFile(packName, cooked.data(), cooked.size())) {
+			GEMPack pack;
+			check(pack.open(packName), "a freshly cooked pack does not open");
+			walkPack(pack);
+		}
+
+		// The raw bytes as a pack: attach must reject anything the accessors cannot walk safely
+		if (writeFile(packName, data, size)) {
+			GEMPack pack;
+			if (pack.open(packName)) walkPack(pack);
+		}
+	}
+
+	void removeScratch() {
+		remove(scratchName(".gem").c_str());
+		remove(scratchName(".pack").c_str());
+	}
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+	runOne(data, size);
+	return 0;
+}
+
+#ifndef GEM_FUZZ_LIBFUZZER
+int main(int argc, char** argv) {
+	std::vector<char> input;
+	if (argc < 2) {
+		input.assign(std::istreambuf_iterator<char>(std::cin), std::istreambuf_iterator<char>());
+		LLVMFuzzerTestOneInput(reinterpret_cast<const uint8_t*>(input.data()), input.size());
+	}
+	for (int i = 1; i < argc; i++) {
+		std::ifstream file(argv[i], std::ios::binary);
+		if (!file) {
+			fprintf(stderr, "gemFuzz: cannot read %s\n", argv[i]);
+			continue;
+		}
+		input.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+		LLVMFuzzerTestOneInput(reinterpret_cast<const uint8_t*>(input.data()), input.size());
+	}
+	removeScratch();
+	printf("gemFuzz: %d input%s ok\n", argc < 2 ? 1 : argc - 1, argc == 2 ? "" : "s");
+	return 0;
+}
+#endif
@@ -0,0 +1,152 @@
+﻿#pragma once
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <memory>
+
+// Small worker pool shared by the animation and collision systems.
+// parallelFor splits an index range into chunks; the calling thread takes chunks too,
+// so a pool with zero workers simply runs everything inline. Jobs must not call wait()
+// themselves.
+class JobSystem
+{
+public:
+	// threadCount = 0 picks hardware_concurrency - 1 workers (the caller is the last thread)
+	explicit JobSystem(unsigned int threadCount = 0) {
+		if (threadCount == 0) {
+			unsigned int hw = std::thread::hardware_concurrency();
+			threadCount = hw > 1 ? hw - 1 : 0;
+		}
+		for (unsigned int i = 0; i < threadCount; i++) {
+			workers.emplace_back([this]() { workerLoop(); });
+		}
+	}
+
+	~JobSystem() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (size_t i = 0; i < workers.size(); i++) {
+			workers[i].join();
+		}
+	}
+
+	JobSystem(const JobSystem&) = delete;
+	JobSystem& operator=(const JobSystem&) = delete;
+
+	int workerCount() const {
+		return (int)workers.size();
+	}
+
+	// Queues a job for any worker; wait() blocks until every submitted job has run
+	void submit(std::function<void()> job) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			jobs.push_back(std::move(job));
+			pending++;
+		}
+		wake.notify_one();
+	}
+
+	void wait() {
+		// Help with the queue instead of sleeping, so a pool without workers still makes progress
+		while (runOne()) {}
+		std::unique_lock<std::mutex> lock(mutex);
+		done.wait(lock, [this]() { return pending == 0; });
+	}
+
+	// Calls fn(begin, end) over [0, count) in chunks of at most grain indices and returns once all are done.
+	// It waits only for its own chunks, not for other jobs in the queue (the asset loader's, say):
+	// the caller runs whatever chunks the workers have not taken, and helpers still queued when the
+	// last chunk finishes find nothing left and return.
+	template<typename Fn>
+	void parallelFor(int count, int grain, Fn fn) {
+		if (count <= 0) return;
+		if (grain < 1) grain = 1;
+		int chunks = (count + grain - 1) / grain;
+		if (chunks == 1 || workers.empty()) {
+			fn(0, count);
+			return;
+		}
+
+		// Shared with the helpers, which may run after this call has returned; fn is only touched
+		// for a chunk that was claimed, and every claimed chunk finishes before the return
+		struct Range {
+			std::atomic<int> next;
+			int remaining;
+			std::mutex mutex;
+			std::condition_variable done;
+		};
+		std::shared_ptr<Range> range = std::make_shared<Range>();
+		range->next = 0;
+		range->remaining = chunks;
+		Fn* body = &fn;
+		auto runChunks = [range, body, chunks, grain, count]() {
+			int chunk;
+			while ((chunk = range->next.fetch_add(1)) < chunks) {
+				int begin = chunk * grain;
+				int end = begin + grain < count ? begin + grain : count;
+				(*body)(begin, end);
+				std::lock_guard<std::mutex> lock(range->mutex);
+				if (--range->remaining == 0) range->done.notify_all();
+			}
+		};
+		int helpers = chunks - 1 < (int)workers.size() ? chunks - 1 : (int)workers.size();
+		for (int i = 0; i < helpers; i++) {
+			submit(runChunks);
+		}
+		runChunks();
+		std::unique_lock<std::mutex> lock(range->mutex);
+		range->done.wait(lock, [&range]() { return range->remaining == 0; });
+	}
+
+private:
+	std::vector<std::thread> workers;
+	std::deque<std::function<void()>> jobs;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable done;
+	int pending = 0;
+	bool stopping = false;
+
+	bool runOne() {
+		std::function<void()> job;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (jobs.empty()) return false;
+			job = std::move(jobs.front());
+			jobs.pop_front();
+		}
+		job();
+		finish();
+		return true;
+	}
+
+	void finish() {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (--pending == 0) {
+			done.notify_all();
+		}
+	}
+
+	void workerLoop() {
+		while (true) {
+			std::function<void()> job;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wake.wait(lock, [this]() { return stopping || !jobs.empty(); });
+				if (stopping && jobs.empty()) return;
+				job = std::move(jobs.front());
+				jobs.pop_front();
+			}
+			job();
+			finish();
+		}
+	}
+};
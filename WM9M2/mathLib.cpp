@@ -1,4 +1,5 @@
-﻿#include "mathLib.h"
+﻿#include <cfloat>
+#include "mathLib.h"
 
 
 
@@ -26,4 +27,96 @@ namespace mathLib {
 		PerPro.m[15] = 0;
 		return PerPro;
 	}
+
+	void transformPointsSoA(const Matrix& m, const float* xs, const float* ys, const float* zs,
+		float* outX, float* outY, float* outZ, int count) {
+		int i = 0;
+#if MATHLIB_SSE
+		const __m128 m0 = _mm_set1_ps(m.m[0]), m1 = _mm_set1_ps(m.m[1]), m2 = _mm_set1_ps(m.m[2]), m3 = _mm_set1_ps(m.m[3]);
+		const __m128 m4 = _mm_set1_ps(m.m[4]), m5 = _mm_set1_ps(m.m[5]), m6 = _mm_set1_ps(m.m[6]), m7 = _mm_set1_ps(m.m[7]);
+		const __m128 m8 = _mm_set1_ps(m.m[8]), m9 = _mm_set1_ps(m.m[9]), m10 = _mm_set1_ps(m.m[10]), m11 = _mm_set1_ps(m.m[11]);
+		for (; i + 4 <= count; i += 4) {
+			__m128 x = _mm_loadu_ps(xs + i);
+			__m128 y = _mm_loadu_ps(ys + i);
+			__m128 z = _mm_loadu_ps(zs + i);
+			__m128 rx = simd::madd(z, m2, simd::madd(y, m1, _mm_mul_ps(x, m0)));
+			__m128 ry = simd::madd(z, m6, simd::madd(y, m5, _mm_mul_ps(x, m4)));
+			__m128 rz = simd::madd(z, m10, simd::madd(y, m9, _mm_mul_ps(x, m8)));
+			_mm_storeu_ps(outX + i, _mm_add_ps(rx, m3));
+			_mm_storeu_ps(outY + i, _mm_add_ps(ry, m7));
+			_mm_storeu_ps(outZ + i, _mm_add_ps(rz, m11));
+		}
+#endif
+		for (; i < count; i++) {
+			float x = xs[i], y = ys[i], z = zs[i];
+			outX[i] = (x * m.m[0] + y * m.m[1] + z * m.m[2]) + m.m[3];
+			outY[i] = (x * m.m[4] + y * m.m[5] + z * m.m[6]) + m.m[7];
+			outZ[i] = (x * m.m[8] + y * m.m[9] + z * m.m[10]) + m.m[11];
+		}
+	}
+
+	void boundsSoA(const float* xs, const float* ys, const float* zs, int count, Vec3& outMin, Vec3& outMax) {
+		float mn[3] = { FLT_MAX, FLT_MAX, FLT_MAX };
+		float mx[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+		int i = 0;
+#if MATHLIB_SSE
+		if (count >= 4) {
+			__m128 minX = _mm_set1_ps(FLT_MAX), minY = minX, minZ = minX;
+			__m128 maxX = _mm_set1_ps(-FLT_MAX), maxY = maxX, maxZ = maxX;
+			for (; i + 4 <= count; i += 4) {
+				__m128 x = _mm_loadu_ps(xs + i);
+				__m128 y = _mm_loadu_ps(ys + i);
+				__m128 z = _mm_loadu_ps(zs + i);
+				minX = _mm_min_ps(minX, x); maxX = _mm_max_ps(maxX, x);
+				minY = _mm_min_ps(minY, y); maxY = _mm_max_ps(maxY, y);
+				minZ = _mm_min_ps(minZ, z); maxZ = _mm_max_ps(maxZ, z);
+			}
+			// 把四个通道归约成一个值
+			float lanes[4];
+			__m128 reduce[6] = { minX, minY, minZ, maxX, maxY, maxZ };
+			for (int a = 0; a < 6; a++) {
+				_mm_storeu_ps(lanes, reduce[a]);
+				if (a < 3) mn[a] = min(min(lanes[0], lanes[1]), min(lanes[2], lanes[3]));
+				else mx[a - 3] = max(max(lanes[0], lanes[1]), max(lanes[2], lanes[3]));
+			}
+		}
+#endif
+		for (; i < count; i++) {
+			mn[0] = min(mn[0], xs[i]); mx[0] = max(mx[0], xs[i]);
+			mn[1] = min(mn[1], ys[i]); mx[1] = max(mx[1], ys[i]);
+			mn[2] = min(mn[2], zs[i]); mx[2] = max(mx[2], zs[i]);
+		}
+		outMin = Vec3(mn[0], mn[1], mn[2]);
+		outMax = Vec3(mx[0], mx[1], mx[2]);
+	}
+
+	void boundsStrided(const void* positions, int stride, int count, Vec3& outMin, Vec3& outMax) {
+		const unsigned char* p = static_cast<const unsigned char*>(positions);
+		float mn[4] = { FLT_MAX, FLT_MAX, FLT_MAX, FLT_MAX };
+		float mx[4] = { -FLT_MAX, -FLT_MAX, -FLT_MAX, -FLT_MAX };
+		int i = 0;
+#if MATHLIB_SSE
+		// 每个位置用一次 16 字节加载 (x, y, z, 下一个字段), 第四个通道最后丢弃;
+		// 只有顶点至少 16 字节时才安全, 且最后一个顶点不越界读取
+		if (stride >= 16 && count > 1) {
+			__m128 vmin = _mm_set1_ps(FLT_MAX);
+			__m128 vmax = _mm_set1_ps(-FLT_MAX);
+			for (; i < count - 1; i++) {
+				__m128 v = _mm_loadu_ps(reinterpret_cast<const float*>(p + (size_t)i * stride));
+				vmin = _mm_min_ps(vmin, v);
+				vmax = _mm_max_ps(vmax, v);
+			}
+			_mm_storeu_ps(mn, vmin);
+			_mm_storeu_ps(mx, vmax);
+		}
+#endif
+		for (; i < count; i++) {
+			const float* v = reinterpret_cast<const float*>(p + (size_t)i * stride);
+			mn[0] = min(mn[0], v[0]); mx[0] = max(mx[0], v[0]);
+			mn[1] = min(mn[1], v[1]); mx[1] = max(mx[1], v[1]);
+			mn[2] = min(mn[2], v[2]); mx[2] = max(mx[2], v[2]);
+		}
+		outMin = Vec3(mn[0], mn[1], mn[2]);
+		outMax = Vec3(mx[0], mx[1], mx[2]);
+	}
 }
\ No newline at end of file
@@ -7,7 +7,50 @@
 #include <algorithm>
 #include <iostream>
 
+// SIMD backend: SSE is used whenever the target guarantees it (x64 / SSE2 builds),
+// FMA when the compiler enables it: -mfma (or -march=...) on gcc/clang, /arch:AVX2 on MSVC,
+// which implies FMA there. Define MATHLIB_NO_SIMD to force the scalar path.
+#if !defined(MATHLIB_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define MATHLIB_SSE 1
+#include <emmintrin.h>
+#if defined(__FMA__) || (defined(_MSC_VER) && !defined(__clang__) && defined(__AVX2__))
+#define MATHLIB_FMA 1
+#include <immintrin.h>
+#endif
+#else
+#define MATHLIB_SSE 0
+#endif
+
 namespace mathLib {
+#if MATHLIB_SSE
+	namespace simd {
+		// a * b + c
+		inline __m128 madd(__m128 a, __m128 b, __m128 c) {
+#if defined(MATHLIB_FMA)
+			return _mm_fmadd_ps(a, b, c);
+#else
+			return _mm_add_ps(_mm_mul_ps(a, b), c);
+#endif
+		}
+
+		// b.x * r0 + b.y * r1 + b.z * r2 + b.w * r3, summed in the same order as the scalar code
+		inline __m128 combineRows(__m128 b, __m128 r0, __m128 r1, __m128 r2, __m128 r3) {
+			__m128 r = _mm_mul_ps(_mm_shuffle_ps(b, b, _MM_SHUFFLE(0, 0, 0, 0)), r0);
+			r = madd(_mm_shuffle_ps(b, b, _MM_SHUFFLE(1, 1, 1, 1)), r1, r);
+			r = madd(_mm_shuffle_ps(b, b, _MM_SHUFFLE(2, 2, 2, 2)), r2, r);
+			return madd(_mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 3, 3, 3)), r3, r);
+		}
+
+		// Horizontal sum of all four lanes
+		inline float hsum(__m128 v) {
+			__m128 shuf = _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1));
+			__m128 sums = _mm_add_ps(v, shuf);
+			shuf = _mm_movehl_ps(shuf, sums);
+			return _mm_cvtss_f32(_mm_add_ss(sums, shuf));
+		}
+	}
+#endif
+
 #define SQ(x) (x) * (x)
 #define max(a,b) (a>b ? a:b)
 #define min(a,b) (a<b ? a:b)
@@ -208,6 +251,24 @@ namespace mathLib {
 			w = 1;  // After division, w is typically set to 1
 		}
 
+#if MATHLIB_SSE
+		__m128 load() const { return _mm_loadu_ps(v); }
+		static Vec4 store(__m128 r) {
+			Vec4 out;
+			_mm_storeu_ps(out.v, r);
+			return out;
+		}
+
+		Vec4 operator+(const Vec4& v) const { return store(_mm_add_ps(load(), v.load())); }
+		Vec4 operator-(const Vec4& v) const { return store(_mm_sub_ps(load(), v.load())); }
+		Vec4 operator*(float scalar) const { return store(_mm_mul_ps(load(), _mm_set1_ps(scalar))); }
+		Vec4 operator/(float scalar) const { return store(_mm_div_ps(load(), _mm_set1_ps(scalar))); }
+
+		// Dot product
+		float dot(const Vec4& v) const {
+			return simd::hsum(_mm_mul_ps(load(), v.load()));
+		}
+#else
 		Vec4 operator+(const Vec4& v) const { return Vec4(x + v.x, y + v.y, z + v.z, w + v.w); }
 		Vec4 operator-(const Vec4& v) const { return Vec4(x - v.x, y - v.y, z - v.z, w - v.w); }
 		Vec4 operator*(float scalar) const { return Vec4(x * scalar, y * scalar, z * scalar, w * scalar); }
@@ -217,6 +278,7 @@ namespace mathLib {
 		float dot(const Vec4& v) const {
 			return x * v.x + y * v.y + z * v.z + w * v.w;
 		}
+#endif
 
 		// Length (magnitude)
 		float length() const {
@@ -240,7 +302,8 @@ namespace mathLib {
 		return Vec4(v.x, v.y, v.z, 1.0f);
 	}
 
-	class Matrix {
+	// 16-byte aligned so rows can be fed straight to SSE registers
+	class alignas(16) Matrix {
 	public:
 		union {
 			float a[4][4];
@@ -248,6 +311,9 @@ namespace mathLib {
 		};
 
 		Matrix() { identity(); }
+		// 不初始化的构造, 供马上会被整块覆盖的结果矩阵使用
+		struct Uninitialized {};
+		explicit Matrix(Uninitialized) {}
 		Matrix(float* otherMatrix) {
 			memcpy(&m, otherMatrix, 16 * sizeof(float));
 		}
@@ -290,8 +356,56 @@ namespace mathLib {
 		//	return (v1 * w);
 		//}
 
+#if MATHLIB_SSE
+		// 把四行转置成四列, 这样点变换就是列的线性组合
+		void loadColumns(__m128& c0, __m128& c1, __m128& c2, __m128& c3) const {
+			c0 = _mm_loadu_ps(&m[0]);
+			c1 = _mm_loadu_ps(&m[4]);
+			c2 = _mm_loadu_ps(&m[8]);
+			c3 = _mm_loadu_ps(&m[12]);
+			_MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+		}
+
+		// 不使用齐次坐标,带平移的变换
+		Vec3 mulPoint(const Vec3& v) const
+		{
+			__m128 c0, c1, c2, c3;
+			loadColumns(c0, c1, c2, c3);
+			__m128 r = _mm_mul_ps(c0, _mm_set1_ps(v.x));
+			r = simd::madd(c1, _mm_set1_ps(v.y), r);
+			r = simd::madd(c2, _mm_set1_ps(v.z), r);
+			r = _mm_add_ps(r, c3);
+			float out[4];
+			_mm_storeu_ps(out, r);
+			return Vec3(out[0], out[1], out[2]);
+		}
+
+		// 齐次坐标
+		Vec4 mulPointP(const Vec4& v) const {
+			__m128 c0, c1, c2, c3;
+			loadColumns(c0, c1, c2, c3);
+			__m128 r = _mm_mul_ps(c0, _mm_set1_ps(v.x));
+			r = simd::madd(c1, _mm_set1_ps(v.y), r);
+			r = simd::madd(c2, _mm_set1_ps(v.z), r);
+			r = simd::madd(c3, _mm_set1_ps(v.w), r);
+			return Vec4::store(r);
+		}
+
+		// 没有平移的线性变换
+		Vec3 mulVec(const Vec3& v) const
+		{
+			__m128 c0, c1, c2, c3;
+			loadColumns(c0, c1, c2, c3);
+			__m128 r = _mm_mul_ps(c0, _mm_set1_ps(v.x));
+			r = simd::madd(c1, _mm_set1_ps(v.y), r);
+			r = simd::madd(c2, _mm_set1_ps(v.z), r);
+			float out[4];
+			_mm_storeu_ps(out, r);
+			return Vec3(out[0], out[1], out[2]);
+		}
+#else
 		// 不使用齐次坐标,带平移的变换
-		Vec3 mulPoint(Vec3& v)const
+		Vec3 mulPoint(const Vec3& v) const
 		{
 			return Vec3(
 				(v.x * m[0] + v.y * m[1] + v.z * m[2]) + m[3],
@@ -300,7 +414,7 @@ namespace mathLib {
 		}
 
 		// 齐次坐标
-		Vec4 mulPointP(Vec4& v) {
+		Vec4 mulPointP(const Vec4& v) const {
 			return Vec4(
 				v.x * m[0] + v.y * m[1] + v.z * m[2] + v.w * m[3],
 				v.x * m[4] + v.y * m[5] + v.z * m[6] + v.w * m[7],
@@ -310,13 +424,14 @@ namespace mathLib {
 		}
 
 		// 没有平移的线性变换
-		Vec3 mulVec(Vec3& v)
+		Vec3 mulVec(const Vec3& v) const
 		{
 			return Vec3(
 				(v.x * m[0] + v.y * m[1] + v.z * m[2]),
 				(v.x * m[4] + v.y * m[5] + v.z * m[6]),
 				(v.x * m[8] + v.y * m[9] + v.z * m[10]));
 		}
+#endif
 
 		// 平移矩阵
 		static Matrix translation(const Vec3& t) {
@@ -380,6 +495,22 @@ namespace mathLib {
 		}
 
 		// 混合矩阵
+#if MATHLIB_SSE
+		// ret 的第 i 行 = sum_k matrix[i][k] * 本矩阵第 k 行, 与标量版本的求和顺序一致
+		Matrix mul(const Matrix& matrix) const
+		{
+			Matrix ret{ Uninitialized() };
+			__m128 r0 = _mm_loadu_ps(&m[0]);
+			__m128 r1 = _mm_loadu_ps(&m[4]);
+			__m128 r2 = _mm_loadu_ps(&m[8]);
+			__m128 r3 = _mm_loadu_ps(&m[12]);
+			_mm_storeu_ps(&ret.m[0], simd::combineRows(_mm_loadu_ps(&matrix.m[0]), r0, r1, r2, r3));
+			_mm_storeu_ps(&ret.m[4], simd::combineRows(_mm_loadu_ps(&matrix.m[4]), r0, r1, r2, r3));
+			_mm_storeu_ps(&ret.m[8], simd::combineRows(_mm_loadu_ps(&matrix.m[8]), r0, r1, r2, r3));
+			_mm_storeu_ps(&ret.m[12], simd::combineRows(_mm_loadu_ps(&matrix.m[12]), r0, r1, r2, r3));
+			return ret;
+		}
+#else
 		Matrix mul(const Matrix& matrix) const
 		{
 			Matrix ret;
@@ -401,6 +532,7 @@ namespace mathLib {
 			ret.m[15] = m[3] * matrix.m[12] + m[7] * matrix.m[13] + m[11] * matrix.m[14] + m[15] * matrix.m[15];
 			return ret;
 		}
+#endif
 
 		// 矩阵的乘积
 		Matrix operator*(const Matrix& matrix)
@@ -547,16 +679,16 @@ namespace mathLib {
 		// 从笛卡尔坐标转换为球坐标
 		static SphericalCoordinates fromCartesian(float x, float y, float z) {
 			float r = sqrtf(SQ(x) + SQ(y) + SQ(z));
-			float theta = std::acosf(z / r);
-			float phi = std::atan2f(y, x);
+			float theta = std::acos(z / r);
+			float phi = std::atan2(y, x);
 			return SphericalCoordinates(r, theta, phi);
 		}
 
 		// 从球坐标转换为笛卡尔坐标
 		void toCartesian(float& x, float& y, float& z) const {
-			x = r * std::sinf(theta) * std::cosf(phi);
-			y = r * std::sinf(theta) * std::sinf(phi);
-			z = r * std::cosf(theta);
+			x = r * std::sin(theta) * std::cos(phi);
+			y = r * std::sin(theta) * std::sin(phi);
+			z = r * std::cos(theta);
 		}
 
 		// 打印球坐标
@@ -587,7 +719,7 @@ namespace mathLib {
 
 		// Normalize the quaternion
 		void normalize() {
-			float norm = std::sqrtf(SQ(w) + SQ(x) + SQ(y) + SQ(z));
+			float norm = std::sqrt(SQ(w) + SQ(x) + SQ(y) + SQ(z));
 			w /= norm;
 			x /= norm;
 			y /= norm;
@@ -637,13 +769,13 @@ namespace mathLib {
 			}
 
 			dot = clamp(dot, -1.0f, 1.0f);
-			float theta_0 = std::acosf(dot);
+			float theta_0 = std::acos(dot);
 			float theta = theta_0 * t;
 
 			Quaternion q3 = q2 - q1 * dot;
 			q3.normalize();
 
-			return q1 * std::cosf(theta) + q3 * std::sinf(theta);
+			return q1 * std::cos(theta) + q3 * std::sin(theta);
 		}
 
 		// Convert to rotation matrix
@@ -822,6 +954,15 @@ namespace mathLib {
 	}
 
 	 Matrix PerPro(float width, float height, float fov, float farZ, float nearZ);
+
+	// 批量点运算 (structure-of-arrays), 每次处理 4 个点, 实现在 mathLib.cpp
+	// out = m * (x, y, z, 1), 输出数组可以与输入数组相同
+	void transformPointsSoA(const Matrix& m, const float* xs, const float* ys, const float* zs,
+		float* outX, float* outY, float* outZ, int count);
+	// SoA 点集的包围盒; count 为 0 时 outMin = FLT_MAX, outMax = -FLT_MAX
+	void boundsSoA(const float* xs, const float* ys, const float* zs, int count, Vec3& outMin, Vec3& outMax);
+	// 交错顶点数组 (AoS) 的包围盒, positions 指向第一个顶点的位置, stride 为顶点字节数
+	void boundsStrided(const void* positions, int stride, int count, Vec3& outMin, Vec3& outMax);
 	//Matrix PerPro(float height, float width, float radians, float Far, float Near) {
 	//	Matrix PerPro;
 	//	float aspectRatio = width / height;
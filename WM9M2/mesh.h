@@ -2,10 +2,13 @@
 #include <d3d11.h>
 #include "shader.h"
 #include "GEMLoader.h"
+#include "GEMPack.h"
 #include "texture.h"
 #include "camera.h"
 
 #include "collision.h"
+#include <map>
+#include <memory>
 
 #ifndef NOMINMAX
 #define NOMINMAX
@@ -37,6 +40,10 @@ struct ANIMATED_VERTEX
 	float boneWeights[4];
 };
 
+// Buffers are created straight from the file's vertex data, so the layouts have to match
+static_assert(sizeof(STATIC_VERTEX) == sizeof(GEMLoader::GEMStaticVertex), "STATIC_VERTEX must match GEMStaticVertex");
+static_assert(sizeof(ANIMATED_VERTEX) == sizeof(GEMLoader::GEMAnimatedVertex), "ANIMATED_VERTEX must match GEMAnimatedVertex");
+
 void SaveMatrixToFile(int i, std::string name) {
 	std::ofstream debugFile("debug_output.txt"); // Open file in append mode
 	debugFile << name << "      ";
@@ -104,12 +111,12 @@ public:
 
 class Mesh {
 public:
-	ID3D11Buffer* indexBuffer;
-	ID3D11Buffer* vertexBuffer;
+	ID3D11Buffer* indexBuffer = nullptr;
+	ID3D11Buffer* vertexBuffer = nullptr;
 	int indicesSize;
 	UINT strides;
 
-	void Init(void* vertices, int vertexSizeInBytes, int numVertices, unsigned int* indices, int numIndices, DxCore& device) {
+	void Init(const void* vertices, int vertexSizeInBytes, int numVertices, const unsigned int* indices, int numIndices, DxCore& device) {
 		D3D11_BUFFER_DESC bd;
 		memset(&bd, 0, sizeof(D3D11_BUFFER_DESC));
 		bd.Usage = D3D11_USAGE_DEFAULT;
@@ -138,13 +145,20 @@ public:
 	}
 
 
-	void draw(DxCore& devicecontext) {
+	void draw(DxCore& devicecontext) const {
 		UINT offsets = 0;
 		devicecontext.devicecontext->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
 		devicecontext.devicecontext->IASetVertexBuffers(0, 1, &vertexBuffer, &strides, &offsets);
 		devicecontext.devicecontext->IASetIndexBuffer(indexBuffer, DXGI_FORMAT_R32_UINT, 0);
 		devicecontext.devicecontext->DrawIndexed(indicesSize, 0, 0);
 	}
+
+	void free() {
+		if (indexBuffer) indexBuffer->Release();
+		if (vertexBuffer) vertexBuffer->Release();
+		indexBuffer = nullptr;
+		vertexBuffer = nullptr;
+	}
 };
 
 class Plane {
@@ -200,74 +214,178 @@ public:
 
 
 
-class LoadMesh {
+// Buffers, bounds and texture names of one GEM file. Not changed once built, so every LoadMesh
+// placed from the file draws from the same one; the buffers are released with the last of them.
+class StaticModel {
 public:
 	std::vector<Mesh> meshes;
-	mathLib::Matrix planeWorld;
 	std::vector<std::string> textureFilenames;
 	float baseLift = 0.0f;
-	float t = 0.0f;
 
 	// Local space AABB (before world matrix/ground lift transformation)
 	AABB localAABB;
 
-	void Init(DxCore& core, std::string filename, TextureManager& textures) {
-		planeWorld.identity();
+	size_t bufferBytes = 0;  // vertex and index data uploaded for it
+
+	StaticModel() {}
+	StaticModel(const StaticModel&) = delete;
+	StaticModel& operator=(const StaticModel&) = delete;
+
+	~StaticModel() {
+		for (Mesh& mesh : meshes) {
+			mesh.free();
+		}
+	}
 
-		GEMLoader::GEMModelLoader loader;
-		std::vector<GEMLoader::GEMMesh> gemmeshes;
-		loader.load(filename, gemmeshes);
+	// Triangles of every mesh in the pack; touches no D3D state
+	static void buildCollisionShape(const GEMLoader::GEMPack& pack, TriangleMeshShape& shape) {
+		const GEMLoader::GEMPackHeader& info = pack.info();
+		for (int i = 0; i < (int)info.meshCount; ++i) {
+			const GEMLoader::GEMPackMesh& packMesh = pack.mesh(i);
+			if (packMesh.vertexCount == 0) continue;
+			shape.addTriangles(pack.vertices(i), sizeof(GEMLoader::GEMStaticVertex), (int)packMesh.vertexCount,
+				pack.indices(i), (int)packMesh.indexCount);
+		}
+		shape.build();
+	}
 
-		float modelMinY = FLT_MAX;
+	// Bounds, lift, GPU buffers and texture names from a loaded pack. Textures are not loaded.
+	void createBuffers(DxCore& core, const GEMLoader::GEMPack& pack) {
+		const GEMLoader::GEMPackHeader& info = pack.info();
 
-		// Initialize local AABB
+		// Local AABB and uniform lift to y=0, precomputed by the cook
 		localAABB = AABB();
+		if (info.boundsMin[0] <= info.boundsMax[0]) {
+			localAABB = AABB(mathLib::Vec3(info.boundsMin[0], info.boundsMin[1], info.boundsMin[2]),
+				mathLib::Vec3(info.boundsMax[0], info.boundsMax[1], info.boundsMax[2]));
+		}
+		baseLift = info.baseLift;
 
-		for (int i = 0; i < (int)gemmeshes.size(); ++i) {
-			std::vector<STATIC_VERTEX> vertices;
-			vertices.reserve(gemmeshes[i].verticesStatic.size());
+		for (int i = 0; i < (int)info.meshCount; ++i) {
+			const GEMLoader::GEMPackMesh& packMesh = pack.mesh(i);
+			Mesh mesh;
+			mesh.Init(pack.vertices(i), sizeof(STATIC_VERTEX), (int)packMesh.vertexCount, pack.indices(i), (int)packMesh.indexCount, core);
+			meshes.push_back(mesh);
+			textureFilenames.push_back(pack.string(packMesh.diffuse));
+			bufferBytes += (size_t)packMesh.vertexCount * sizeof(STATIC_VERTEX) + (size_t)packMesh.indexCount * sizeof(unsigned int);
+		}
+	}
+};
 
-			for (int j = 0; j < (int)gemmeshes[i].verticesStatic.size(); ++j) {
-				STATIC_VERTEX v;
-				std::memcpy(&v, &gemmeshes[i].verticesStatic[j], sizeof(STATIC_VERTEX));
-				vertices.push_back(v);
+// One StaticModel per file, keyed on the path it was loaded from. The cache keeps every model it
+// made until it is destroyed; instances keep theirs alive after that.
+class ModelCache {
+public:
+	std::map<std::string, std::shared_ptr<const StaticModel>> models;
+	int loads = 0;           // files read and uploaded
+	int hits = 0;            // placements that reused one of them
+	size_t bytesSaved = 0;   // buffer bytes those placements did not upload again
+
+	std::shared_ptr<const StaticModel> find(const std::string& name) const {
+		auto it = models.find(name);
+		if (it != models.end()) {
+			return it->second;
+		}
+		return nullptr;
+	}
 
-				if (v.pos.y < modelMinY) modelMinY = v.pos.y;
+	// find() for a new placement; counts the reuse
+	std::shared_ptr<const StaticModel> acquire(const std::string& name) {
+		std::shared_ptr<const StaticModel> model = find(name);
+		if (model) {
+			hits++;
+			bytesSaved += model->bufferBytes;
+		}
+		return model;
+	}
 
-				// Accumulate to local AABB
-				localAABB.expand(v.pos);
-			}
+	// Registers the model built from pack under name; an empty model if pack is null, so a missing
+	// file is only reported once
+	std::shared_ptr<const StaticModel> add(DxCore& core, const std::string& name, const GEMLoader::GEMPack* pack) {
+		std::shared_ptr<StaticModel> model = std::make_shared<StaticModel>();
+		if (pack) {
+			model->createBuffers(core, *pack);
+		}
+		models[name] = model;
+		loads++;
+		return model;
+	}
 
-			Mesh mesh;
-			mesh.Init(vertices, gemmeshes[i].indices, core);
-			meshes.push_back(mesh);
+	// The model for filename, loading it and its textures on first use. The collision shape is
+	// built from the same pack if a cache is given and does not have it yet.
+	std::shared_ptr<const StaticModel> load(DxCore& core, const std::string& filename, TextureManager& textures, CollisionShapeCache* collisionShapes = nullptr) {
+		std::shared_ptr<const StaticModel> model = acquire(filename);
+		bool needShape = collisionShapes && !collisionShapes->find(filename);
+		if (model && !needShape) return model;
+
+		// The cooked pack already holds bounds, lift and texture paths, and its vertex blobs are
+		// uploaded straight from the mapping
+		GEMLoader::GEMPack pack;
+		bool opened = pack.openOrCook(filename);
+
+		// Only the first instance of a file pays for the triangle BVH
+		if (opened && needShape) {
+			StaticModel::buildCollisionShape(pack, *collisionShapes->create(filename));
+		}
+		if (model) return model;
 
-			textureFilenames.push_back(gemmeshes[i].material.find("diffuse").getValue());
-			textures.loadTexture(textureFilenames.back(), &core);
+		model = add(core, filename, opened ? &pack : nullptr);
+		for (const std::string& name : model->textureFilenames) {
+			textures.loadTexture(name, &core);
 		}
+		return model;
+	}
+};
 
-		// Uniform lift to y=0
-		baseLift = -modelMinY;
+// One placement of a model: the shared buffers plus its own transform
+class LoadMesh {
+public:
+	std::shared_ptr<const StaticModel> model;
+	mathLib::Matrix planeWorld;
+	float t = 0.0f;
+
+	// Triangle collider shared by every instance of the same file; null unless a cache was given
+	const TriangleMeshShape* collisionShape = nullptr;
+
+	// Places filename, loading it only if the cache does not have it yet
+	void Init(DxCore& core, std::string filename, TextureManager& textures, ModelCache& models, CollisionShapeCache* collisionShapes = nullptr) {
+		planeWorld.identity();
+		model = models.load(core, filename, textures, collisionShapes);
+		collisionShape = collisionShapes ? collisionShapes->find(filename) : nullptr;
+	}
+
+	// Loads filename into a model of its own
+	void Init(DxCore& core, std::string filename, TextureManager& textures, CollisionShapeCache* collisionShapes = nullptr) {
+		ModelCache own;
+		Init(core, filename, textures, own, collisionShapes);
 	}
 
 	void translate(mathLib::Vec3 v) { planeWorld = planeWorld * mathLib::Matrix::translation(v); }
 	void scale(mathLib::Vec3 v) { planeWorld = planeWorld * mathLib::Matrix::scaling(v); }
 
-	// Get world space AABB (consistent with draw() method's W matrix)
+	// Same matrix draw() uses. Until Init (or the loader) has set model there is no lift, no
+	// bounds and nothing to draw, so the three calls below are safe on an empty LoadMesh.
+	mathLib::Matrix getWorldMatrix() const {
+		if (!model) return planeWorld;
+		mathLib::Matrix lift = mathLib::Matrix::translation({ 0, model->baseLift, 0 });
+		return lift * planeWorld;
+	}
+
+	// Get world space AABB (consistent with draw() method's W matrix); empty without a model
 	AABB getWorldAABB() const {
-		mathLib::Matrix lift = mathLib::Matrix::translation({ 0, baseLift, 0 });
-		mathLib::Matrix W_final = lift * planeWorld;
-		return localAABB.transform(W_final);
+		if (!model) return AABB();
+		return model->localAABB.transform(getWorldMatrix());
 	}
 
 	void draw(Shader* shader, DxCore& core, TextureManager& textures, const mathLib::Matrix& VP) {
-		for (int i = 0; i < (int)meshes.size(); ++i) {
-			mathLib::Matrix W_final = mathLib::Matrix::translation({ 0, baseLift, 0 }) * planeWorld;
+		if (!model) return;
+		for (int i = 0; i < (int)model->meshes.size(); ++i) {
+			mathLib::Matrix W_final = mathLib::Matrix::translation({ 0, model->baseLift, 0 }) * planeWorld;
 			shader->updateConstantVS("StaticModel", "staticMeshBuffer", "W", &W_final);
 			shader->updateConstantVS("StaticModel", "staticMeshBuffer", "VP", &VP);
-			shader->updateTexturePS(core, "tex", textures.find(textureFilenames[i]));
+			shader->updateTexturePS(core, "tex", textures.find(model->textureFilenames[i]));
 			shader->apply(core);
-			meshes[i].draw(core);
+			model->meshes[i].draw(core);
 		}
 	}
 };
@@ -3,6 +3,7 @@
 #include "animation.h"
 #include "collision.h"
 #include <string>
+#include <vector>
 
 // T-Rex Player Controller with Collision
 class TRexPlayer {
@@ -20,11 +21,13 @@ public:
     float boundingBoxWidth;
     float boundingBoxHeight;
     float boundingBoxDepth;
+    CharacterController controller;  // capsule used for movement when a collision world is given
 
     TRexPlayer(const mathLib::Vec3& startPos = mathLib::Vec3(0, 0, 0), float moveSpeed = 8.0f)
         : position(startPos), velocity(0, 0, 0), speed(moveSpeed),
         rotationY(0), model(nullptr), currentAnimation("Idle"), isMoving(false),
-        boundingBoxWidth(2.0f), boundingBoxHeight(3.0f), boundingBoxDepth(4.0f) {
+        boundingBoxWidth(2.0f), boundingBoxHeight(3.0f), boundingBoxDepth(4.0f),
+        controller(startPos, 1.0f, 3.0f) {
         updateBoundingBox();
     }
 
@@ -33,6 +36,47 @@ public:
     }
 
     void update(const mathLib::Vec3& moveDirection, float dt, CollisionWorld* collisionWorld = nullptr) {
+        mathLib::Vec3 walk = steer(moveDirection, dt);
+
+        // Check collision if collision world exists
+        if (collisionWorld) {
+            // The capsule slides along walls, climbs small steps and follows the ground. Standing
+            // still still needs gravity and the ground probe.
+            controller.position = position;
+            controller.move(*collisionWorld, walk, dt);
+            position = controller.position;
+            updateBoundingBox();
+        }
+        else if (isMoving) {
+            position = position + walk;
+            position.y = 0.0f;  // Keep on ground
+            updateBoundingBox();
+        }
+    }
+
+    // Updates a herd of actors at once: steering runs in order, the collision moves run on the
+    // job system against the world as it was at the start of the call. objectIds, when given,
+    // are the actors' own boxes in the world and are moved to the new capsules afterwards; set
+    // controller.collideWithDynamic for the actors to block each other.
+    static void updateHerd(TRexPlayer** actors, const mathLib::Vec3* moveDirections, const int* objectIds,
+        int count, float dt, CollisionWorld& collisionWorld, JobSystem* jobs = nullptr) {
+        std::vector<CharacterMove> moves(count);
+        for (int i = 0; i < count; i++) {
+            TRexPlayer& actor = *actors[i];
+            moves[i].walk = actor.steer(moveDirections[i], dt);
+            moves[i].controller = &actor.controller;
+            moves[i].objectId = objectIds ? objectIds[i] : -1;
+            actor.controller.position = actor.position;
+        }
+        moveCharacters(collisionWorld, moves.data(), count, dt, jobs);
+        for (int i = 0; i < count; i++) {
+            actors[i]->position = actors[i]->controller.position;
+            actors[i]->updateBoundingBox();
+        }
+    }
+
+    // Turns towards moveDirection and picks the animation; returns this frame's walk
+    mathLib::Vec3 steer(const mathLib::Vec3& moveDirection, float dt) {
         // Create non-const copy for getLengthSquare() which is not const
         mathLib::Vec3 moveDir = moveDirection;
 
@@ -48,42 +92,16 @@ public:
             rotationY += rotationDiff * 10.0f * dt;
 
             // Calculate velocity
-            mathLib::Vec3 vel = moveDir * speed;
-            velocity = vel;
-
-            // Calculate new position
-            mathLib::Vec3 newPosition = position + vel * dt;
-
-            // Check collision if collision world exists
-            if (collisionWorld) {
-                // Create AABB at new position
-                AABB newBox = boundingBox;
-                mathLib::Vec3 offset = newPosition - position;
-                newBox.minPoint = newBox.minPoint + offset;  
-                newBox.maxPoint = newBox.maxPoint + offset;  
-
-                // Check and resolve collisions
-                mathLib::Vec3 responseVel = collisionWorld->checkCollision(newBox, vel);
-
-                // Apply collision response
-                if (responseVel.x != vel.x || responseVel.z != vel.z) {
-                    // Collision detected, use sliding response
-                    newPosition = position + responseVel * dt;
-                }
-            }
-
-            position = newPosition;
-            position.y = 0.0f;  // Keep on ground
-
-            updateBoundingBox();
+            velocity = moveDir * speed;
 
             isMoving = true;
             currentAnimation = "Run";
+            return velocity * dt;
         }
-        else {
-            isMoving = false;
-            currentAnimation = "Idle";
-        }
+
+        isMoving = false;
+        currentAnimation = "Idle";
+        return mathLib::Vec3(0, 0, 0);
     }
 
     void updateBoundingBox() {
@@ -28,6 +28,38 @@ public:
 	}
 };
 
+// Decoded pixels, ready for Texture::upload. Decoding touches no D3D state, so it can run on any thread.
+struct TextureData {
+	int width = 0;
+	int height = 0;
+	int channels = 0;
+	std::vector<unsigned char> texels;
+
+	bool decode(const std::string& filename) {
+		unsigned char* pixels = stbi_load(filename.c_str(), &width, &height, &channels, 0);
+		if (pixels == nullptr) {
+			return false;
+		}
+
+		if (channels == 3) {
+			// D3D has no 24-bit format, so expand to RGBA
+			texels.resize((size_t)width * height * 4);
+			for (int i = 0; i < (width * height); i++) {
+				texels[i * 4] = pixels[i * 3];
+				texels[(i * 4) + 1] = pixels[(i * 3) + 1];
+				texels[(i * 4) + 2] = pixels[(i * 3) + 2];
+				texels[(i * 4) + 3] = 255;
+			}
+			channels = 4;
+		}
+		else {
+			texels.assign(pixels, pixels + (size_t)width * height * channels);
+		}
+		stbi_image_free(pixels);
+		return true;
+	}
+};
+
 class Texture {
 public:
 	ID3D11Texture2D* texture;
@@ -65,42 +97,27 @@ public:
 	void load(std::string filename, DxCore* dxcore, bool isNormalMap = false) {
 		std::cout << "Attempting to load texture: " << filename << std::endl;
 
-		int width = 0;
-		int height = 0;
-		int channels = 0;
-		unsigned char* texels = stbi_load(filename.c_str(), &width, &height, &channels, 0);
-
-		if (texels == nullptr) {
+		TextureData data;
+		if (!data.decode(filename)) {
 			std::cout << "Failed to load texture file: " << filename << std::endl;
 			srv = nullptr;
 			return;
 		}
+		upload(filename, data, dxcore, isNormalMap);
+	}
 
+	// GPU half of load(); call on the thread that owns the device context
+	void upload(const std::string& filename, const TextureData& data, DxCore* dxcore, bool isNormalMap = false) {
 		std::cout << "Successfully loaded: " << filename
-			<< " (" << width << "x" << height << ", " << channels << " channels)" << std::endl;
+			<< " (" << data.width << "x" << data.height << ", " << data.channels << " channels)" << std::endl;
 
 		// Choose appropriate format
 		DXGI_FORMAT format = isNormalMap ? DXGI_FORMAT_R8G8B8A8_UNORM : DXGI_FORMAT_R8G8B8A8_UNORM_SRGB;
 
-		if (channels == 3) {
-			channels = 4;
-			unsigned char* texelsWithAlpha = new unsigned char[width * height * channels];
-			for (int i = 0; i < (width * height); i++) {
-				texelsWithAlpha[i * 4] = texels[i * 3];
-				texelsWithAlpha[(i * 4) + 1] = texels[(i * 3) + 1];
-				texelsWithAlpha[(i * 4) + 2] = texels[(i * 3) + 2];
-				texelsWithAlpha[(i * 4) + 3] = 255;
-			}
-			init(dxcore, width, height, channels, texelsWithAlpha, format);
-			delete[] texelsWithAlpha;
-		}
-		else {
-			init(dxcore, width, height, channels, texels, format);
-		}
+		init(dxcore, data.width, data.height, data.channels, const_cast<unsigned char*>(data.texels.data()), format);
 
 		sampler.init(*dxcore);
 		sampler.bind(*dxcore);
-		stbi_image_free(texels);
 
 		if (srv == nullptr) {
 			std::cerr << "Error: SRV not created for " << filename << std::endl;
@@ -164,17 +181,27 @@ public:
 
 
 
-	// Load normal texture based on base texture name
-	void loadNormalTexture(const std::string& baseTextureName, DxCore* core) {
-		// Construct normal map filename from base texture name
-		std::string normalFileName;
+	// Textures uploaded elsewhere (the async loader); the manager takes ownership
+	void addTexture(const std::string& filename, Texture* texture) {
+		textures.insert({ filename, texture });
+	}
+
+	bool contains(const std::string& filename) const {
+		return textures.find(filename) != textures.end();
+	}
+
+	// Normal map filename for a base texture name
+	static std::string normalMapName(const std::string& baseTextureName) {
 		size_t lastDot = baseTextureName.find_last_of('.');
 		if (lastDot != std::string::npos) {
-			normalFileName = baseTextureName.substr(0, lastDot) + "_Normal" + baseTextureName.substr(lastDot);
-		}
-		else {
-			normalFileName = baseTextureName + "_Normal";
+			return baseTextureName.substr(0, lastDot) + "_Normal" + baseTextureName.substr(lastDot);
 		}
+		return baseTextureName + "_Normal";
+	}
+
+	// Load normal texture based on base texture name
+	void loadNormalTexture(const std::string& baseTextureName, DxCore* core) {
+		std::string normalFileName = normalMapName(baseTextureName);
 
 		if (textures.find(normalFileName) == textures.end()) {
 			Texture* texture = new Texture();
@@ -199,15 +226,7 @@ public:
 
 	// Find normal map, return default if not found
 	ID3D11ShaderResourceView* findNormalMap(std::string baseName) {
-		// Construct actual normal map filename
-		std::string normalFileName;
-		size_t lastDot = baseName.find_last_of('.');
-		if (lastDot != std::string::npos) {
-			normalFileName = baseName.substr(0, lastDot) + "_Normal" + baseName.substr(lastDot);
-		}
-		else {
-			normalFileName = baseName + "_Normal";
-		}
+		std::string normalFileName = normalMapName(baseName);
 
 		auto it = textures.find(normalFileName);
 		if (it != textures.end()) {